@@ -31,8 +31,60 @@ THE SOFTWARE.
 #include <sstream>
 #include <fstream>
 #include <stack>
+#include <set>
+#include <map>
 #include <algorithm>
 #include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <limits>
+
+#if __cplusplus >= 201103L
+#	include <thread>
+#	include <mutex>
+#	include <atomic>
+#	include <deque>
+#	define JZON_THREADS
+#endif
+
+#if (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) || defined(_M_X64) || defined(_M_IX86)
+#	define JZON_LITTLE_ENDIAN
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#	include <fcntl.h>
+#	include <unistd.h>
+#	include <sys/stat.h>
+#	include <sys/mman.h>
+#	define JZON_POSIX_FILES
+#endif
+
+#if defined(__linux__)
+#	include <sys/inotify.h>
+#	define JZON_INOTIFY
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#	include <emmintrin.h>
+#	define JZON_SSE2
+#	ifdef _MSC_VER
+#		include <intrin.h>
+#	endif
+#endif
+
+#ifdef JZON_ENABLE_STATS
+#	if __cplusplus >= 201103L
+#		include <chrono>
+#	else
+#		include <ctime>
+#	endif
+#	define JZON_STAT(x) x
+#	define JZON_TRACE(phase, begin) if (traceHook != NULL) traceHook(phase, begin, traceUserData)
+#else
+#	define JZON_STAT(x)
+#	define JZON_TRACE(phase, begin)
+#endif
 
 namespace Jzon
 {
@@ -47,20 +99,6 @@ namespace Jzon
 		const char *charsEscaped[]  = { "\\\\", "\\/", "\\\"", "\\n", "\\t", "\\b", "\\f", "\\r" };
 		const unsigned int numEscapeChars = 8;
 		const char nullUnescaped = '\0';
-		const char *nullEscaped  = "\0\0";
-		const char *getEscaped(const char c)
-		{
-			for (unsigned int i = 0; i < numEscapeChars; ++i)
-			{
-				const char &ue = charsUnescaped[i];
-
-				if (c == ue)
-				{
-					return charsEscaped[i];
-				}
-			}
-			return nullEscaped;
-		}
 		char getUnescaped(const char c1, const char c2)
 		{
 			for (unsigned int i = 0; i < numEscapeChars; ++i)
@@ -74,954 +112,6888 @@ namespace Jzon
 			}
 			return nullUnescaped;
 		}
-	}
 
-	Node::Node() : data(NULL)
-	{
-	}
-	Node::Node(Type type) : data(NULL)
-	{
-		if (type != T_INVALID)
-		{
-			data = new Data(type);
-		}
-	}
-	Node::Node(const Node &other) : data(other.data)
-	{
-		if (data != NULL)
+#ifdef JZON_SSE2
+		inline unsigned int countTrailingZeros(unsigned int mask)
 		{
-			data->addRef();
+#	ifdef _MSC_VER
+			unsigned long index;
+			_BitScanForward(&index, mask);
+			return index;
+#	else
+			return __builtin_ctz(mask);
+#	endif
 		}
-	}
-	Node::Node(Type type, const std::string &value) : data(new Data(T_NULL)) { set(type, value); }
-	Node::Node(const std::string &value) : data(new Data(T_STRING)) { set(value); }
-	Node::Node(const char *value) : data(new Data(T_STRING)) { set(value); }
-	Node::Node(int value) : data(new Data(T_NUMBER)) { set(value); }
-	Node::Node(unsigned int value) : data(new Data(T_NUMBER)) { set(value); }
-	Node::Node(long long value) : data(new Data(T_NUMBER)) { set(value); }
-	Node::Node(unsigned long long value) : data(new Data(T_NUMBER)) { set(value); }
-	Node::Node(float value) : data(new Data(T_NUMBER)) { set(value); }
-	Node::Node(double value) : data(new Data(T_NUMBER)) { set(value); }
-	Node::Node(bool value) : data(new Data(T_BOOL)) { set(value); }
-	Node::~Node()
-	{
-		if (data != NULL && data->release())
+#endif
+
+		// Skips ASCII characters that don't end or escape a string
+		const char *skipPlainString(const char *it, const char *end)
 		{
-			delete data;
-			data = NULL;
+#ifdef JZON_SSE2
+			const __m128i quote = _mm_set1_epi8('"');
+			const __m128i backslash = _mm_set1_epi8('\\');
+			while (end - it >= 16)
+			{
+				const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(it));
+				const __m128i special = _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash));
+				// The sign bit is set for anything outside of ASCII
+				const unsigned int mask = static_cast<unsigned int>(_mm_movemask_epi8(special) | _mm_movemask_epi8(chunk));
+				if (mask != 0)
+				{
+					return it + countTrailingZeros(mask);
+				}
+				it += 16;
+			}
+#endif
+			while (it != end && *it != '"' && *it != '\\' && static_cast<unsigned char>(*it) < 0x80)
+			{
+				++it;
+			}
+			return it;
 		}
-	}
-
-	void Node::detach()
-	{
-		if (data != NULL && data->refCount > 1)
+		const char *skipAscii(const char *it, const char *end)
 		{
-			Data *newData = new Data(*data);
-			if (data->release())
+#ifdef JZON_SSE2
+			while (end - it >= 16)
 			{
-				delete data;
+				const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(it));
+				const unsigned int mask = static_cast<unsigned int>(_mm_movemask_epi8(chunk));
+				if (mask != 0)
+				{
+					return it + countTrailingZeros(mask);
+				}
+				it += 16;
 			}
-			data = newData;
+#endif
+			while (it != end && static_cast<unsigned char>(*it) < 0x80)
+			{
+				++it;
+			}
+			return it;
 		}
-	}
 
-	std::string Node::toString(const std::string &def) const
-	{
-		if (isValue())
+		inline bool needsEscape(char c)
 		{
-			if (isNull())
+			return (c == '"' || c == '\\' || c == '/' || static_cast<unsigned char>(c) < 0x20);
+		}
+		// Skips characters that are written into strings as they are
+		const char *skipUnescaped(const char *it, const char *end)
+		{
+#ifdef JZON_SSE2
+			const __m128i quote = _mm_set1_epi8('"');
+			const __m128i backslash = _mm_set1_epi8('\\');
+			const __m128i slash = _mm_set1_epi8('/');
+			const __m128i control = _mm_set1_epi8(0x1F);
+			while (end - it >= 16)
 			{
-				return std::string("null");
+				const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(it));
+				__m128i special = _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash));
+				special = _mm_or_si128(special, _mm_cmpeq_epi8(chunk, slash));
+				// Bytes up to 0x1F, compared unsigned
+				special = _mm_or_si128(special, _mm_cmpeq_epi8(_mm_min_epu8(chunk, control), chunk));
+				const unsigned int mask = static_cast<unsigned int>(_mm_movemask_epi8(special));
+				if (mask != 0)
+				{
+					return it + countTrailingZeros(mask);
+				}
+				it += 16;
 			}
-			else
+#endif
+			while (it != end && !needsEscape(*it))
 			{
-				return data->valueStr;
+				++it;
 			}
+			return it;
 		}
-		else
+		// Writes the escape sequence for a character that needs one, returns its length
+		size_t escapeChar(char c, char *buffer)
 		{
-			return def;
+			for (unsigned int i = 0; i < numEscapeChars; ++i)
+			{
+				if (c == charsUnescaped[i])
+				{
+					buffer[0] = charsEscaped[i][0];
+					buffer[1] = charsEscaped[i][1];
+					return 2;
+				}
+			}
+			static const char hexDigits[] = "0123456789abcdef";
+			buffer[0] = '\\';
+			buffer[1] = 'u';
+			buffer[2] = '0';
+			buffer[3] = '0';
+			buffer[4] = hexDigits[(c >> 4) & 0xF];
+			buffer[5] = hexDigits[c & 0xF];
+			return 6;
 		}
-	}
-#define GET_NUMBER(T) \
-	if (isNumber())\
-	{\
-		std::stringstream sstr(data->valueStr);\
-		T val;\
-		sstr >> val;\
-		return val;\
-	}\
-	else\
-	{\
-		return def;\
-	}
-	int Node::toInt(int def) const { GET_NUMBER(int) }
-	float Node::toFloat(float def) const { GET_NUMBER(float) }
-	double Node::toDouble(double def) const { GET_NUMBER(double) }
-#undef GET_NUMBER
-	bool Node::toBool(bool def) const
-	{
-		if (isBool())
+		// Writes the string escaped and in quotes, copying the runs between
+		// escaped characters in one go. Adds the bytes added by escaping to escapes.
+		void writeQuoted(std::ostream &stream, const char *it, const char *end, size_t &escapes)
 		{
-			return (data->valueStr == "true");
+			stream.put('"');
+			for (;;)
+			{
+				const char *run = skipUnescaped(it, end);
+				stream.write(it, run - it);
+				if (run == end)
+				{
+					break;
+				}
+				char buffer[6];
+				const size_t length = escapeChar(*run, buffer);
+				stream.write(buffer, static_cast<std::streamsize>(length));
+				escapes += length - 1;
+				it = run + 1;
+			}
+			stream.put('"');
 		}
-		else
+		void writeQuoted(std::ostream &stream, const std::string &value, size_t &escapes)
 		{
-			return def;
+			writeQuoted(stream, value.data(), value.data() + value.size(), escapes);
 		}
-	}
-
-	void Node::setNull()
-	{
-		if (isValue())
+		void writeQuoted(std::ostream &stream, const std::string &value)
 		{
-			detach();
-			data->type = T_NULL;
-			data->valueStr.clear();
+			size_t escapes = 0;
+			writeQuoted(stream, value, escapes);
 		}
-	}
-	void Node::set(Type type, const std::string &value)
-	{
-		if (isValue() && (type == T_NULL || type == T_STRING || type == T_NUMBER || type == T_BOOL))
+
+		// Returns the length of the UTF-8 sequence at it, or 0 if it's invalid
+		size_t utf8SequenceLength(const char *it, const char *end)
 		{
-			detach();
-			data->type = type;
-			if (type == T_STRING)
+			const unsigned char *p = reinterpret_cast<const unsigned char*>(it);
+			const size_t available = end - it;
+
+			if (p[0] < 0x80)
+				return 1;
+
+			size_t length;
+			unsigned char low = 0x80, high = 0xBF; // Allowed range of the second byte
+			if (p[0] >= 0xC2 && p[0] <= 0xDF)
 			{
-				data->valueStr = unescapeString(value);
+				length = 2;
+			}
+			else if (p[0] >= 0xE0 && p[0] <= 0xEF)
+			{
+				length = 3;
+				if (p[0] == 0xE0)
+					low = 0xA0; // Overlong
+				else if (p[0] == 0xED)
+					high = 0x9F; // Surrogates
+			}
+			else if (p[0] >= 0xF0 && p[0] <= 0xF4)
+			{
+				length = 4;
+				if (p[0] == 0xF0)
+					low = 0x90; // Overlong
+				else if (p[0] == 0xF4)
+					high = 0x8F; // Above U+10FFFF
 			}
 			else
 			{
-				data->valueStr = value;
+				return 0;
+			}
+
+			if (available < length || p[1] < low || p[1] > high)
+				return 0;
+			for (size_t i = 2; i < length; ++i)
+			{
+				if ((p[i] & 0xC0) != 0x80)
+					return 0;
 			}
+			return length;
 		}
-	}
-	void Node::set(const std::string &value)
-	{
-		if (isValue())
+
+		// lower must be lowercase
+		bool equalsIgnoreCase(const std::string &str, const char *lower)
 		{
-			detach();
-			data->type = T_STRING;
-			data->valueStr = unescapeString(value);
+			const size_t length = std::strlen(lower);
+			if (str.size() != length)
+				return false;
+			for (size_t i = 0; i < length; ++i)
+			{
+				if (tolower(str[i]) != lower[i])
+					return false;
+			}
+			return true;
 		}
-	}
-	void Node::set(const char *value)
-	{
-		if (isValue())
+
+		bool readHex4(const char *it, const char *end, unsigned int &value)
 		{
-			detach();
-			data->type = T_STRING;
-			data->valueStr = unescapeString(std::string(value));
+			if (end - it < 4)
+				return false;
+
+			value = 0;
+			for (int i = 0; i < 4; ++i)
+			{
+				const char c = it[i];
+				value <<= 4;
+				if (c >= '0' && c <= '9')
+					value |= (c - '0');
+				else if (c >= 'a' && c <= 'f')
+					value |= (c - 'a' + 10);
+				else if (c >= 'A' && c <= 'F')
+					value |= (c - 'A' + 10);
+				else
+					return false;
+			}
+			return true;
 		}
-	}
-#define SET_NUMBER \
-	if (isValue())\
-	{\
-		detach();\
-		data->type = T_NUMBER;\
-		std::stringstream sstr;\
-		sstr << value;\
-		data->valueStr = sstr.str();\
-	}
-	void Node::set(int value) { SET_NUMBER }
-	void Node::set(unsigned int value) { SET_NUMBER }
-	void Node::set(long long value) { SET_NUMBER }
-	void Node::set(unsigned long long value) { SET_NUMBER }
-	void Node::set(float value) { SET_NUMBER }
-	void Node::set(double value) { SET_NUMBER }
-#undef SET_NUMBER
-	void Node::set(bool value)
-	{
-		if (isValue())
+		inline bool isHighSurrogate(unsigned int c) { return (c >= 0xD800 && c <= 0xDBFF); }
+		inline bool isLowSurrogate(unsigned int c)  { return (c >= 0xDC00 && c <= 0xDFFF); }
+
+		// Reads the \uXXXX escape at it (and the low surrogate following it,
+		// if any) and returns the length of the escape, or 0 if it's invalid
+		size_t readUnicodeEscape(const char *it, const char *end, unsigned int &codePoint)
 		{
-			detach();
-			data->type = T_BOOL;
-			data->valueStr = (value ? "true" : "false");
+			if (!readHex4(it+2, end, codePoint) || isLowSurrogate(codePoint))
+				return 0;
+			if (!isHighSurrogate(codePoint))
+				return 6;
+
+			unsigned int low;
+			if (end - it < 12 || it[6] != '\\' || it[7] != 'u' || !readHex4(it+8, end, low) || !isLowSurrogate(low))
+				return 0;
+			codePoint = 0x10000 + ((codePoint - 0xD800) << 10) + (low - 0xDC00);
+			return 12;
 		}
-	}
+		// Returns the length of the escape sequence at it, or 0 if it's invalid
+		size_t escapeSequenceLength(const char *it, const char *end)
+		{
+			if (end - it < 2)
+				return 0;
 
-	Node &Node::operator=(const Node &rhs)
-	{
-		if (this != &rhs)
+			switch (it[1])
+			{
+			case '"': case '\\': case '/': case 'b': case 'f': case 'n': case 'r': case 't':
+				return 2;
+			case 'u':
+				{
+					unsigned int codePoint;
+					return readUnicodeEscape(it, end, codePoint);
+				}
+			default:
+				return 0;
+			}
+		}
+
+		void appendUtf8(std::string &str, unsigned int codePoint)
 		{
-			if (data != NULL && data->release())
+			if (codePoint < 0x80)
 			{
-				delete data;
+				str += static_cast<char>(codePoint);
 			}
-			data = rhs.data;
-			if (data != NULL)
+			else if (codePoint < 0x800)
 			{
-				data->addRef();
+				str += static_cast<char>(0xC0 | (codePoint >> 6));
+				str += static_cast<char>(0x80 | (codePoint & 0x3F));
+			}
+			else if (codePoint < 0x10000)
+			{
+				str += static_cast<char>(0xE0 | (codePoint >> 12));
+				str += static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F));
+				str += static_cast<char>(0x80 | (codePoint & 0x3F));
+			}
+			else
+			{
+				str += static_cast<char>(0xF0 | (codePoint >> 18));
+				str += static_cast<char>(0x80 | ((codePoint >> 12) & 0x3F));
+				str += static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F));
+				str += static_cast<char>(0x80 | (codePoint & 0x3F));
 			}
 		}
-		return *this;
-	}
-	Node &Node::operator=(const std::string &rhs) { set(rhs); return *this; }
-	Node &Node::operator=(const char *rhs) { set(rhs); return *this; }
-	Node &Node::operator=(int rhs) { set(rhs); return *this; }
-	Node &Node::operator=(unsigned int rhs) { set(rhs); return *this; }
-	Node &Node::operator=(long long rhs) { set(rhs); return *this; }
-	Node &Node::operator=(unsigned long long rhs) { set(rhs); return *this; }
-	Node &Node::operator=(float rhs) { set(rhs); return *this; }
-	Node &Node::operator=(double rhs) { set(rhs); return *this; }
-	Node &Node::operator=(bool rhs) { set(rhs); return *this; }
 
-	void Node::add(const Node &node)
-	{
-		if (isArray())
+		inline unsigned long long mixHash(unsigned long long h)
 		{
-			detach();
-			data->children.push_back(std::make_pair(std::string(), node));
+			h ^= (h >> 30);
+			h *= 0xbf58476d1ce4e5b9ULL;
+			h ^= (h >> 27);
+			h *= 0x94d049bb133111ebULL;
+			h ^= (h >> 31);
+			return h;
 		}
-	}
-	void Node::add(const std::string &name, const Node &node)
-	{
-		if (isObject())
+		unsigned long long hashString(const std::string &str)
 		{
-			detach();
-			data->children.push_back(std::make_pair(name, node));
+			unsigned long long h = 0xcbf29ce484222325ULL;
+			for (std::string::const_iterator it = str.begin(); it != str.end(); ++it)
+			{
+				h ^= static_cast<unsigned char>(*it);
+				h *= 0x100000001b3ULL;
+			}
+			return mixHash(h);
 		}
-	}
-	void Node::append(const Node &node)
-	{
-		if ((isObject() && node.isObject()) || (isArray() && node.isArray()))
+		unsigned long long hashNumber(double value)
 		{
-			detach();
-			data->children.insert(data->children.end(), node.data->children.begin(), node.data->children.end());
+			if (value == 0.0)
+				value = 0.0; // -0 == 0
+			unsigned long long bits = 0;
+			std::memcpy(&bits, &value, sizeof(value));
+			return mixHash(bits);
 		}
-	}
-	void Node::remove(size_t index)
-	{
-		if (isContainer() && index < data->children.size())
+
+		const double powersOf10[] = {
+			1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+			1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18
+		};
+
+		// Packed reals have at most this many significant digits, which is the
+		// most that is guaranteed to survive a round trip through a double
+		const size_t maxRealDigits = 15;
+		// At most 3 zeros after "0.", so the value is never below 1e-4
+		const size_t maxLeadingZeros = 3;
+		const size_t maxIntegerDigits = 18;
+
+		// Accumulates up to maxDigits digits, 8 at a time where possible
+		size_t readDigits(const char *&it, const char *end, unsigned long long &value, size_t maxDigits)
 		{
-			detach();
-			NamedNodeList::iterator it = data->children.begin()+index;
-			data->children.erase(it);
+			size_t count = 0;
+#ifdef JZON_LITTLE_ENDIAN
+			while (end - it >= 8 && count + 8 <= maxDigits)
+			{
+				unsigned long long chunk;
+				std::memcpy(&chunk, it, sizeof(chunk));
+				if ((((chunk & 0xF0F0F0F0F0F0F0F0ULL) | (((chunk + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4)) != 0x3333333333333333ULL))
+					break;
+				chunk = ((chunk & 0x0F0F0F0F0F0F0F0FULL) * 2561) >> 8;
+				chunk = ((chunk & 0x00FF00FF00FF00FFULL) * 6553601) >> 16;
+				chunk = ((chunk & 0x0000FFFF0000FFFFULL) * 42949672960001ULL) >> 32;
+				value = value * 100000000ULL + chunk;
+				count += 8;
+				it += 8;
+			}
+#endif
+			while (it != end && *it >= '0' && *it <= '9' && count < maxDigits)
+			{
+				value = value * 10 + static_cast<unsigned long long>(*it - '0');
+				++count;
+				++it;
+			}
+			return count;
 		}
-	}
-	void Node::remove(const std::string &name)
-	{
-		if (isObject())
+
+		enum PackedKind
 		{
-			detach();
-			NamedNodeList &children = data->children;
-			for (NamedNodeList::iterator it = children.begin(); it != children.end(); ++it)
+			PACKED_NONE,
+			PACKED_INTEGER,
+			PACKED_REAL
+		};
+		// Only numbers that formatPackedInteger() or formatPackedReal() writes
+		// back identically can be packed
+		PackedKind classifyNumber(const std::string &number, long long &integer, double &real)
+		{
+			const char *it = number.data();
+			const char *end = it + number.size();
+
+			const bool negative = (it != end && *it == '-');
+			if (negative)
+				++it;
+			if (it == end || (*it == '0' && end - it > 1 && it[1] != '.'))
+				return PACKED_NONE; // Empty or leading zero
+
+			unsigned long long mantissa = 0;
+			const size_t integerDigits = readDigits(it, end, mantissa, maxIntegerDigits+1);
+			if (integerDigits == 0 || integerDigits > maxIntegerDigits)
+				return PACKED_NONE;
+
+			if (it == end)
+			{
+				if (negative && mantissa == 0)
+					return PACKED_NONE; // -0
+				integer = (negative ? -static_cast<long long>(mantissa) : static_cast<long long>(mantissa));
+				return PACKED_INTEGER;
+			}
+
+			if (*it != '.' || integerDigits > maxRealDigits)
+				return PACKED_NONE;
+			++it;
+
+			// Reading one digit more than allowed makes the check below fail
+			const bool zeroIntegerPart = (mantissa == 0);
+			const char *fraction = it;
+			const size_t maxFractionDigits = (zeroIntegerPart ? maxRealDigits + maxLeadingZeros : maxRealDigits - integerDigits);
+			const size_t fractionDigits = readDigits(it, end, mantissa, maxFractionDigits+1);
+			if (it != end || fractionDigits == 0 || fractionDigits > maxFractionDigits || *(end-1) == '0')
+				return PACKED_NONE; // Exponent, too many digits or trailing zero
+
+			if (zeroIntegerPart)
+			{
+				size_t leadingZeros = 0;
+				while (fraction[leadingZeros] == '0')
+					++leadingZeros;
+				if (leadingZeros > maxLeadingZeros || fractionDigits - leadingZeros > maxRealDigits)
+					return PACKED_NONE;
+			}
+
+			// Both are exact, so the division is correctly rounded just like strtod()
+			real = static_cast<double>(mantissa) / powersOf10[fractionDigits];
+			if (negative)
+				real = -real;
+			return PACKED_REAL;
+		}
+
+		// Buffers passed to these need room for 32 chars
+		size_t formatPackedInteger(char *buffer, long long value)
+		{
+			char digits[24];
+			size_t count = 0;
+			unsigned long long magnitude = (value < 0 ? 0ULL - static_cast<unsigned long long>(value) : static_cast<unsigned long long>(value));
+			do
+			{
+				digits[count++] = static_cast<char>('0' + magnitude % 10);
+				magnitude /= 10;
+			} while (magnitude != 0);
+
+			size_t length = 0;
+			if (value < 0)
+				buffer[length++] = '-';
+			while (count > 0)
+				buffer[length++] = digits[--count];
+			return length;
+		}
+		size_t formatPackedReal(char *buffer, double value)
+		{
+			// The smallest scale that reproduces the value gives back the
+			// digits it was read from, see classifyNumber()
+			const size_t maxScale = maxRealDigits + maxLeadingZeros;
+			for (size_t scale = 0; scale <= maxScale; ++scale)
 			{
-				if ((*it).first == name)
+				const double scaled = value * powersOf10[scale];
+				if (scaled >= 1e15 || scaled <= -1e15)
+					continue;
+				const long long mantissa = static_cast<long long>(scaled < 0 ? scaled - 0.5 : scaled + 0.5);
+				if (static_cast<double>(mantissa) / powersOf10[scale] != value)
+					continue;
+
+				char digits[32];
+				size_t count = formatPackedInteger(digits, mantissa < 0 ? -mantissa : mantissa);
+				size_t length = 0;
+				if (value < 0)
+					buffer[length++] = '-';
+				if (scale == 0)
 				{
-					children.erase(it);
-					break;
+					std::memcpy(buffer+length, digits, count);
+					return length + count;
+				}
+				if (count <= scale)
+				{
+					// Pad to "0.000ddd"
+					const size_t padding = scale + 1 - count;
+					std::memmove(digits+padding, digits, count);
+					std::memset(digits, '0', padding);
+					count += padding;
 				}
+				std::memcpy(buffer+length, digits, count-scale);
+				length += count-scale;
+				buffer[length++] = '.';
+				std::memcpy(buffer+length, digits+count-scale, scale);
+				return length + scale;
 			}
+
+			std::ostringstream sstr;
+			sstr.precision(17);
+			sstr << value;
+			const std::string str = sstr.str();
+			std::memcpy(buffer, str.data(), str.size());
+			return str.size();
 		}
-	}
-	void Node::clear()
-	{
-		if (data != NULL && !data->children.empty())
+
+		// Plain integers that fit in 64 bits, as sign and magnitude
+		bool readExactInteger(const std::string &number, bool &negative, unsigned long long &magnitude)
 		{
-			detach();
-			data->children.clear();
+			negative = (!number.empty() && number[0] == '-');
+			magnitude = 0;
+			const size_t first = (negative ? 1 : 0);
+			if (number.size() == first)
+				return false;
+			for (size_t i = first; i < number.size(); ++i)
+			{
+				const char c = number[i];
+				if (c < '0' || c > '9')
+					return false; // Fraction or exponent
+				const unsigned int digit = static_cast<unsigned int>(c - '0');
+				if (magnitude > (~0ULL - digit) / 10)
+					return false;
+				magnitude = magnitude*10 + digit;
+			}
+			if (magnitude == 0)
+				negative = false; // -0
+			return true;
+		}
+		// Integers are compared exactly, since doubles lose them past 2^53
+		bool equalNumbers(const std::string &number1, const std::string &number2)
+		{
+			if (number1 == number2)
+				return true;
+			bool negative1, negative2;
+			unsigned long long magnitude1, magnitude2;
+			if (readExactInteger(number1, negative1, magnitude1) && readExactInteger(number2, negative2, magnitude2))
+				return (negative1 == negative2 && magnitude1 == magnitude2);
+			return (std::strtod(number1.c_str(), NULL) == std::strtod(number2.c_str(), NULL));
 		}
-	}
 
-	bool Node::has(const std::string &name) const
-	{
-		if (isObject())
+		// Reads a whole file using its size up front, instead of small stream reads
+		// With maxBytes, stops once more than that has been read, which is enough
+		// for the caller's size check to fail
+		bool readFile(const std::string &filename, std::string &json, size_t maxBytes = 0)
 		{
-			NamedNodeList &children = data->children;
-			for (NamedNodeList::const_iterator it = children.begin(); it != children.end(); ++it)
+			json.clear();
+#ifdef JZON_POSIX_FILES
+			const int fd = open(filename.c_str(), O_RDONLY);
+			if (fd < 0)
+			{
+				return false;
+			}
+
+			struct stat info;
+			size_t capacity = 4096;
+			if (fstat(fd, &info) == 0 && info.st_size > 0)
+			{
+				capacity = static_cast<size_t>(info.st_size) + 1; // +1 so that the last read sees the end
+			}
+#ifdef POSIX_FADV_SEQUENTIAL
+			posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+			size_t length = 0;
+			bool success = true;
+			for (;;)
 			{
-				if ((*it).first == name)
+				if (length == json.size())
 				{
-					return true;
+					json.resize(length < capacity ? capacity : length * 2);
+				}
+				const ssize_t count = read(fd, &json[length], json.size() - length);
+				if (count < 0)
+				{
+					success = false;
+					break;
+				}
+				else if (count == 0)
+				{
+					break;
+				}
+				length += static_cast<size_t>(count);
+				if (maxBytes != 0 && length > maxBytes)
+				{
+					break;
+				}
+			}
+			json.resize(length);
+			close(fd);
+			return success;
+#else
+			std::ifstream stream(filename.c_str(), std::ios::in | std::ios::binary);
+			if (!stream)
+			{
+				return false;
+			}
+			stream.seekg(0, std::ios::end);
+			const std::streamoff size = stream.tellg();
+			stream.seekg(0, std::ios::beg);
+			if (size > 0)
+			{
+				json.reserve(static_cast<size_t>(size));
+			}
+			char buffer[65536];
+			while (stream.read(buffer, sizeof(buffer)) || stream.gcount() > 0)
+			{
+				json.append(buffer, static_cast<size_t>(stream.gcount()));
+				if (maxBytes != 0 && json.size() > maxBytes)
+				{
+					break;
 				}
 			}
+			return true;
+#endif
 		}
-		return false;
-	}
-	size_t Node::getCount() const
-	{
-		return data != NULL ? data->children.size() : 0;
-	}
-	Node Node::get(const std::string &name) const
-	{
-		if (isObject())
+		// Whether the file is known to be larger, without reading it
+		bool fileLargerThan(const std::string &filename, size_t maxBytes)
+		{
+#ifdef JZON_POSIX_FILES
+			struct stat info;
+			return (stat(filename.c_str(), &info) == 0 && info.st_size > 0 && static_cast<unsigned long long>(info.st_size) > maxBytes);
+#else
+			std::ifstream stream(filename.c_str(), std::ios::in | std::ios::binary);
+			stream.seekg(0, std::ios::end);
+			const std::streamoff size = stream.tellg();
+			return (size > 0 && static_cast<unsigned long long>(size) > maxBytes);
+#endif
+		}
+
+		const unsigned long long wholeFile = static_cast<unsigned long long>(-1);
+
+		// A byte range of a file, mapped where possible and read otherwise
+		class FileRange
 		{
-			NamedNodeList &children = data->children;
-			for (NamedNodeList::const_iterator it = children.begin(); it != children.end(); ++it)
+		public:
+			FileRange() : data(""), length(0), fileSize(0), mapping(NULL), mappedLength(0)
 			{
-				if ((*it).first == name)
+			}
+			~FileRange()
+			{
+#ifdef JZON_POSIX_FILES
+				if (mapping != NULL)
+					munmap(mapping, mappedLength);
+#endif
+			}
+
+			// Reads from begin up to end, or up to the end of the file if it is shorter
+			bool load(const std::string &filename, unsigned long long begin, unsigned long long end)
+			{
+#ifdef JZON_POSIX_FILES
+				const int fd = open(filename.c_str(), O_RDONLY);
+				if (fd < 0)
+				{
+					return false;
+				}
+				struct stat info;
+				if (fstat(fd, &info) != 0)
+				{
+					close(fd);
+					return false;
+				}
+				fileSize = static_cast<unsigned long long>(info.st_size);
+				end = std::min(end, fileSize);
+				begin = std::min(begin, end);
+
+				// Mappings have to start on a page
+				const unsigned long long pageSize = static_cast<unsigned long long>(sysconf(_SC_PAGESIZE));
+				const unsigned long long first = begin - begin % pageSize;
+				if (end > begin)
+				{
+					mappedLength = static_cast<size_t>(end - first);
+					mapping = mmap(NULL, mappedLength, PROT_READ, MAP_PRIVATE, fd, static_cast<off_t>(first));
+					if (mapping == MAP_FAILED)
+					{
+						mapping = NULL;
+						close(fd);
+						return false;
+					}
+					data = static_cast<const char*>(mapping) + (begin - first);
+				}
+				close(fd);
+#else
+				std::ifstream stream(filename.c_str(), std::ios::in | std::ios::binary);
+				if (!stream)
+				{
+					return false;
+				}
+				stream.seekg(0, std::ios::end);
+				fileSize = static_cast<unsigned long long>(stream.tellg());
+				end = std::min(end, fileSize);
+				begin = std::min(begin, end);
+
+				buffer.resize(static_cast<size_t>(end - begin));
+				stream.seekg(static_cast<std::streamoff>(begin));
+				if (!buffer.empty() && !stream.read(&buffer[0], static_cast<std::streamsize>(buffer.size())))
 				{
-					return (*it).second;
+					return false;
 				}
+				data = buffer.data();
+#endif
+				length = static_cast<size_t>(end - begin);
+				return true;
 			}
+
+			const char *data;
+			size_t length;
+			unsigned long long fileSize;
+
+		private:
+			FileRange(const FileRange&);
+			FileRange &operator=(const FileRange&);
+
+			void *mapping;
+			size_t mappedLength;
+			std::string buffer;
+		};
+
+		const size_t inlineStringCapacity = std::string().capacity();
+
+		size_t stringBytes(const std::string &str)
+		{
+			return (str.capacity() > inlineStringCapacity ? str.capacity() + 1 : 0);
 		}
-		return Node(T_INVALID);
-	}
-	Node Node::get(size_t index) const
-	{
-		if (isContainer() && index < data->children.size())
+		size_t stringSlack(const std::string &str)
 		{
-			return data->children.at(index).second;
+			return (str.capacity() > inlineStringCapacity ? str.capacity() - str.size() : 0);
+		}
+		void shrinkString(std::string &str)
+		{
+			if (str.capacity() > str.size() && str.capacity() > inlineStringCapacity)
+				std::string(str).swap(str);
+		}
+		template <typename T>
+		void shrinkVector(std::vector<T> &list)
+		{
+			if (list.capacity() > list.size())
+				std::vector<T>(list).swap(list);
 		}
-		return Node(T_INVALID);
-	}
 
-	Node::iterator Node::begin()
-	{
-		if (data != NULL && !data->children.empty())
-			return Node::iterator(&data->children.front());
-		else
-			return Node::iterator(NULL);
-	}
-	Node::const_iterator Node::begin() const
-	{
-		if (data != NULL && !data->children.empty())
-			return Node::const_iterator(&data->children.front());
-		else
-			return Node::const_iterator(NULL);
-	}
-	Node::iterator Node::end()
-	{
-		if (data != NULL && !data->children.empty())
-			return Node::iterator(&data->children.back()+1);
-		else
-			return Node::iterator(NULL);
-	}
-	Node::const_iterator Node::end() const
-	{
-		if (data != NULL && !data->children.empty())
-			return Node::const_iterator(&data->children.back()+1);
-		else
-			return Node::const_iterator(NULL);
+#ifdef JZON_ENABLE_STATS
+		double statsClock()
+		{
+#if __cplusplus >= 201103L
+			return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#else
+			return static_cast<double>(std::clock()) / CLOCKS_PER_SEC;
+#endif
+		}
+
+		void countNode(ParseStats &stats, Node::Type type, const std::string &value, size_t depth, bool shared = false)
+		{
+			++stats.nodes[type];
+			if (!shared)
+				++stats.allocations;
+			if (!shared && value.size() > inlineStringCapacity)
+				++stats.allocations;
+			if (depth > stats.maxDepth)
+				stats.maxDepth = depth;
+		}
+#endif
+
+		// Longest value Parser::setInternValues() shares
+		const size_t maxInternedLength = 32;
+
+		inline bool equalName(const std::string &str, const char *name, size_t length)
+		{
+			return (str.size() == length && (length == 0 || std::memcmp(str.data(), name, length) == 0));
+		}
+
+		template <typename T>
+		void eraseAt(std::vector<T> &list, size_t index)
+		{
+			list.erase(list.begin()+index);
+		}
+		template <typename List>
+		void eraseAt(List &list, size_t index)
+		{
+			list.erase(index);
+		}
+		template <typename T>
+		void insertAt(std::vector<T> &list, size_t index, const T &value)
+		{
+			list.insert(list.begin()+index, value);
+		}
+		template <typename List, typename T>
+		void insertAt(List &list, size_t index, const T &value)
+		{
+			list.insert(index, value);
+		}
+
+		template <typename T>
+		void shrinkList(std::vector<std::pair<std::string, T> > &list)
+		{
+			shrinkVector(list);
+			for (size_t i = 0; i < list.size(); ++i)
+				shrinkString(list[i].first);
+		}
+		template <typename List>
+		void shrinkList(List &)
+		{
+			// Chunks are shared between lists, so they are left alone
+		}
 	}
 
-	bool Node::operator==(const Node &other) const
+	Key::Key(const std::string &name) : name(name), slot(0)
 	{
-		return (
-			(data == other.data) ||
-			(isValue() && (data->type == other.data->type)&&(data->valueStr == other.data->valueStr)));
 	}
-	bool Node::operator!=(const Node &other) const
+	Key::Key(const char *name) : name(name), slot(0)
 	{
-		return !(*this == other);
 	}
 
-	Node::Data::Data(Type type) : refCount(1), type(type)
+	Node::Node() : data(NULL)
 	{
 	}
-	Node::Data::Data(const Data &other) : refCount(1), type(other.type), valueStr(other.valueStr), children(other.children)
+	Node::Node(Type type) : data(NULL)
 	{
+		if (type == T_NULL)
+		{
+			data = sharedData(type, std::string());
+		}
+		else if (type != T_INVALID)
+		{
+			data = new Data(type);
+		}
 	}
-	Node::Data::~Data()
+	Node::Node(const Node &other) : data(other.data)
 	{
-		assert(refCount == 0);
+		if (data != NULL)
+		{
+			data->addRef();
+		}
 	}
-	void Node::Data::addRef()
+	Node::Node(Type type, const std::string &value) : data(new Data(T_NULL)) { set(type, value); }
+	Node::Node(const std::string &value) : data(new Data(T_STRING)) { set(value); }
+	Node::Node(const char *value) : data(new Data(T_STRING)) { set(value); }
+	Node::Node(int value) : data(new Data(T_NUMBER)) { set(value); }
+	Node::Node(unsigned int value) : data(new Data(T_NUMBER)) { set(value); }
+	Node::Node(long long value) : data(new Data(T_NUMBER)) { set(value); }
+	Node::Node(unsigned long long value) : data(new Data(T_NUMBER)) { set(value); }
+	Node::Node(float value) : data(new Data(T_NUMBER)) { set(value); }
+	Node::Node(double value) : data(new Data(T_NUMBER)) { set(value); }
+	Node::Node(bool value) : data(sharedData(T_BOOL, value ? "true" : "false")) {}
+	Node::~Node()
 	{
-		++refCount;
+		if (data != NULL && data->release())
+		{
+			delete data;
+			data = NULL;
+		}
 	}
-	bool Node::Data::release()
+
+	void Node::detach()
 	{
-		return (--refCount == 0);
+		if (data != NULL && data->refCount != 1)
+		{
+			Data *newData = new Data(*data);
+			if (data->release())
+			{
+				delete data;
+			}
+			data = newData;
+		}
+		if (data != NULL)
+		{
+			// Everything that modifies the node detaches first
+			data->hashValid = false;
+			unpack();
+		}
 	}
 
-
-	std::string escapeString(const std::string &value)
+	std::string Node::toString(const std::string &def) const
 	{
-		std::string escaped;
-		escaped.reserve(value.length());
-
-		for (std::string::const_iterator it = value.begin(); it != value.end(); ++it)
+		if (isValue())
 		{
-			const char &c = (*it);
-
-			const char *a = getEscaped(c);
-			if (a[0] != '\0')
+			if (isNull())
 			{
-				escaped += a[0];
-				escaped += a[1];
+				return std::string("null");
 			}
 			else
 			{
-				escaped += c;
+				return data->valueStr;
 			}
 		}
-
-		return escaped;
+		else
+		{
+			return def;
+		}
 	}
-	std::string unescapeString(const std::string &value)
+#ifdef JZON_STRING_VIEW
+	std::string_view Node::toStringView(std::string_view def) const
 	{
-		std::string unescaped;
-
-		for (std::string::const_iterator it = value.begin(); it != value.end(); ++it)
+		if (isNull())
 		{
-			const char c = (*it);
-			char c2 = '\0';
-			if (it+1 != value.end())
-				c2 = *(it+1);
-
-			const char a = getUnescaped(c, c2);
-			if (a != '\0')
+			return std::string_view("null");
+		}
+		return (isValue() ? std::string_view(data->valueStr) : def);
+	}
+#endif
+#define GET_NUMBER(T) \
+	if (isNumber())\
+	{\
+		std::stringstream sstr(data->valueStr);\
+		T val;\
+		sstr >> val;\
+		return val;\
+	}\
+	else\
+	{\
+		return def;\
+	}
+	int Node::toInt(int def) const { GET_NUMBER(int) }
+	float Node::toFloat(float def) const { GET_NUMBER(float) }
+	double Node::toDouble(double def) const { GET_NUMBER(double) }
+#undef GET_NUMBER
+	bool Node::toBool(bool def) const
+	{
+		if (isBool())
+		{
+			return (data->valueStr == "true");
+		}
+		else
+		{
+			return def;
+		}
+	}
+
+	void Node::setNull()
+	{
+		if (isValue())
+		{
+			detach();
+			data->type = T_NULL;
+			data->valueStr.clear();
+		}
+	}
+	void Node::set(Type type, const std::string &value)
+	{
+		if (isValue() && (type == T_NULL || type == T_STRING || type == T_NUMBER || type == T_BOOL))
+		{
+			detach();
+			data->type = type;
+			if (type == T_STRING)
 			{
-				unescaped += a;
-				if (it+1 != value.end())
-					++it;
+				data->valueStr = unescapeString(value);
 			}
 			else
 			{
-				unescaped += c;
+				data->valueStr = value;
 			}
 		}
-
-		return unescaped;
 	}
-
-	Node invalid()
+	void Node::set(const std::string &value)
 	{
-		return Node(Node::T_INVALID);
+		if (isValue())
+		{
+			detach();
+			data->type = T_STRING;
+			data->valueStr = unescapeString(value);
+		}
 	}
-	Node null()
+	void Node::setRaw(const std::string &value)
 	{
-		return Node(Node::T_NULL);
+		if (isValue())
+		{
+			detach();
+			data->type = T_STRING;
+			data->valueStr = value;
+		}
 	}
-	Node object()
+	void Node::set(const char *value)
 	{
-		return Node(Node::T_OBJECT);
+		if (isValue())
+		{
+			detach();
+			data->type = T_STRING;
+			data->valueStr = unescapeString(std::string(value));
+		}
 	}
-	Node array()
+#define SET_NUMBER \
+	if (isValue())\
+	{\
+		detach();\
+		data->type = T_NUMBER;\
+		std::stringstream sstr;\
+		sstr << value;\
+		data->valueStr = sstr.str();\
+	}
+	void Node::set(int value) { SET_NUMBER }
+	void Node::set(unsigned int value) { SET_NUMBER }
+	void Node::set(long long value) { SET_NUMBER }
+	void Node::set(unsigned long long value) { SET_NUMBER }
+	void Node::set(float value) { SET_NUMBER }
+	void Node::set(double value) { SET_NUMBER }
+#undef SET_NUMBER
+	void Node::set(bool value)
 	{
-		return Node(Node::T_ARRAY);
+		if (isValue())
+		{
+			detach();
+			data->type = T_BOOL;
+			data->valueStr = (value ? "true" : "false");
+		}
 	}
 
+	Node &Node::operator=(const Node &rhs)
+	{
+		if (this != &rhs)
+		{
+			if (data != NULL && data->release())
+			{
+				delete data;
+			}
+			data = rhs.data;
+			if (data != NULL)
+			{
+				data->addRef();
+			}
+		}
+		return *this;
+	}
+	Node &Node::operator=(const std::string &rhs) { set(rhs); return *this; }
+	Node &Node::operator=(const char *rhs) { set(rhs); return *this; }
+	Node &Node::operator=(int rhs) { set(rhs); return *this; }
+	Node &Node::operator=(unsigned int rhs) { set(rhs); return *this; }
+	Node &Node::operator=(long long rhs) { set(rhs); return *this; }
+	Node &Node::operator=(unsigned long long rhs) { set(rhs); return *this; }
+	Node &Node::operator=(float rhs) { set(rhs); return *this; }
+	Node &Node::operator=(double rhs) { set(rhs); return *this; }
+	Node &Node::operator=(bool rhs) { set(rhs); return *this; }
 
-	Writer::Writer(const Format &format)
+	void Node::add(const Node &node)
 	{
-		setFormat(format);
+		if (isArray())
+		{
+			detach();
+			data->children.push_back(std::make_pair(std::string(), node));
+		}
 	}
-	Writer::~Writer()
+	void Node::add(const std::string &name, const Node &node)
 	{
+		if (isObject())
+		{
+			detach();
+			data->children.push_back(std::make_pair(name, node));
+		}
 	}
-
-	void Writer::setFormat(const Format &format)
+	void Node::append(const Node &node)
 	{
-		this->format = format;
-		indentationChar = (format.useTabs ? '\t' : ' ');
-		spacing = (format.spacing ? " " : "");
-		newline = (format.newline ? "\n" : spacing);
+		if ((isObject() && node.isObject()) || (isArray() && node.isArray()))
+		{
+			detach();
+			if (node.data->packed != NULL)
+			{
+				const size_t otherCount = node.getCount();
+				data->children.reserve(data->children.size() + otherCount);
+				for (size_t i = 0; i < otherCount; ++i)
+				{
+					data->children.push_back(std::make_pair(std::string(), packedAt(*node.data->packed, i)));
+				}
+				return;
+			}
+			const NamedNodeList &other = node.data->children;
+			const size_t otherCount = other.size();
+			data->children.reserve(data->children.size() + otherCount);
+			for (size_t i = 0; i < otherCount; ++i)
+			{
+				data->children.push_back(other[i]);
+			}
+		}
 	}
-
-	void Writer::writeStream(const Node &node, std::ostream &stream) const
+	void Node::remove(size_t index)
 	{
-		writeNode(node, 0, stream);
+		if (isContainer() && index < getCount())
+		{
+			detach();
+			eraseAt(data->children, index);
+		}
 	}
-	void Writer::writeString(const Node &node, std::string &json) const
+	void Node::remove(const std::string &name)
 	{
-		std::ostringstream stream(json);
-		writeStream(node, stream);
-		json = stream.str();
+		removeChild(findChild(name.data(), name.size(), noChild));
 	}
-	void Writer::writeFile(const Node &node, const std::string &filename) const
+	void Node::remove(const Key &key)
 	{
-		std::ofstream stream(filename.c_str(), std::ios::out | std::ios::trunc);
-		writeStream(node, stream);
+		removeChild(findChild(key.name.data(), key.name.size(), key.slot));
 	}
-
-	void Writer::writeNode(const Node &node, unsigned int level, std::ostream &stream) const
+	void Node::removeChild(size_t index)
 	{
-		switch (node.getType())
+		if (index != noChild)
 		{
-		case Node::T_INVALID: break;
-		case Node::T_OBJECT: writeObject(node, level, stream); break;
-		case Node::T_ARRAY: writeArray(node, level, stream); break;
-		case Node::T_NULL: // Fallthrough
-		case Node::T_STRING: // Fallthrough
-		case Node::T_NUMBER: // Fallthrough
-		case Node::T_BOOL: writeValue(node, stream); break;
+			detach();
+			eraseAt(data->children, index);
 		}
 	}
-	void Writer::writeObject(const Node &node, unsigned int level, std::ostream &stream) const
+	void Node::clear()
 	{
-		stream << "{" << newline;
-
-		for (Node::const_iterator it = node.begin(); it != node.end(); ++it)
+		if (getCount() > 0)
 		{
-			const std::string &name = (*it).first;
-			const Node &value = (*it).second;
-
-			if (it != node.begin())
-				stream << "," << newline;
-			stream << getIndentation(level+1) << "\""<<name<<"\"" << ":" << spacing;
-			writeNode(value, level+1, stream);
+			detach();
+			data->children.clear();
 		}
+	}
 
-		stream << newline << getIndentation(level) << "}";
+	bool Node::has(const std::string &name) const
+	{
+		return (findChild(name.data(), name.size(), noChild) != noChild);
 	}
-	void Writer::writeArray(const Node &node, unsigned int level, std::ostream &stream) const
+	bool Node::has(const Key &key) const
 	{
-		stream << "[" << newline;
-
-		for (Node::const_iterator it = node.begin(); it != node.end(); ++it)
+		const size_t index = findChild(key.name.data(), key.name.size(), key.slot);
+		if (index == noChild)
 		{
-			const Node &value = (*it).second;
-
-			if (it != node.begin())
-				stream << "," << newline;
-			stream << getIndentation(level+1);
-			writeNode(value, level+1, stream);
+			return false;
 		}
-
-		stream << newline << getIndentation(level) << "]";
+		key.slot = index;
+		return true;
 	}
-	void Writer::writeValue(const Node &node, std::ostream &stream) const
+	size_t Node::getCount() const
 	{
-		if (node.isString())
+		if (data != NULL && data->packed != NULL)
 		{
-			stream << "\""<<escapeString(node.toString())<<"\"";
-		}
-		else
-		{
-			stream << node.toString();
+			const PackedNumbers &packed = *data->packed;
+			return (packed.isReal ? packed.reals.size() : packed.integers.size());
 		}
+		return data != NULL ? data->children.size() : 0;
 	}
-
-	std::string Writer::getIndentation(unsigned int level) const
+	Node Node::get(const std::string &name) const
 	{
-		if (!format.newline)
+		return childAt(findChild(name.data(), name.size(), noChild));
+	}
+	Node Node::get(const Key &key) const
+	{
+		return at(key);
+	}
+	size_t Node::findChild(const char *name, size_t length, size_t hint) const
+	{
+		if (!isObject())
 		{
-			return "";
+			return noChild;
 		}
-		else
+		const NamedNodeList &children = data->children;
+		const size_t count = children.size();
+		if (hint < count && equalName(children[hint].first, name, length))
 		{
-			return std::string(format.indentSize * level, indentationChar);
+			return hint;
+		}
+		for (size_t i = 0; i < count; ++i)
+		{
+			if (equalName(children[i].first, name, length))
+			{
+				return i;
+			}
 		}
+		return noChild;
 	}
-
-
-	Parser::Parser()
+	const Node &Node::childAt(size_t index) const
 	{
+		static const Node invalidNode;
+		if (index == noChild)
+		{
+			return invalidNode;
+		}
+		const NamedNodeList &children = data->children;
+		return children[index].second;
 	}
-	Parser::~Parser()
+	Node Node::get(size_t index) const
 	{
+		if (data != NULL && data->packed != NULL && index < getCount())
+		{
+			return packedAt(*data->packed, index);
+		}
+		if (isContainer() && index < data->children.size())
+		{
+			const NamedNodeList &children = data->children;
+			return children[index].second;
+		}
+		return Node(T_INVALID);
 	}
-
-	Node Parser::parseStream(std::istream &stream)
+	const Node &Node::at(const std::string &name) const
 	{
-		TokenQueue tokens;
-		DataQueue data;
-
-		tokenize(stream, tokens, data);
-		Node node = assemble(tokens, data);
-
-		return node;
+		return childAt(findChild(name.data(), name.size(), noChild));
 	}
-	Node Parser::parseString(const std::string &json)
+	const Node &Node::at(const Key &key) const
 	{
-		std::istringstream stream(json);
-		return parseStream(stream);
+		const size_t index = findChild(key.name.data(), key.name.size(), key.slot);
+		if (index != noChild)
+		{
+			key.slot = index;
+		}
+		return childAt(index);
 	}
-	Node Parser::parseFile(const std::string &filename)
+	const Node &Node::at(size_t index) const
 	{
-		std::ifstream stream(filename.c_str(), std::ios::in);
-		return parseStream(stream);
+		if (data != NULL && data->packed != NULL)
+		{
+			return (index < getCount() ? packedElements(*data->packed)[index] : childAt(noChild));
+		}
+		return childAt(isContainer() && index < data->children.size() ? index : noChild);
 	}
 
-	const std::string &Parser::getError() const
+#ifdef JZON_PERSISTENT_CONTAINERS
+	Node::iterator Node::begin()
 	{
-		return error;
+		unpack();
+		if (data != NULL && data->refCount > 0)
+			data->hashValid = false;
+		return Node::iterator(data != NULL ? &data->children : NULL, 0);
+	}
+	Node::const_iterator Node::begin() const
+	{
+		if (data != NULL && data->packed != NULL)
+			return Node::const_iterator(data->packed, 0);
+		return Node::const_iterator(data != NULL ? &data->children : NULL, 0);
+	}
+	Node::iterator Node::end()
+	{
+		unpack();
+		if (data != NULL && data->refCount > 0)
+			data->hashValid = false;
+		return Node::iterator(data != NULL ? &data->children : NULL, getCount());
+	}
+	Node::const_iterator Node::end() const
+	{
+		if (data != NULL && data->packed != NULL)
+			return Node::const_iterator(data->packed, getCount());
+		return Node::const_iterator(data != NULL ? &data->children : NULL, getCount());
 	}
 
-	void Parser::tokenize(std::istream &stream, TokenQueue &tokens, DataQueue &data)
+	NamedNode &Node::iterator::operator*() { return (*list)[index]; }
+	NamedNode *Node::iterator::operator->() { return &(*list)[index]; }
+	const NamedNode &Node::const_iterator::operator*() { return (packed != NULL ? unpacked() : (*list)[index]); }
+	const NamedNode *Node::const_iterator::operator->() { return &operator*(); }
+#else
+	Node::iterator Node::begin()
+	{
+		unpack();
+		if (data != NULL && data->refCount > 0)
+			data->hashValid = false;
+		if (data != NULL && !data->children.empty())
+			return Node::iterator(&data->children.front());
+		else
+			return Node::iterator(NULL);
+	}
+	Node::const_iterator Node::begin() const
+	{
+		if (data != NULL && data->packed != NULL)
+			return Node::const_iterator(data->packed, 0);
+		if (data != NULL && !data->children.empty())
+			return Node::const_iterator(&data->children.front());
+		else
+			return Node::const_iterator(NULL);
+	}
+	Node::iterator Node::end()
+	{
+		unpack();
+		if (data != NULL && data->refCount > 0)
+			data->hashValid = false;
+		if (data != NULL && !data->children.empty())
+			return Node::iterator(&data->children.back()+1);
+		else
+			return Node::iterator(NULL);
+	}
+	Node::const_iterator Node::end() const
 	{
-		Token token = T_UNKNOWN;
-		std::string valueBuffer;
-		bool saveBuffer;
+		if (data != NULL && data->packed != NULL)
+			return Node::const_iterator(data->packed, getCount());
+		if (data != NULL && !data->children.empty())
+			return Node::const_iterator(&data->children.back()+1);
+		else
+			return Node::const_iterator(NULL);
+	}
+#endif
 
-		char c = '\0';
-		while (stream.peek() != std::char_traits<char>::eof())
+	Node::const_iterator::~const_iterator()
+	{
+		delete current;
+	}
+	Node::const_iterator &Node::const_iterator::operator=(const const_iterator &rhs)
+	{
+#ifdef JZON_PERSISTENT_CONTAINERS
+		list = rhs.list;
+#else
+		p = rhs.p;
+#endif
+		packed = rhs.packed;
+		index = rhs.index;
+		return *this;
+	}
+	const NamedNode &Node::const_iterator::unpacked()
+	{
+		if (current == NULL)
 		{
-			stream.get(c);
+			current = new NamedNode();
+		}
+		current->second = packedAt(*packed, index);
+		return *current;
+	}
 
-			if (isWhitespace(c))
+	bool Node::isPacked() const
+	{
+		return (data != NULL && data->packed != NULL);
+	}
+	const long long *Node::getIntegerData() const
+	{
+		if (isPacked() && !data->packed->isReal && !data->packed->integers.empty())
+		{
+			return &data->packed->integers.front();
+		}
+		return NULL;
+	}
+	const double *Node::getDoubleData() const
+	{
+		if (isPacked() && data->packed->isReal && !data->packed->reals.empty())
+		{
+			return &data->packed->reals.front();
+		}
+		return NULL;
+	}
+	std::vector<long long> Node::toIntegerArray() const
+	{
+		std::vector<long long> values;
+		if (isPacked())
+		{
+			const PackedNumbers &packed = *data->packed;
+			if (!packed.isReal)
+				return packed.integers;
+			values.reserve(packed.reals.size());
+			for (size_t i = 0; i < packed.reals.size(); ++i)
+				values.push_back(static_cast<long long>(packed.reals[i]));
+		}
+		else if (isArray())
+		{
+			const NamedNodeList &children = data->children;
+			values.reserve(children.size());
+			for (size_t i = 0; i < children.size(); ++i)
+			{
+				long long value = 0;
+				if (children[i].second.isNumber())
+				{
+					std::stringstream sstr(children[i].second.data->valueStr);
+					sstr >> value;
+				}
+				values.push_back(value);
+			}
+		}
+		return values;
+	}
+	std::vector<double> Node::toDoubleArray() const
+	{
+		std::vector<double> values;
+		if (isPacked())
+		{
+			const PackedNumbers &packed = *data->packed;
+			if (packed.isReal)
+				return packed.reals;
+			values.reserve(packed.integers.size());
+			for (size_t i = 0; i < packed.integers.size(); ++i)
+				values.push_back(static_cast<double>(packed.integers[i]));
+		}
+		else if (isArray())
+		{
+			const NamedNodeList &children = data->children;
+			values.reserve(children.size());
+			for (size_t i = 0; i < children.size(); ++i)
+			{
+				values.push_back(children[i].second.toDouble());
+			}
+		}
+		return values;
+	}
+
+	bool Node::addPacked(const std::string &number)
+	{
+		long long integer = 0;
+		double real = 0.0;
+		const PackedKind kind = classifyNumber(number, integer, real);
+		if (kind == PACKED_NONE || !isArray())
+		{
+			return false;
+		}
+		if (data->packed == NULL)
+		{
+			if (!data->children.empty())
+				return false;
+			data->packed = new PackedNumbers();
+		}
+
+		PackedNumbers &packed = *data->packed;
+		delete[] packed.elements;
+		packed.elements = NULL;
+		if (!packed.isReal)
+		{
+			if (kind == PACKED_INTEGER)
+			{
+				packed.integers.push_back(integer);
+				return true;
+			}
+
+			// Only integers that are exact as reals can be moved over
+			for (size_t i = 0; i < packed.integers.size(); ++i)
+			{
+				if (packed.integers[i] >= 1000000000000000LL || packed.integers[i] <= -1000000000000000LL)
+					return false;
+			}
+			packed.reals.reserve(packed.integers.capacity());
+			for (size_t i = 0; i < packed.integers.size(); ++i)
+			{
+				packed.reals.push_back(static_cast<double>(packed.integers[i]));
+			}
+			std::vector<long long>().swap(packed.integers);
+			packed.isReal = true;
+		}
+
+		if (kind == PACKED_INTEGER)
+		{
+			if (integer >= 1000000000000000LL || integer <= -1000000000000000LL)
+				return false;
+			real = static_cast<double>(integer);
+		}
+		packed.reals.push_back(real);
+		return true;
+	}
+	Node Node::packedAt(const PackedNumbers &packed, size_t index)
+	{
+		char buffer[32];
+		const size_t length = (packed.isReal ? formatPackedReal(buffer, packed.reals[index]) : formatPackedInteger(buffer, packed.integers[index]));
+		return Node(T_NUMBER, std::string(buffer, length));
+	}
+	const Node *Node::packedElements(PackedNumbers &packed)
+	{
+		// Made once and only read after that, so that at(index) doesn't change
+		// the array, which other threads may be reading
+#ifdef JZON_THREADS
+		static std::mutex mutex;
+		std::lock_guard<std::mutex> lock(mutex);
+#endif
+		if (packed.elements == NULL)
+		{
+			const size_t count = (packed.isReal ? packed.reals.size() : packed.integers.size());
+			Node *elements = new Node[count];
+			for (size_t i = 0; i < count; ++i)
+			{
+				elements[i] = packedAt(packed, i);
+			}
+			packed.elements = elements;
+		}
+		return packed.elements;
+	}
+	Node::PackedNumbers::~PackedNumbers()
+	{
+		delete[] elements;
+	}
+	void Node::unpack() const
+	{
+		if (data == NULL || data->packed == NULL)
+		{
+			return;
+		}
+
+		PackedNumbers *packed = data->packed;
+		data->packed = NULL;
+
+		const size_t count = (packed->isReal ? packed->reals.size() : packed->integers.size());
+		char buffer[32];
+		data->children.reserve(count);
+		for (size_t i = 0; i < count; ++i)
+		{
+			if (packed->elements != NULL)
+			{
+				data->children.push_back(std::make_pair(std::string(), packed->elements[i]));
 				continue;
+			}
+			const size_t length = (packed->isReal ? formatPackedReal(buffer, packed->reals[i]) : formatPackedInteger(buffer, packed->integers[i]));
+			data->children.push_back(std::make_pair(std::string(), Node(T_NUMBER, std::string(buffer, length))));
+		}
+		delete packed;
+	}
 
-			saveBuffer = true;
+	struct Node::Visited
+	{
+		std::set<const Data*> data;
+#ifdef JZON_PERSISTENT_CONTAINERS
+		std::set<const void*> chunks; // Shared between lists
+#endif
+	};
 
-			switch (c)
+	MemoryUsage Node::memoryUsage() const
+	{
+		MemoryUsage usage = MemoryUsage();
+		Visited visited;
+		measure(usage, visited);
+		usage.total = usage.headers + usage.values + usage.keys + usage.children + usage.packed;
+		return usage;
+	}
+	void Node::shrinkToFit()
+	{
+		Visited visited;
+		shrink(visited);
+	}
+
+	void Node::measure(MemoryUsage &usage, Visited &visited) const
+	{
+		if (data == NULL || data->refCount < 0 || !visited.data.insert(data).second)
+		{
+			return;
+		}
+
+		++usage.blocks;
+		usage.headers += sizeof(Data);
+		usage.values += stringBytes(data->valueStr);
+		usage.unused += stringSlack(data->valueStr);
+
+		if (data->packed != NULL)
+		{
+			const PackedNumbers &packed = *data->packed;
+			usage.headers += sizeof(PackedNumbers);
+			usage.packed += packed.integers.capacity() * sizeof(long long) + packed.reals.capacity() * sizeof(double);
+			usage.unused += (packed.integers.capacity() - packed.integers.size()) * sizeof(long long);
+			usage.unused += (packed.reals.capacity() - packed.reals.size()) * sizeof(double);
+			if (packed.elements != NULL)
+			{
+				const size_t count = (packed.isReal ? packed.reals.size() : packed.integers.size());
+				usage.children += count * sizeof(Node);
+				for (size_t i = 0; i < count; ++i)
+					packed.elements[i].measure(usage, visited);
+			}
+		}
+
+#ifdef JZON_PERSISTENT_CONTAINERS
+		data->children.measure(usage, visited);
+#else
+		const NamedNodeList &children = data->children;
+		usage.children += children.capacity() * sizeof(NamedNode);
+		usage.unused += (children.capacity() - children.size()) * sizeof(NamedNode);
+		for (size_t i = 0; i < children.size(); ++i)
+		{
+			usage.keys += stringBytes(children[i].first);
+			usage.unused += stringSlack(children[i].first);
+			children[i].second.measure(usage, visited);
+		}
+#endif
+	}
+	void Node::shrink(Visited &visited) const
+	{
+		if (data == NULL || data->refCount < 0 || !visited.data.insert(data).second)
+		{
+			return;
+		}
+
+		shrinkString(data->valueStr);
+		if (data->packed != NULL)
+		{
+			shrinkVector(data->packed->integers);
+			shrinkVector(data->packed->reals);
+		}
+
+		shrinkList(data->children);
+		const NamedNodeList &children = data->children;
+		for (size_t i = 0; i < children.size(); ++i)
+		{
+			children[i].second.shrink(visited);
+		}
+	}
+
+	unsigned long long Node::hash() const
+	{
+		if (data == NULL)
+		{
+			return 0;
+		}
+		if (data->hashValid)
+		{
+			return data->hashValue;
+		}
+
+		unsigned long long h = mixHash(static_cast<unsigned long long>(data->type) + 1);
+		switch (data->type)
+		{
+		case T_INVALID: // Fallthrough
+		case T_NULL:
+			break;
+		case T_STRING: // Fallthrough
+		case T_BOOL:
+			{
+				h ^= hashString(data->valueStr);
+				break;
+			}
+		case T_NUMBER:
+			{
+				h ^= hashNumber(std::strtod(data->valueStr.c_str(), NULL));
+				break;
+			}
+		case T_ARRAY:
 			{
-			case '{':
+				if (data->packed != NULL)
 				{
-					token = T_OBJ_BEGIN;
+					// Same as hashing each element as a T_NUMBER node
+					const PackedNumbers &packed = *data->packed;
+					const unsigned long long numberHash = mixHash(static_cast<unsigned long long>(T_NUMBER) + 1);
+					const size_t count = getCount();
+					for (size_t i = 0; i < count; ++i)
+					{
+						const double value = (packed.isReal ? packed.reals[i] : static_cast<double>(packed.integers[i]));
+						h = mixHash(h + (numberHash ^ hashNumber(value)));
+					}
 					break;
 				}
-			case '}':
+				const NamedNodeList &children = data->children;
+				for (size_t i = 0; i < children.size(); ++i)
 				{
-					token = T_OBJ_END;
-					break;
+					h = mixHash(h + children[i].second.hash());
 				}
-			case '[':
+				break;
+			}
+		case T_OBJECT:
+			{
+				// Order-independent, since member order doesn't affect equality
+				const NamedNodeList &children = data->children;
+				unsigned long long sum = 0;
+				for (size_t i = 0; i < children.size(); ++i)
 				{
-					token = T_ARRAY_BEGIN;
-					break;
+					sum += mixHash(hashString(children[i].first) ^ (children[i].second.hash() * 0x9e3779b97f4a7c15ULL));
+				}
+				h = mixHash(h ^ sum ^ children.size());
+				break;
+			}
+		}
+
+		// Immortal data may be read from many threads at once
+		if (data->refCount > 0)
+		{
+			data->hashValue = h;
+			data->hashValid = true;
+		}
+		return h;
+	}
+
+	bool Node::operator==(const Node &other) const
+	{
+		if (data == other.data)
+		{
+			return true;
+		}
+		if (data == NULL || other.data == NULL || data->type != other.data->type)
+		{
+			return false;
+		}
+
+		switch (data->type)
+		{
+		case T_INVALID: // Fallthrough
+		case T_NULL:
+			return true;
+		case T_STRING: // Fallthrough
+		case T_BOOL:
+			return (data->valueStr == other.data->valueStr);
+		case T_NUMBER:
+			return equalNumbers(data->valueStr, other.data->valueStr);
+		case T_ARRAY: // Fallthrough
+		case T_OBJECT:
+			{
+				if (getCount() != other.getCount())
+				{
+					return false;
 				}
-			case ']':
+				if (data->packed != NULL && other.data->packed != NULL)
 				{
-					token = T_ARRAY_END;
-					break;
+					const PackedNumbers &packed = *data->packed;
+					const PackedNumbers &otherPacked = *other.data->packed;
+					if (!packed.isReal && !otherPacked.isReal)
+					{
+						return (packed.integers == otherPacked.integers);
+					}
+					for (size_t i = 0; i < getCount(); ++i)
+					{
+						const double value = (packed.isReal ? packed.reals[i] : static_cast<double>(packed.integers[i]));
+						const double otherValue = (otherPacked.isReal ? otherPacked.reals[i] : static_cast<double>(otherPacked.integers[i]));
+						if (value != otherValue)
+							return false;
+					}
+					return true;
+				}
+				if (hash() != other.hash())
+				{
+					return false;
+				}
+				if (data->packed != NULL || other.data->packed != NULL)
+				{
+					// Compare element by element rather than unpacking
+					for (size_t i = 0; i < getCount(); ++i)
+					{
+						if (get(i) != other.get(i))
+							return false;
+					}
+					return true;
+				}
+				return equalChildren(other);
+			}
+		}
+		return false;
+	}
+	bool Node::operator!=(const Node &other) const
+	{
+		return !(*this == other);
+	}
+
+	bool Node::equalChildren(const Node &other) const
+	{
+		const NamedNodeList &children = data->children;
+		const NamedNodeList &otherChildren = other.data->children;
+		const size_t count = children.size();
+
+		size_t i = 0;
+		for (; i < count; ++i)
+		{
+			if (children[i].first != otherChildren[i].first)
+				break;
+			if (children[i].second != otherChildren[i].second)
+				return false;
+		}
+		if (i == count)
+		{
+			return true;
+		}
+
+		// The objects have members in different orders, so match the rest by name
+		std::vector<bool> matched(count, false);
+		std::fill(matched.begin(), matched.begin()+i, true);
+		for (; i < count; ++i)
+		{
+			const NamedNode &member = children[i];
+			bool found = false;
+			for (size_t j = 0; j < count && !found; ++j)
+			{
+				const NamedNode &otherMember = otherChildren[j];
+				if (!matched[j] && member.first == otherMember.first && member.second == otherMember.second)
+				{
+					matched[j] = true;
+					found = true;
 				}
-			case ',':
+			}
+			if (!found)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	Node::Data::Data(Type type) : refCount(1), type(type), packed(NULL), hashValid(false), hashValue(0)
+	{
+	}
+	Node::Data::Data(const Data &other) : refCount(1), type(other.type), valueStr(other.valueStr), children(other.children), packed(NULL), hashValid(false), hashValue(0)
+	{
+		if (other.packed != NULL)
+		{
+			packed = new PackedNumbers(*other.packed);
+		}
+	}
+	Node::Data::~Data()
+	{
+		assert(refCount == 0);
+		delete packed;
+	}
+	void Node::Data::addRef()
+	{
+		if (refCount > 0)
+			++refCount;
+	}
+	bool Node::Data::release()
+	{
+		return (refCount > 0 && --refCount == 0);
+	}
+
+	Node::Data *Node::sharedData(Type type, const std::string &value)
+	{
+		struct Immortal
+		{
+			static Data *create(Type type, const char *value)
+			{
+				Data *data = new Data(type);
+				data->refCount = -1;
+				data->valueStr = value;
+				return data;
+			}
+		};
+		// Never freed, so nodes in static objects can still use them at exit
+		static Data *const nullData = Immortal::create(T_NULL, "");
+		static Data *const trueData = Immortal::create(T_BOOL, "true");
+		static Data *const falseData = Immortal::create(T_BOOL, "false");
+		static Data *const zeroData = Immortal::create(T_NUMBER, "0");
+		static Data *const emptyData = Immortal::create(T_STRING, "");
+
+		switch (type)
+		{
+		case T_NULL:
+			return nullData;
+		case T_BOOL:
+			return (value == "true" ? trueData : (value == "false" ? falseData : NULL));
+		case T_NUMBER:
+			return (value == "0" ? zeroData : NULL);
+		case T_STRING:
+			return (value.empty() ? emptyData : NULL);
+		default:
+			return NULL;
+		}
+	}
+
+#ifdef JZON_PERSISTENT_CONTAINERS
+	namespace
+	{
+		const unsigned int chunkBits = 5;
+		const size_t chunkSize = (1 << chunkBits);
+		const size_t chunkMask = (chunkSize - 1);
+	}
+
+	struct Node::PersistentList::Chunk
+	{
+		Chunk() : refCount(1)
+		{
+		}
+		Chunk(const Chunk &other) : refCount(1), branches(other.branches), items(other.items)
+		{
+			for (std::vector<Chunk*>::iterator it = branches.begin(); it != branches.end(); ++it)
+			{
+				++(*it)->refCount;
+			}
+		}
+
+		int refCount;
+		std::vector<Chunk*> branches; // Only used by inner chunks
+		std::vector<NamedNode> items; // Only used by leaf chunks
+	};
+
+	Node::PersistentList::PersistentList() : root(NULL), tail(NULL), count(0), shift(chunkBits)
+	{
+	}
+	Node::PersistentList::PersistentList(const PersistentList &other)
+		: root(other.root), tail(other.tail), count(other.count), shift(other.shift)
+	{
+		if (root != NULL)
+			++root->refCount;
+		if (tail != NULL)
+			++tail->refCount;
+	}
+	Node::PersistentList::~PersistentList()
+	{
+		release(root);
+		release(tail);
+	}
+
+	Node::PersistentList &Node::PersistentList::operator=(const PersistentList &rhs)
+	{
+		if (this != &rhs)
+		{
+			PersistentList copy(rhs);
+			std::swap(root, copy.root);
+			std::swap(tail, copy.tail);
+			std::swap(count, copy.count);
+			std::swap(shift, copy.shift);
+		}
+		return *this;
+	}
+
+	const NamedNode &Node::PersistentList::operator[](size_t index) const
+	{
+		const size_t offset = tailOffset();
+		if (index >= offset)
+		{
+			return tail->items[index - offset];
+		}
+
+		const Chunk *chunk = root;
+		for (unsigned int level = shift; level > 0; level -= chunkBits)
+		{
+			chunk = chunk->branches[(index >> level) & chunkMask];
+		}
+		return chunk->items[index & chunkMask];
+	}
+	NamedNode &Node::PersistentList::operator[](size_t index)
+	{
+		const size_t offset = tailOffset();
+		return uniqueLeaf(index)->items[index >= offset ? index - offset : index & chunkMask];
+	}
+
+	void Node::PersistentList::push_back(const NamedNode &value)
+	{
+		if (tail == NULL)
+		{
+			tail = new Chunk;
+		}
+		else if (count - tailOffset() == chunkSize)
+		{
+			// The tail is full, so move it into the trie
+			const size_t offset = count - chunkSize;
+			if (root == NULL)
+			{
+				root = new Chunk;
+				shift = chunkBits;
+			}
+			else if ((offset >> chunkBits) == (static_cast<size_t>(1) << shift))
+			{
+				Chunk *newRoot = new Chunk;
+				newRoot->branches.push_back(root);
+				root = newRoot;
+				shift += chunkBits;
+			}
+
+			Chunk *chunk = unique(root);
+			for (unsigned int level = shift; level > chunkBits; level -= chunkBits)
+			{
+				const size_t index = (offset >> level) & chunkMask;
+				if (index == chunk->branches.size())
+				{
+					chunk->branches.push_back(new Chunk);
+				}
+				chunk = unique(chunk->branches[index]);
+			}
+			Chunk *newTail = new Chunk;
+			newTail->items.reserve(chunkSize);
+			newTail->items.push_back(value); // value may live in the old tail
+			chunk->branches.push_back(tail);
+			tail = newTail;
+			++count;
+			return;
+		}
+
+		unique(tail)->items.push_back(value);
+		++count;
+	}
+	void Node::PersistentList::pop_back()
+	{
+		assert(count > 0);
+
+		const size_t offset = tailOffset();
+		if (count - offset > 1)
+		{
+			unique(tail)->items.pop_back();
+		}
+		else if (offset == 0)
+		{
+			release(tail);
+			tail = NULL;
+		}
+		else
+		{
+			release(tail);
+			tail = popLeaf(offset - chunkSize);
+		}
+		--count;
+	}
+	void Node::PersistentList::insert(size_t index, const NamedNode &value)
+	{
+		assert(index <= count);
+
+		// The value goes to the back, and then moves down a leaf at a time:
+		// each leaf shifts its items up by one and gives its last one to the next
+		push_back(value);
+		size_t leafBegin = tailOffset();
+		Chunk *leaf = unique(tail);
+		for (;;)
+		{
+			std::vector<NamedNode> &items = leaf->items;
+			const size_t first = (index > leafBegin ? index - leafBegin : 0);
+			for (size_t i = items.size()-1; i > first; --i)
+			{
+				swapItems(items[i], items[i-1]);
+			}
+			if (index >= leafBegin)
+			{
+				break;
+			}
+			Chunk *previous = uniqueLeaf(leafBegin - chunkSize);
+			swapItems(previous->items.back(), items.front());
+			leaf = previous;
+			leafBegin -= chunkSize;
+		}
+	}
+	void Node::PersistentList::erase(size_t index)
+	{
+		assert(index < count);
+
+		// The item moves up to the back a leaf at a time, the other way round
+		// from insert(), and is then popped
+		const size_t offset = tailOffset();
+		size_t leafBegin = (index >= offset ? offset : index & ~chunkMask);
+		Chunk *leaf = uniqueLeaf(index);
+		size_t first = index - leafBegin;
+		for (;;)
+		{
+			std::vector<NamedNode> &items = leaf->items;
+			for (size_t i = first; i+1 < items.size(); ++i)
+			{
+				swapItems(items[i], items[i+1]);
+			}
+			if (leafBegin == offset)
+			{
+				break;
+			}
+			Chunk *next = uniqueLeaf(leafBegin + chunkSize);
+			swapItems(items.back(), next->items.front());
+			leaf = next;
+			leafBegin += chunkSize;
+			first = 0;
+		}
+		pop_back();
+	}
+	void Node::PersistentList::clear()
+	{
+		release(root);
+		release(tail);
+		root = NULL;
+		tail = NULL;
+		count = 0;
+		shift = chunkBits;
+	}
+
+	void Node::PersistentList::measure(MemoryUsage &usage, Visited &visited) const
+	{
+		std::vector<const Chunk*> pending;
+		if (root != NULL)
+			pending.push_back(root);
+		if (tail != NULL)
+			pending.push_back(tail);
+		while (!pending.empty())
+		{
+			const Chunk *chunk = pending.back();
+			pending.pop_back();
+			if (!visited.chunks.insert(chunk).second)
+				continue;
+			usage.children += sizeof(Chunk) + chunk->branches.capacity() * sizeof(Chunk*) + chunk->items.capacity() * sizeof(NamedNode);
+			pending.insert(pending.end(), chunk->branches.begin(), chunk->branches.end());
+			for (size_t i = 0; i < chunk->items.size(); ++i)
+			{
+				usage.keys += stringBytes(chunk->items[i].first);
+				usage.unused += stringSlack(chunk->items[i].first);
+				chunk->items[i].second.measure(usage, visited);
+			}
+		}
+	}
+
+	size_t Node::PersistentList::tailOffset() const
+	{
+		return (count == 0 ? 0 : ((count - 1) >> chunkBits) << chunkBits);
+	}
+	void Node::PersistentList::swapItems(NamedNode &a, NamedNode &b)
+	{
+		a.first.swap(b.first);
+		std::swap(a.second.data, b.second.data);
+	}
+	Node::PersistentList::Chunk *Node::PersistentList::uniqueLeaf(size_t index)
+	{
+		if (index >= tailOffset())
+		{
+			return unique(tail);
+		}
+
+		Chunk *chunk = unique(root);
+		for (unsigned int level = shift; level > 0; level -= chunkBits)
+		{
+			chunk = unique(chunk->branches[(index >> level) & chunkMask]);
+		}
+		return chunk;
+	}
+	Node::PersistentList::Chunk *Node::PersistentList::popLeaf(size_t offset)
+	{
+		std::vector<Chunk*> path;
+		Chunk *chunk = unique(root);
+		path.push_back(chunk);
+		for (unsigned int level = shift; level > chunkBits; level -= chunkBits)
+		{
+			chunk = unique(chunk->branches[(offset >> level) & chunkMask]);
+			path.push_back(chunk);
+		}
+
+		// Ownership of the leaf moves from the trie to the caller
+		Chunk *leaf = chunk->branches.back();
+		chunk->branches.pop_back();
+
+		for (size_t i = path.size()-1; i > 0 && path[i]->branches.empty(); --i)
+		{
+			release(path[i-1]->branches.back());
+			path[i-1]->branches.pop_back();
+		}
+
+		if (root->branches.empty())
+		{
+			release(root);
+			root = NULL;
+			shift = chunkBits;
+		}
+		else
+		{
+			while (shift > chunkBits && root->branches.size() == 1)
+			{
+				Chunk *child = root->branches.front();
+				++child->refCount;
+				release(root);
+				root = child;
+				shift -= chunkBits;
+			}
+		}
+
+		return leaf;
+	}
+
+	Node::PersistentList::Chunk *Node::PersistentList::unique(Chunk *&chunk)
+	{
+		if (chunk->refCount > 1)
+		{
+			Chunk *copy = new Chunk(*chunk);
+			--chunk->refCount;
+			chunk = copy;
+		}
+		return chunk;
+	}
+	void Node::PersistentList::release(Chunk *chunk)
+	{
+		if (chunk != NULL && --chunk->refCount == 0)
+		{
+			for (std::vector<Chunk*>::iterator it = chunk->branches.begin(); it != chunk->branches.end(); ++it)
+			{
+				release(*it);
+			}
+			delete chunk;
+		}
+	}
+#endif
+
+
+	std::string escapeString(const std::string &value)
+	{
+		std::string escaped;
+		escaped.reserve(value.length());
+
+		const char *it = value.data();
+		const char *end = it + value.size();
+		for (;;)
+		{
+			const char *run = skipUnescaped(it, end);
+			escaped.append(it, run);
+			if (run == end)
+			{
+				break;
+			}
+			char buffer[6];
+			escaped.append(buffer, escapeChar(*run, buffer));
+			it = run + 1;
+		}
+
+		return escaped;
+	}
+	std::string unescapeString(const std::string &value)
+	{
+		if (value.find('\\') == std::string::npos)
+		{
+			return value;
+		}
+
+		std::string unescaped;
+		unescaped.reserve(value.length());
+
+		const char *end = value.data() + value.size();
+		for (const char *it = value.data(); it != end; ++it)
+		{
+			const char c = (*it);
+			char c2 = '\0';
+			if (it+1 != end)
+				c2 = *(it+1);
+
+			if (c == '\\' && c2 == 'u')
+			{
+				unsigned int codePoint;
+				size_t length = readUnicodeEscape(it, end, codePoint);
+				if (length == 0 && readHex4(it+2, end, codePoint))
+				{
+					// Unpaired surrogate
+					codePoint = 0xFFFD;
+					length = 6;
+				}
+				if (length != 0)
+				{
+					appendUtf8(unescaped, codePoint);
+					it += length-1;
+					continue;
+				}
+			}
+
+			const char a = getUnescaped(c, c2);
+			if (a != '\0')
+			{
+				unescaped += a;
+				if (it+1 != end)
+					++it;
+			}
+			else
+			{
+				unescaped += c;
+			}
+		}
+
+		return unescaped;
+	}
+	bool isValidUtf8(const std::string &value)
+	{
+		const char *it = value.data();
+		const char *end = it + value.size();
+		while ((it = skipAscii(it, end)) != end)
+		{
+			const size_t length = utf8SequenceLength(it, end);
+			if (length == 0)
+			{
+				return false;
+			}
+			it += length;
+		}
+		return true;
+	}
+
+	Node invalid()
+	{
+		return Node(Node::T_INVALID);
+	}
+	Node null()
+	{
+		return Node(Node::T_NULL);
+	}
+	Node object()
+	{
+		return Node(Node::T_OBJECT);
+	}
+	Node array()
+	{
+		return Node(Node::T_ARRAY);
+	}
+
+
+	Writer::Writer(const Format &format)
+	{
+		setFormat(format);
+#ifdef JZON_ENABLE_STATS
+		stats = WriteStats();
+		traceHook = NULL;
+		traceUserData = NULL;
+#endif
+	}
+	Writer::~Writer()
+	{
+	}
+
+	void Writer::setFormat(const Format &format)
+	{
+		this->format = format;
+		indentationChar = (format.useTabs ? '\t' : ' ');
+		spacing = (format.spacing ? " " : "");
+		newline = (format.newline ? "\n" : spacing);
+	}
+
+	void Writer::writeStream(const Node &node, std::ostream &stream) const
+	{
+#ifdef JZON_ENABLE_STATS
+		stats = WriteStats();
+		JZON_TRACE(TRACE_WRITE, true);
+		const double start = statsClock();
+		const std::streampos begin = stream.tellp();
+#endif
+
+		writeNode(node, 0, stream);
+
+#ifdef JZON_ENABLE_STATS
+		const std::streampos end = stream.tellp();
+		if (begin != std::streampos(-1) && end != std::streampos(-1))
+			stats.bytes = static_cast<size_t>(end - begin);
+		stats.seconds = statsClock() - start;
+		JZON_TRACE(TRACE_WRITE, false);
+#endif
+	}
+	void Writer::writeString(const Node &node, std::string &json) const
+	{
+		std::ostringstream stream(json);
+		writeStream(node, stream);
+		json = stream.str();
+	}
+	void Writer::writeFile(const Node &node, const std::string &filename) const
+	{
+		std::ofstream stream(filename.c_str(), std::ios::out | std::ios::trunc);
+		writeStream(node, stream);
+	}
+
+	namespace
+	{
+		// Reads the tokens queued by Parser::tokenize() like a Reader would
+		class QueueSource
+		{
+		public:
+			QueueSource(std::queue<Reader::Token> &tokens, std::queue<std::pair<Node::Type, std::string> > &data) : tokens(tokens), data(data), hasData(false) {}
+
+			Reader::Token next()
+			{
+				if (hasData)
+					data.pop();
+				if (tokens.empty())
+				{
+					hasData = false;
+					return Reader::T_END;
+				}
+				const Reader::Token token = tokens.front();
+				tokens.pop();
+				hasData = (token == Reader::T_VALUE || token == Reader::T_UNKNOWN);
+				return token;
+			}
+			Reader::Token peek() const
+			{
+				return (tokens.empty() ? Reader::T_END : tokens.front());
+			}
+			Node::Type getType() const { return data.front().first; }
+			std::string &getValue() { return data.front().second; }
+			// Errors stop tokenize() before they are queued
+			const std::string &getError() const { return error; }
+
+		private:
+			std::queue<Reader::Token> &tokens;
+			std::queue<std::pair<Node::Type, std::string> > &data;
+			bool hasData;
+			std::string error;
+		};
+
+		// Adds a look at the next token to a Reader, keeping the value of the
+		// current one until next() moves on
+		class ReaderSource
+		{
+		public:
+			explicit ReaderSource(Reader &reader) : reader(reader), peeked(Reader::T_END), hasPeeked(false), type(Node::T_INVALID) {}
+
+			Reader::Token next()
+			{
+				if (hasPeeked)
+				{
+					hasPeeked = false;
+					return peeked;
+				}
+				return reader.next();
+			}
+			Reader::Token peek()
+			{
+				if (!hasPeeked)
+				{
+					type = reader.getType();
+					value.swap(reader.getValue());
+					peeked = reader.next();
+					hasPeeked = true;
+				}
+				return peeked;
+			}
+			Node::Type getType() const { return (hasPeeked ? type : reader.getType()); }
+			std::string &getValue() { return (hasPeeked ? value : reader.getValue()); }
+			const std::string &getError() const { return reader.getError(); }
+
+		private:
+			Reader &reader;
+			Reader::Token peeked;
+			bool hasPeeked;
+			Node::Type type;
+			std::string value;
+		};
+
+		// Checks that the tokens form a document and hands each container and
+		// value to the sink, so Parser::assemble() and Writer::reformatBuffer()
+		// accept the same input with the same errors. The name is NULL outside
+		// of objects. Outermost containers are passed on one after another, the
+		// sink decides what to do with more than one. Sinks return false to
+		// stop, with the reason in getError().
+		template <typename Source, typename Sink>
+		bool assembleTokens(Source &source, Sink &sink, std::string &error)
+		{
+			std::vector<bool> objects; // Whether each open container is an object
+			std::string name;
+			bool done = false;
+
+			for (;;)
+			{
+				const Reader::Token token = source.next();
+				switch (token)
+				{
+				case Reader::T_END:
+					{
+						if (!objects.empty())
+						{
+							error = "Unexpected end of input";
+							return false;
+						}
+						if (!done)
+						{
+							error = "No object or array found";
+							return false;
+						}
+						return true;
+					}
+				case Reader::T_ERROR:
+					{
+						error = source.getError();
+						return false;
+					}
+				case Reader::T_UNKNOWN:
+					{
+						error = "Unknown token: "+source.getValue();
+						return false;
+					}
+				case Reader::T_OBJ_BEGIN: // Fallthrough
+				case Reader::T_ARRAY_BEGIN:
+					{
+						const bool object = (token == Reader::T_OBJ_BEGIN);
+						if (!sink.begin(object, (!objects.empty() && objects.back() ? &name : NULL), objects.size()))
+						{
+							error = sink.getError();
+							return false;
+						}
+						objects.push_back(object);
+						name.clear();
+						break;
+					}
+				case Reader::T_OBJ_END: // Fallthrough
+				case Reader::T_ARRAY_END:
+					{
+						const bool object = (token == Reader::T_OBJ_END);
+						if (objects.empty())
+						{
+							error = "Found end of object or array without beginning";
+							return false;
+						}
+						if (objects.back() != object)
+						{
+							error = (object ? "Mismatched end and beginning of object" : "Mismatched end and beginning of array");
+							return false;
+						}
+						objects.pop_back();
+						if (!sink.end(object, objects.size()))
+						{
+							error = sink.getError();
+							return false;
+						}
+						done = done || objects.empty();
+						break;
+					}
+				case Reader::T_VALUE:
+					{
+						if (source.peek() == Reader::T_SEPARATOR_NAME)
+						{
+							if (source.getType() != Node::T_STRING)
+							{
+								error = "A name has to be a string";
+								return false;
+							}
+							name.swap(source.getValue());
+							source.next();
+							break;
+						}
+						if (objects.empty())
+						{
+							error = "Outermost node must be an object or array";
+							return false;
+						}
+						if (!sink.value(source.getType(), source.getValue(), (objects.back() ? &name : NULL), objects.size()))
+						{
+							error = sink.getError();
+							return false;
+						}
+						name.clear();
+						break;
+					}
+				case Reader::T_SEPARATOR_NAME:
+					break;
+				case Reader::T_SEPARATOR_NODE:
+					{
+						if (source.peek() == Reader::T_ARRAY_END)
+						{
+							error = "Extra comma in array";
+							return false;
+						}
+						break;
+					}
+				}
+			}
+		}
+	}
+
+	// Writes what assembleTokens() finds where Writer::writeNode() would,
+	// instead of adding it to a node
+	class Writer::Reformatter
+	{
+	public:
+		Reformatter(const Writer &writer, std::ostream &stream) : writer(writer), stream(stream), done(false) {}
+
+		bool begin(bool object, const std::string *name, size_t depth)
+		{
+			if (depth == 0 && done)
+			{
+				error = "Only one outermost object or array is allowed";
+				return false;
+			}
+			writePrefix(name, depth);
+			stream << (object ? "{" : "[") << writer.newline;
+			empty.push_back(true);
+			JZON_STAT(++writer.stats.nodes[object ? Node::T_OBJECT : Node::T_ARRAY]);
+			JZON_STAT(writer.stats.maxDepth = std::max<size_t>(writer.stats.maxDepth, depth+1));
+			return true;
+		}
+		bool end(bool object, size_t depth)
+		{
+			empty.pop_back();
+			stream << writer.newline << writer.getIndentation(static_cast<unsigned int>(depth)) << (object ? "}" : "]");
+			done = true;
+			return true;
+		}
+		bool value(Node::Type type, const std::string &value, const std::string *name, size_t depth)
+		{
+			writePrefix(name, depth);
+			if (type == Node::T_STRING)
+			{
+				size_t escapes = 0;
+				writeQuoted(stream, value, escapes);
+				JZON_STAT(writer.stats.stringBytes += value.size());
+				JZON_STAT(writer.stats.escapes += escapes);
+			}
+			else if (type == Node::T_NULL)
+			{
+				stream << "null";
+			}
+			else
+			{
+				stream << value;
+			}
+			JZON_STAT(++writer.stats.nodes[type]);
+			JZON_STAT(writer.stats.maxDepth = std::max<size_t>(writer.stats.maxDepth, depth+1));
+			return true;
+		}
+		const std::string &getError() const
+		{
+			return error;
+		}
+
+	private:
+		void writePrefix(const std::string *name, size_t depth)
+		{
+			if (empty.empty())
+				return;
+			writer.writeChildPrefix(name, empty.back(), writer.getIndentation(static_cast<unsigned int>(depth)), stream);
+			empty.back() = false;
+		}
+
+		const Writer &writer;
+		std::ostream &stream;
+		std::vector<bool> empty; // Whether each open container has no children yet
+		bool done;
+		std::string error;
+	};
+
+	bool Writer::reformatBuffer(const char *json, size_t length, std::ostream &stream, std::string *error) const
+	{
+#ifdef JZON_ENABLE_STATS
+		stats = WriteStats();
+		JZON_TRACE(TRACE_WRITE, true);
+		const double start = statsClock();
+		const std::streampos begin = stream.tellp();
+#endif
+
+		Reader reader(json, length);
+		ReaderSource source(reader);
+		Reformatter reformatter(*this, stream);
+		std::string message;
+		const bool success = assembleTokens(source, reformatter, message);
+
+#ifdef JZON_ENABLE_STATS
+		// The output size, like writeStream()
+		const std::streampos end = stream.tellp();
+		if (begin != std::streampos(-1) && end != std::streampos(-1))
+			stats.bytes = static_cast<size_t>(end - begin);
+		stats.seconds = statsClock() - start;
+		JZON_TRACE(TRACE_WRITE, false);
+#endif
+
+		if (!success && error != NULL)
+		{
+			*error = message;
+		}
+		return success;
+	}
+	bool Writer::reformatString(const std::string &json, std::string &output, std::string *error) const
+	{
+		std::ostringstream stream;
+		const bool success = reformatBuffer(json.data(), json.size(), stream, error);
+		output = stream.str();
+		return success;
+	}
+	bool Writer::reformatStream(std::istream &input, std::ostream &output, std::string *error) const
+	{
+		// The Reader needs the whole text, since tokens can span any read
+		std::string json;
+		char buffer[4096];
+		while (input.read(buffer, sizeof(buffer)) || input.gcount() > 0)
+		{
+			json.append(buffer, static_cast<size_t>(input.gcount()));
+		}
+		return reformatBuffer(json.data(), json.size(), output, error);
+	}
+
+#ifdef JZON_ENABLE_STATS
+	const WriteStats &Writer::getStats() const
+	{
+		return stats;
+	}
+	void Writer::setTraceHook(TraceHook hook, void *userData)
+	{
+		traceHook = hook;
+		traceUserData = userData;
+	}
+#endif
+
+	void Writer::writeNode(const Node &node, unsigned int level, std::ostream &stream) const
+	{
+		JZON_STAT(++stats.nodes[node.getType()]);
+		JZON_STAT(stats.maxDepth = std::max<size_t>(stats.maxDepth, level+1));
+
+		switch (node.getType())
+		{
+		case Node::T_INVALID: break;
+		case Node::T_OBJECT: writeObject(node, level, stream); break;
+		case Node::T_ARRAY: writeArray(node, level, stream); break;
+		case Node::T_NULL: // Fallthrough
+		case Node::T_STRING: // Fallthrough
+		case Node::T_NUMBER: // Fallthrough
+		case Node::T_BOOL: writeValue(node, stream); break;
+		}
+	}
+	void Writer::writeObject(const Node &node, unsigned int level, std::ostream &stream) const
+	{
+		stream << "{" << newline;
+		writeChildren(node, 0, node.getCount(), level, stream);
+		stream << newline << getIndentation(level) << "}";
+	}
+	void Writer::writeArray(const Node &node, unsigned int level, std::ostream &stream) const
+	{
+		stream << "[" << newline;
+		writeChildren(node, 0, node.getCount(), level, stream);
+		stream << newline << getIndentation(level) << "]";
+	}
+	void Writer::writeValue(const Node &node, std::ostream &stream) const
+	{
+		if (node.isString())
+		{
+			const std::string &value = node.data->valueStr;
+			size_t escapes = 0;
+			writeQuoted(stream, value, escapes);
+			JZON_STAT(stats.stringBytes += value.size());
+			JZON_STAT(stats.escapes += escapes);
+		}
+		else if (node.isNull())
+		{
+			stream << "null";
+		}
+		else
+		{
+			stream << node.data->valueStr;
+		}
+	}
+
+	void Writer::writeChildren(const Node &node, size_t begin, size_t end, unsigned int level, std::ostream &stream) const
+	{
+		const std::string indentation = getIndentation(level+1);
+
+		if (node.isPacked())
+		{
+			const long long *integers = node.getIntegerData();
+			const double *reals = node.getDoubleData();
+			char buffer[32];
+			for (size_t i = begin; i < end; ++i)
+			{
+				writeChildPrefix(NULL, i == 0, indentation, stream);
+				stream.write(buffer, static_cast<std::streamsize>(integers != NULL ? formatPackedInteger(buffer, integers[i]) : formatPackedReal(buffer, reals[i])));
+			}
+			JZON_STAT(stats.nodes[Node::T_NUMBER] += end - begin);
+			JZON_STAT(stats.maxDepth = std::max<size_t>(stats.maxDepth, level+2));
+			return;
+		}
+
+		// Indexed directly, since chunks start in the middle of the children
+		const bool object = node.isObject();
+		const Node::NamedNodeList &children = node.data->children;
+		for (size_t i = begin; i < end; ++i)
+		{
+			const NamedNode &child = children[i];
+			writeChildPrefix(object ? &child.first : NULL, i == 0, indentation, stream);
+			writeNode(child.second, level+1, stream);
+		}
+	}
+	void Writer::writeChildPrefix(const std::string *name, bool first, const std::string &indentation, std::ostream &stream) const
+	{
+		if (!first)
+			stream << "," << newline;
+		stream << indentation;
+		if (name != NULL)
+		{
+			writeQuoted(stream, *name);
+			stream << ":" << spacing;
+		}
+	}
+
+	namespace
+	{
+		// Rough cost of writing a node, used to split the work evenly
+		typedef std::map<const Node*, size_t> WeightMap;
+
+		// Remembers the weights above minWeight, so that planning a large
+		// container doesn't walk its children again at every level
+		size_t measureWeights(const Node &node, size_t minWeight, WeightMap &weights)
+		{
+			if (!node.isContainer() || node.isPacked())
+			{
+				return 1 + node.getCount();
+			}
+			size_t weight = 1;
+			for (Node::const_iterator it = node.begin(); it != node.end(); ++it)
+			{
+				weight += measureWeights((*it).second, minWeight, weights);
+			}
+			if (weight > minWeight)
+			{
+				weights[&node] = weight;
+			}
+			return weight;
+		}
+		// Nodes missing from the map weigh at most minWeight, so walking them is cheap
+		size_t writeWeight(const Node &node, const WeightMap &weights)
+		{
+			const WeightMap::const_iterator it = weights.find(&node);
+			if (it != weights.end())
+			{
+				return it->second;
+			}
+			WeightMap none;
+			return measureWeights(node, static_cast<size_t>(-1), none);
+		}
+	}
+
+	struct Writer::ChunkPlan
+	{
+		struct Job
+		{
+			const Node *node;
+			size_t begin;
+			size_t end; // Children to write, or the whole node when begin == end
+			unsigned int level;
+			size_t chunk;
+		};
+
+		void addJob(const Node *node, size_t begin, size_t end, unsigned int level)
+		{
+			flush();
+			Job job = { node, begin, end, level, chunks.size() };
+			jobs.push_back(job);
+			chunks.push_back(std::string());
+		}
+		void flush()
+		{
+			if (literal.tellp() > 0)
+			{
+				chunks.push_back(literal.str());
+				literal.str(std::string());
+			}
+		}
+
+		std::vector<std::string> chunks;
+		std::vector<Job> jobs;
+		std::ostringstream literal; // Text between jobs
+		WeightMap weights; // See measureWeights()
+	};
+
+	void Writer::planChunks(const Node &node, unsigned int level, size_t target, ChunkPlan &plan) const
+	{
+		if (!node.isContainer() || node.getCount() == 0 || writeWeight(node, plan.weights) <= target)
+		{
+			plan.addJob(&node, 0, 0, level);
+			return;
+		}
+
+		// Written here instead of by writeNode()
+		JZON_STAT(++stats.nodes[node.getType()]);
+		JZON_STAT(stats.maxDepth = std::max<size_t>(stats.maxDepth, level+1));
+
+		const bool object = node.isObject();
+		plan.literal << (object ? "{" : "[") << newline;
+
+		const size_t count = node.getCount();
+		if (node.isPacked())
+		{
+			for (size_t begin = 0; begin < count; begin += target)
+			{
+				plan.addJob(&node, begin, std::min(begin + target, count), level);
+			}
+		}
+		else
+		{
+			const std::string indentation = getIndentation(level+1);
+			size_t index = 0;
+			size_t groupBegin = 0;
+			size_t groupWeight = 0;
+			for (Node::const_iterator it = node.begin(); it != node.end(); ++it, ++index)
+			{
+				const size_t weight = writeWeight((*it).second, plan.weights);
+				if (weight > target)
+				{
+					// Too big for one chunk, so split it up as well
+					if (groupBegin < index)
+						plan.addJob(&node, groupBegin, index, level);
+					writeChildPrefix(object ? &(*it).first : NULL, index == 0, indentation, plan.literal);
+					planChunks((*it).second, level+1, target, plan);
+					groupBegin = index+1;
+					groupWeight = 0;
+				}
+				else if (groupWeight + weight > target && groupBegin < index)
+				{
+					plan.addJob(&node, groupBegin, index, level);
+					groupBegin = index;
+					groupWeight = weight;
+				}
+				else
+				{
+					groupWeight += weight;
+				}
+			}
+			if (groupBegin < index)
+				plan.addJob(&node, groupBegin, index, level);
+		}
+
+		plan.literal << newline << getIndentation(level) << (object ? "}" : "]");
+	}
+
+	void Writer::writeChunks(const Node &node, std::vector<std::string> &chunks, unsigned int threads) const
+	{
+#ifdef JZON_ENABLE_STATS
+		stats = WriteStats();
+		JZON_TRACE(TRACE_WRITE, true);
+		const double start = statsClock();
+#endif
+
+#ifdef JZON_THREADS
+		if (threads == 0)
+		{
+			threads = std::thread::hardware_concurrency();
+		}
+#endif
+		if (threads == 0)
+		{
+			threads = 1;
+		}
+
+		// A few chunks per thread, so that uneven chunks still balance out
+		const size_t minChunkWeight = 4096;
+		ChunkPlan plan;
+		const size_t target = std::max<size_t>(minChunkWeight, measureWeights(node, minChunkWeight, plan.weights) / (threads * 8));
+
+		planChunks(node, 0, target, plan);
+		plan.flush();
+
+		// Each job writes with its own copy of the writer, since the
+		// statistics are not shared between threads
+		std::vector<Writer> writers(std::min<size_t>(threads, plan.jobs.size()), *this);
+		const std::vector<ChunkPlan::Job> &jobs = plan.jobs;
+		std::vector<std::string> &output = plan.chunks;
+
+#ifdef JZON_THREADS
+		if (writers.size() > 1)
+		{
+			std::atomic<size_t> nextJob(0);
+			std::vector<std::thread> workers;
+			for (size_t t = 0; t < writers.size(); ++t)
+			{
+				workers.push_back(std::thread([&jobs, &output, &writers, &nextJob, t]()
+				{
+					const Writer &writer = writers[t];
+					for (size_t j = nextJob++; j < jobs.size(); j = nextJob++)
+					{
+						const ChunkPlan::Job &job = jobs[j];
+						std::ostringstream stream;
+						if (job.begin == job.end)
+							writer.writeNode(*job.node, job.level, stream);
+						else
+							writer.writeChildren(*job.node, job.begin, job.end, job.level, stream);
+						output[job.chunk] = stream.str();
+					}
+				}));
+			}
+			for (size_t t = 0; t < workers.size(); ++t)
+			{
+				workers[t].join();
+			}
+		}
+		else
+#endif
+		{
+			for (size_t j = 0; j < jobs.size(); ++j)
+			{
+				const ChunkPlan::Job &job = jobs[j];
+				std::ostringstream stream;
+				if (job.begin == job.end)
+					writers[0].writeNode(*job.node, job.level, stream);
+				else
+					writers[0].writeChildren(*job.node, job.begin, job.end, job.level, stream);
+				output[job.chunk] = stream.str();
+			}
+		}
+
+		chunks.swap(output);
+
+#ifdef JZON_ENABLE_STATS
+		for (size_t t = 0; t < writers.size(); ++t)
+		{
+			const WriteStats &workerStats = writers[t].stats;
+			for (size_t i = 0; i <= Node::T_BOOL; ++i)
+				stats.nodes[i] += workerStats.nodes[i];
+			stats.maxDepth = std::max(stats.maxDepth, workerStats.maxDepth);
+			stats.stringBytes += workerStats.stringBytes;
+			stats.escapes += workerStats.escapes;
+		}
+		for (size_t i = 0; i < chunks.size(); ++i)
+			stats.bytes += chunks[i].size();
+		stats.seconds = statsClock() - start;
+		JZON_TRACE(TRACE_WRITE, false);
+#endif
+	}
+	void Writer::writeStreamParallel(const Node &node, std::ostream &stream, unsigned int threads) const
+	{
+		std::vector<std::string> chunks;
+		writeChunks(node, chunks, threads);
+		for (size_t i = 0; i < chunks.size(); ++i)
+		{
+			stream.write(chunks[i].data(), static_cast<std::streamsize>(chunks[i].size()));
+		}
+	}
+
+	std::string Writer::getIndentation(unsigned int level) const
+	{
+		if (!format.newline)
+		{
+			return "";
+		}
+		else
+		{
+			return std::string(format.indentSize * level, indentationChar);
+		}
+	}
+
+
+	ParseLimits::ParseLimits() : maxBytes(0), maxDepth(0), maxNodes(0), maxStringLength(0), maxContainerSize(0)
+	{
+	}
+
+	Parser::Parser() : schema(NULL), internValues(false)
+	{
+#ifdef JZON_ENABLE_STATS
+		stats = ParseStats();
+		traceHook = NULL;
+		traceUserData = NULL;
+#endif
+	}
+	Parser::~Parser()
+	{
+	}
+
+	namespace
+	{
+		// Every word of a tape has a tag in the top byte and a payload below it:
+		//   object, array  index after the matching end, then a word with the count
+		//   end            index of the matching object or array
+		//   string, number offset in the string buffer, then a word with the length
+		//   true, false, null
+		// Object members are a string for the name followed by the value.
+		// Strings are stored unescaped and null-terminated.
+		enum TapeTag
+		{
+			TAPE_OBJECT = 1,
+			TAPE_ARRAY,
+			TAPE_END,
+			TAPE_STRING,
+			TAPE_NUMBER,
+			TAPE_TRUE,
+			TAPE_FALSE,
+			TAPE_NULL
+		};
+		const unsigned int tapeTagShift = 56;
+		const unsigned long long tapePayloadMask = (1ULL << tapeTagShift) - 1;
+
+		inline unsigned long long tapeWord(TapeTag tag, unsigned long long payload)
+		{
+			return (static_cast<unsigned long long>(tag) << tapeTagShift) | payload;
+		}
+		inline TapeTag tapeTag(unsigned long long word)
+		{
+			return static_cast<TapeTag>(word >> tapeTagShift);
+		}
+		inline size_t tapePayload(unsigned long long word)
+		{
+			return static_cast<size_t>(word & tapePayloadMask);
+		}
+		// Index of the word after the value at index
+		inline size_t tapeSkip(const std::vector<unsigned long long> &tape, size_t index)
+		{
+			switch (tapeTag(tape[index]))
+			{
+			case TAPE_OBJECT: // Fallthrough
+			case TAPE_ARRAY:
+				return tapePayload(tape[index]);
+			case TAPE_STRING: // Fallthrough
+			case TAPE_NUMBER:
+				return index+2;
+			default:
+				return index+1;
+			}
+		}
+		void addTapeString(std::vector<unsigned long long> &tape, std::string &strings, TapeTag tag, const std::string &value)
+		{
+			tape.push_back(tapeWord(tag, strings.size()));
+			tape.push_back(value.size());
+			strings.append(value);
+			strings += '\0';
+		}
+
+		// Reads the next token, with the schema checking it like Parser::tokenize()
+		// Checks ParseLimits as tokens are read, see Parser::setLimits()
+		class LimitChecker
+		{
+		public:
+			explicit LimitChecker(const ParseLimits &limits) : limits(limits), nodes(0)
+			{
+			}
+
+			bool isEnabled() const
+			{
+				return (limits.maxDepth != 0 || limits.maxNodes != 0 || limits.maxContainerSize != 0);
+			}
+
+			// Returns false at the first token over a limit
+			bool token(Reader::Token token)
+			{
+				switch (token)
+				{
+				case Reader::T_OBJ_BEGIN: // Fallthrough
+				case Reader::T_ARRAY_BEGIN:
+					{
+						if (!addNode())
+							return false;
+						if (limits.maxDepth != 0 && frames.size() >= limits.maxDepth)
+							return fail("Nesting is deeper than ", limits.maxDepth, " levels");
+						Frame frame = { (token == Reader::T_OBJ_BEGIN), (token == Reader::T_OBJ_BEGIN), 0 };
+						frames.push_back(frame);
+						return true;
+					}
+				case Reader::T_OBJ_END: // Fallthrough
+				case Reader::T_ARRAY_END:
+					{
+						if (!frames.empty())
+							frames.pop_back();
+						return true;
+					}
+				case Reader::T_SEPARATOR_NODE:
+					{
+						if (!frames.empty())
+							frames.back().expectingName = frames.back().object;
+						return true;
+					}
+				case Reader::T_VALUE:
+					{
+						if (!frames.empty() && frames.back().expectingName)
+						{
+							frames.back().expectingName = false;
+							return true;
+						}
+						return addNode();
+					}
+				default:
+					return true;
+				}
+			}
+			const std::string &getError() const
+			{
+				return error;
+			}
+
+		private:
+			struct Frame
+			{
+				bool object;
+				bool expectingName;
+				size_t count;
+			};
+
+			bool addNode()
+			{
+				if (limits.maxNodes != 0 && ++nodes > limits.maxNodes)
+					return fail("Document has more than ", limits.maxNodes, " nodes");
+				if (limits.maxContainerSize != 0 && !frames.empty() && ++frames.back().count > limits.maxContainerSize)
+					return fail("Object or array has more than ", limits.maxContainerSize, " children");
+				return true;
+			}
+			bool fail(const char *before, size_t limit, const char *after)
+			{
+				std::ostringstream message;
+				message << before << limit << after;
+				error = message.str();
+				return false;
+			}
+
+			const ParseLimits &limits;
+			size_t nodes;
+			std::vector<Frame> frames;
+			std::string error;
+		};
+
+		std::string sizeLimitError(size_t maxBytes)
+		{
+			std::ostringstream message;
+			message << "Input is larger than " << maxBytes << " bytes";
+			return message.str();
+		}
+
+		Reader::Token nextTapeToken(Reader &reader, Schema::Validator *validator, LimitChecker *limits)
+		{
+			Reader::Token token = reader.next();
+			if (validator != NULL && !validator->token(token, reader.getType(), reader.getValue()))
+			{
+				reader.setError(validator->getError());
+				token = Reader::T_ERROR;
+			}
+			else if (limits != NULL && !limits->token(token))
+			{
+				reader.setError(limits->getError());
+				token = Reader::T_ERROR;
+			}
+			return token;
+		}
+	}
+
+	Node Parser::parseStream(std::istream &stream)
+	{
+		std::string json;
+		char buffer[4096];
+		while (stream.read(buffer, sizeof(buffer)) || stream.gcount() > 0)
+		{
+			json.append(buffer, static_cast<size_t>(stream.gcount()));
+			// Enough to fail, without reading the rest
+			if (limits.maxBytes != 0 && json.size() > limits.maxBytes)
+				break;
+		}
+		return parseBuffer(json.data(), json.size());
+	}
+	Node Parser::parseString(const std::string &json)
+	{
+		return parseBuffer(json.data(), json.size());
+	}
+	Node Parser::parseFile(const std::string &filename)
+	{
+		if (limits.maxBytes != 0 && fileLargerThan(filename, limits.maxBytes))
+		{
+			error = sizeLimitError(limits.maxBytes);
+			return Node(Node::T_INVALID);
+		}
+		std::string json;
+		readFile(filename, json, limits.maxBytes);
+		return parseBuffer(json.data(), json.size());
+	}
+	Node Parser::parseBuffer(const char *json, size_t length)
+	{
+		TokenQueue tokens;
+		DataQueue data;
+
+		error.clear();
+		if (limits.maxBytes != 0 && length > limits.maxBytes)
+		{
+			error = sizeLimitError(limits.maxBytes);
+			return Node(Node::T_INVALID);
+		}
+
+#ifdef JZON_ENABLE_STATS
+		stats = ParseStats();
+		stats.bytes = length;
+		JZON_TRACE(TRACE_PARSE, true);
+		JZON_TRACE(TRACE_TOKENIZE, true);
+		const double start = statsClock();
+#endif
+
+		const bool tokenized = tokenize(json, json+length, tokens, data);
+
+#ifdef JZON_ENABLE_STATS
+		const double scanned = statsClock();
+		stats.scanSeconds = (scanned - start) - stats.interpretSeconds;
+		JZON_TRACE(TRACE_TOKENIZE, false);
+		JZON_TRACE(TRACE_ASSEMBLE, true);
+#endif
+
+		Node node = (tokenized ? assemble(tokens, data) : Node(Node::T_INVALID));
+
+#ifdef JZON_ENABLE_STATS
+		stats.assembleSeconds = statsClock() - scanned;
+		JZON_TRACE(TRACE_ASSEMBLE, false);
+		JZON_TRACE(TRACE_PARSE, false);
+#endif
+
+		return node;
+	}
+
+	bool Parser::parseTapeString(const std::string &json, TapeDocument &document)
+	{
+		return parseTapeBuffer(json.data(), json.size(), document);
+	}
+	bool Parser::parseTapeFile(const std::string &filename, TapeDocument &document)
+	{
+		if (limits.maxBytes != 0 && fileLargerThan(filename, limits.maxBytes))
+		{
+			error = sizeLimitError(limits.maxBytes);
+			document.clear();
+			return false;
+		}
+		std::string json;
+		readFile(filename, json, limits.maxBytes);
+		return parseTapeBuffer(json.data(), json.size(), document);
+	}
+	bool Parser::parseTapeBuffer(const char *json, size_t length, TapeDocument &document)
+	{
+		error.clear();
+		document.clear();
+		if (limits.maxBytes != 0 && length > limits.maxBytes)
+		{
+			error = sizeLimitError(limits.maxBytes);
+			return false;
+		}
+
+		std::vector<unsigned long long> &tape = document.tape;
+		std::string &strings = document.strings;
+		tape.reserve(length/8 + 16);
+
+		Reader reader(json, length);
+		reader.setMaxStringLength(limits.maxStringLength);
+		static const Schema noSchema;
+		Schema::Validator validator(schema != NULL ? *schema : noSchema);
+		Schema::Validator *checker = (schema != NULL ? &validator : NULL);
+		LimitChecker limitChecker(limits);
+		LimitChecker *limited = (limitChecker.isEnabled() ? &limitChecker : NULL);
+
+		// Tape index and number of children of each open container
+		std::vector<std::pair<size_t, size_t> > open;
+		bool named = false;
+		std::string value;
+
+		Reader::Token token = nextTapeToken(reader, checker, limited);
+		for (;;)
+		{
+			switch (token)
+			{
+			case Reader::T_END:
+				{
+					if (!open.empty())
+					{
+						error = "Unexpected end of input";
+						document.clear();
+						return false;
+					}
+					return !tape.empty();
+				}
+			case Reader::T_ERROR:
+				{
+					error = reader.getError();
+					document.clear();
+					return false;
+				}
+			case Reader::T_UNKNOWN:
+				{
+					error = "Unknown token: "+reader.getValue();
+					document.clear();
+					return false;
+				}
+			case Reader::T_OBJ_BEGIN: // Fallthrough
+			case Reader::T_ARRAY_BEGIN:
+				{
+					if (open.empty())
+					{
+						// Like parseBuffer(), the last of several roots is kept
+						document.clear();
+					}
+					else
+					{
+						if (tapeTag(tape[open.back().first]) == TAPE_OBJECT && !named)
+							addTapeString(tape, strings, TAPE_STRING, std::string());
+						++open.back().second;
+					}
+					named = false;
+					open.push_back(std::make_pair(tape.size(), size_t(0)));
+					tape.push_back(tapeWord(token == Reader::T_OBJ_BEGIN ? TAPE_OBJECT : TAPE_ARRAY, 0));
+					tape.push_back(0);
+					break;
+				}
+			case Reader::T_OBJ_END: // Fallthrough
+			case Reader::T_ARRAY_END:
+				{
+					if (open.empty())
+					{
+						error = "Found end of object or array without beginning";
+						document.clear();
+						return false;
+					}
+					const size_t start = open.back().first;
+					const TapeTag tag = tapeTag(tape[start]);
+					if (token == Reader::T_OBJ_END && tag != TAPE_OBJECT)
+					{
+						error = "Mismatched end and beginning of object";
+						document.clear();
+						return false;
+					}
+					if (token == Reader::T_ARRAY_END && tag != TAPE_ARRAY)
+					{
+						error = "Mismatched end and beginning of array";
+						document.clear();
+						return false;
+					}
+
+					if (named)
+					{
+						// A name without a value is dropped
+						tape.resize(tape.size()-2);
+					}
+					tape.push_back(tapeWord(TAPE_END, start));
+					tape[start] = tapeWord(tag, tape.size());
+					tape[start+1] = open.back().second;
+					open.pop_back();
+					named = false;
+					break;
+				}
+			case Reader::T_VALUE:
+				{
+					// Looking ahead for ':' replaces the value in the reader
+					const Node::Type type = reader.getType();
+					value.swap(reader.getValue());
+
+					const Reader::Token following = nextTapeToken(reader, checker, limited);
+					if (following == Reader::T_SEPARATOR_NAME)
+					{
+						if (type != Node::T_STRING)
+						{
+							error = "A name has to be a string";
+							document.clear();
+							return false;
+						}
+						// Names inside arrays are dropped, like parseBuffer() does
+						if (!open.empty() && tapeTag(tape[open.back().first]) == TAPE_OBJECT)
+						{
+							if (named)
+								tape.resize(tape.size()-2);
+							addTapeString(tape, strings, TAPE_STRING, value);
+							named = true;
+						}
+						token = nextTapeToken(reader, checker, limited);
+						continue;
+					}
+
+					if (open.empty())
+					{
+						error = "Outermost node must be an object or array";
+						document.clear();
+						return false;
+					}
+					if (tapeTag(tape[open.back().first]) == TAPE_OBJECT && !named)
+					{
+						addTapeString(tape, strings, TAPE_STRING, std::string());
+					}
+					switch (type)
+					{
+					case Node::T_STRING: addTapeString(tape, strings, TAPE_STRING, value); break;
+					case Node::T_NUMBER: addTapeString(tape, strings, TAPE_NUMBER, value); break;
+					case Node::T_BOOL: tape.push_back(tapeWord(value == "true" ? TAPE_TRUE : TAPE_FALSE, 0)); break;
+					default: tape.push_back(tapeWord(TAPE_NULL, 0)); break;
+					}
+					++open.back().second;
+					named = false;
+
+					token = following;
+					continue;
+				}
+			case Reader::T_SEPARATOR_NODE:
+				{
+					token = nextTapeToken(reader, checker, limited);
+					if (token == Reader::T_ARRAY_END)
+					{
+						error = "Extra comma in array";
+						document.clear();
+						return false;
+					}
+					continue;
+				}
+			case Reader::T_SEPARATOR_NAME:
+				break;
+			}
+			token = nextTapeToken(reader, checker, limited);
+		}
+	}
+
+	Node Parser::parseIndexed(const std::string &filename, const FileIndex &index, size_t element)
+	{
+		error.clear();
+		if (element >= index.getCount())
+		{
+			std::ostringstream message;
+			message << "Element " << element << " is not in the index";
+			error = message.str();
+			return Node(Node::T_INVALID);
+		}
+
+		const FileIndex::Entry &entry = index.entries[element];
+		FileRange range;
+		if (!range.load(filename, entry.begin, entry.end))
+		{
+			error = "Unable to read file: "+filename;
+			return Node(Node::T_INVALID);
+		}
+		if (range.fileSize != index.getFileSize())
+		{
+			error = "The index doesn't match the file: "+filename;
+			return Node(Node::T_INVALID);
+		}
+		return parseElement(range.data, range.length);
+	}
+	Node Parser::parseIndexed(const std::string &filename, const FileIndex &index, const std::string &name)
+	{
+		const size_t element = index.find(name);
+		if (element == index.getCount())
+		{
+			error = "Member '"+name+"' is not in the index";
+			return Node(Node::T_INVALID);
+		}
+		return parseIndexed(filename, index, element);
+	}
+
+	const std::string &Parser::getError() const
+	{
+		return error;
+	}
+
+	void Parser::setSchema(const Schema *schema)
+	{
+		this->schema = schema;
+	}
+	void Parser::setLimits(const ParseLimits &limits)
+	{
+		this->limits = limits;
+	}
+	void Parser::setInternValues(bool intern)
+	{
+		internValues = intern;
+	}
+
+#ifdef JZON_ENABLE_STATS
+	const ParseStats &Parser::getStats() const
+	{
+		return stats;
+	}
+	void Parser::setTraceHook(TraceHook hook, void *userData)
+	{
+		traceHook = hook;
+		traceUserData = userData;
+	}
+#endif
+
+	bool Parser::tokenize(const char *it, const char *end, TokenQueue &tokens, DataQueue &data)
+	{
+		Reader reader(it, end - it);
+		reader.setMaxStringLength(limits.maxStringLength);
+		static const Schema noSchema;
+		Schema::Validator validator(schema != NULL ? *schema : noSchema);
+		LimitChecker limitChecker(limits);
+		const bool limited = limitChecker.isEnabled();
+
+		for (;;)
+		{
+			const Reader::Token token = reader.next();
+			if (schema != NULL && !validator.token(token, reader.getType(), reader.getValue()))
+			{
+				error = validator.getError();
+				return false;
+			}
+			if (limited && !limitChecker.token(token))
+			{
+				error = limitChecker.getError();
+				return false;
+			}
+
+			switch (token)
+			{
+			case Reader::T_END:
+				{
+					JZON_STAT(stats.escapes = reader.getStats().escapes);
+					JZON_STAT(stats.stringBytes = reader.getStats().stringBytes);
+					JZON_STAT(stats.interpretSeconds = reader.getStats().interpretSeconds);
+					return true;
+				}
+			case Reader::T_ERROR:
+				{
+					error = reader.getError();
+					return false;
+				}
+			case Reader::T_VALUE:
+				{
+					data.push(std::make_pair(reader.getType(), std::string()));
+					data.back().second.swap(reader.getValue());
+					break;
+				}
+			case Reader::T_UNKNOWN:
+				{
+					// Store the unknown token, so we can show it to the user
+					data.push(std::make_pair(Node::T_STRING, reader.getValue()));
+					break;
+				}
+			default:
+				break;
+			}
+			tokens.push(token);
+		}
+	}
+	// Builds the nodes for what assembleTokens() finds
+	class Parser::NodeBuilder
+	{
+	public:
+		explicit NodeBuilder(Parser &parser) : parser(parser), root(Node::T_INVALID) {}
+
+		bool begin(bool isObject, const std::string *name, size_t depth)
+		{
+#ifdef JZON_ENABLE_STATS
+			countName(name);
+			countNode(parser.stats, (isObject ? Node::T_OBJECT : Node::T_ARRAY), std::string(), depth+1);
+#else
+			(void)depth;
+#endif
+			nodeStack.push(NamedNode(std::string(), (isObject ? object() : array())));
+			if (name != NULL)
+				nodeStack.top().first = *name;
+			return true;
+		}
+		bool end(bool, size_t)
+		{
+			std::string name;
+			name.swap(nodeStack.top().first);
+			Node node = nodeStack.top().second;
+			nodeStack.pop();
+
+			if (nodeStack.empty())
+				root = node;
+			else if (nodeStack.top().second.isObject())
+				nodeStack.top().second.add(name, node);
+			else
+				nodeStack.top().second.add(node);
+			return true;
+		}
+		bool value(Node::Type type, std::string &value, const std::string *name, size_t depth)
+		{
+#ifndef JZON_ENABLE_STATS
+			(void)depth;
+#endif
+			Node &parent = nodeStack.top().second;
+			if (type == Node::T_NUMBER && parent.addPacked(value))
+			{
+				JZON_STAT(++parser.stats.nodes[Node::T_NUMBER]);
+				JZON_STAT(parser.stats.maxDepth = std::max<size_t>(parser.stats.maxDepth, depth+1));
+				return true;
+			}
+
+			// Common values use immortal data, and repeated short ones share
+			// the data of their first occurrence when interning
+			Node node;
+			node.data = Node::sharedData(type, value);
+			bool shared = (node.data != NULL);
+			Node *first = NULL;
+			if (!shared && parser.internValues && value.size() <= maxInternedLength)
+			{
+				first = &interned[std::make_pair(type, value)];
+				shared = first->isValid();
+				if (shared)
+					node = *first;
+			}
+			if (!shared)
+			{
+				// Strings are unescaped by readString already, so move them
+				// straight into the node
+				node.data = new Node::Data(type);
+				node.data->valueStr.swap(value);
+				if (first != NULL)
+					*first = node;
+			}
+			JZON_STAT(countName(name));
+			JZON_STAT(countNode(parser.stats, node.data->type, node.data->valueStr, depth+1, shared));
+
+			if (name != NULL)
+				parent.add(*name, node);
+			else
+				parent.add(node);
+			return true;
+		}
+		const std::string &getError() const
+		{
+			return error;
+		}
+		const Node &getRoot() const
+		{
+			return root;
+		}
+
+	private:
+#ifdef JZON_ENABLE_STATS
+		void countName(const std::string *name)
+		{
+			if (name != NULL && name->size() > inlineStringCapacity)
+				++parser.stats.allocations;
+		}
+#endif
+
+		Parser &parser;
+		std::stack<NamedNode> nodeStack;
+		Node root;
+		std::map<std::pair<Node::Type, std::string>, Node> interned;
+		std::string error; // Building never fails
+	};
+
+	Node Parser::assemble(TokenQueue &tokens, DataQueue &data)
+	{
+		QueueSource source(tokens, data);
+		NodeBuilder builder(*this);
+		if (!assembleTokens(source, builder, error))
+		{
+			return Node(Node::T_INVALID);
+		}
+		return builder.getRoot();
+	}
+	Node Parser::parseElement(const char *json, size_t length)
+	{
+		const char *it = json;
+		const char *end = json + length;
+		while (it != end && isWhitespace(*it))
+		{
+			++it;
+		}
+		if (it != end && (*it == '{' || *it == '['))
+		{
+			return parseBuffer(json, length);
+		}
+
+		error.clear();
+		if (limits.maxBytes != 0 && length > limits.maxBytes)
+		{
+			error = sizeLimitError(limits.maxBytes);
+			return Node(Node::T_INVALID);
+		}
+		Reader reader(json, length);
+		reader.setMaxStringLength(limits.maxStringLength);
+		static const Schema noSchema;
+		Schema::Validator validator(schema != NULL ? *schema : noSchema);
+		LimitChecker limitChecker(limits);
+
+		const Reader::Token token = reader.next();
+		if (schema != NULL && !validator.token(token, reader.getType(), reader.getValue()))
+		{
+			error = validator.getError();
+		}
+		else if (!limitChecker.token(token))
+		{
+			error = limitChecker.getError();
+		}
+		else if (token == Reader::T_ERROR)
+		{
+			error = reader.getError();
+		}
+		else if (token == Reader::T_UNKNOWN)
+		{
+			error = "Unknown token: "+reader.getValue();
+		}
+		else if (token != Reader::T_VALUE)
+		{
+			error = "Expected a value";
+		}
+		if (!error.empty())
+		{
+			return Node(Node::T_INVALID);
+		}
+
+		// Like assemble(), common values use immortal data, and the rest is
+		// moved into the node, since Reader unescapes strings already
+		Node node;
+		node.data = Node::sharedData(reader.getType(), reader.getValue());
+		if (node.data == NULL)
+		{
+			node.data = new Node::Data(reader.getType());
+			node.data->valueStr.swap(reader.getValue());
+		}
+
+		if (reader.next() != Reader::T_END)
+		{
+			error = "Expected only one value";
+			return Node(Node::T_INVALID);
+		}
+		return node;
+	}
+
+	TapeView::const_iterator &TapeView::const_iterator::operator++()
+	{
+		index = tapeSkip(document->tape, object ? index+2 : index);
+		return *this;
+	}
+	std::string TapeView::const_iterator::getName() const
+	{
+		if (!object)
+		{
+			return std::string();
+		}
+		const unsigned long long *word = &document->tape[index];
+		return std::string(document->strings.data() + tapePayload(word[0]), static_cast<size_t>(word[1]));
+	}
+	TapeView TapeView::const_iterator::operator*() const
+	{
+		return TapeView(document, object ? index+2 : index);
+	}
+
+	TapeView::TapeView() : document(NULL), index(0)
+	{
+	}
+	TapeView::TapeView(const TapeDocument *document, size_t index) : document(document), index(index)
+	{
+	}
+
+	Node::Type TapeView::getType() const
+	{
+		if (document == NULL)
+		{
+			return Node::T_INVALID;
+		}
+		switch (tapeTag(document->tape[index]))
+		{
+		case TAPE_OBJECT: return Node::T_OBJECT;
+		case TAPE_ARRAY: return Node::T_ARRAY;
+		case TAPE_STRING: return Node::T_STRING;
+		case TAPE_NUMBER: return Node::T_NUMBER;
+		case TAPE_TRUE: // Fallthrough
+		case TAPE_FALSE: return Node::T_BOOL;
+		case TAPE_NULL: return Node::T_NULL;
+		default: return Node::T_INVALID;
+		}
+	}
+
+	std::string TapeView::toString(const std::string &def) const
+	{
+		switch (getType())
+		{
+		case Node::T_STRING: // Fallthrough
+		case Node::T_NUMBER:
+			{
+				const unsigned long long *word = &document->tape[index];
+				return std::string(document->strings.data() + tapePayload(word[0]), static_cast<size_t>(word[1]));
+			}
+		case Node::T_BOOL: return (toBool() ? "true" : "false");
+		case Node::T_NULL: return "null";
+		default: return def;
+		}
+	}
+	int TapeView::toInt(int def) const
+	{
+		if (!isNumber())
+		{
+			return def;
+		}
+		return static_cast<int>(std::strtol(document->strings.c_str() + tapePayload(document->tape[index]), NULL, 10));
+	}
+	float TapeView::toFloat(float def) const
+	{
+		return static_cast<float>(toDouble(def));
+	}
+	double TapeView::toDouble(double def) const
+	{
+		if (!isNumber())
+		{
+			return def;
+		}
+		return std::strtod(document->strings.c_str() + tapePayload(document->tape[index]), NULL);
+	}
+	bool TapeView::toBool(bool def) const
+	{
+		if (!isBool())
+		{
+			return def;
+		}
+		return (tapeTag(document->tape[index]) == TAPE_TRUE);
+	}
+
+	size_t TapeView::getCount() const
+	{
+		return ((isObject() || isArray()) ? static_cast<size_t>(document->tape[index+1]) : 0);
+	}
+	bool TapeView::has(const std::string &name) const
+	{
+		return get(name).isValid();
+	}
+	TapeView TapeView::get(const std::string &name) const
+	{
+		if (!isObject())
+		{
+			return TapeView();
+		}
+		const std::vector<unsigned long long> &tape = document->tape;
+		const char *strings = document->strings.data();
+		const size_t end = tapePayload(tape[index]) - 1;
+		for (size_t i = index+2; i < end; i = tapeSkip(tape, i+2))
+		{
+			if (tape[i+1] == name.size() && std::memcmp(strings + tapePayload(tape[i]), name.data(), name.size()) == 0)
+			{
+				return TapeView(document, i+2);
+			}
+		}
+		return TapeView();
+	}
+	TapeView TapeView::get(size_t position) const
+	{
+		if (position >= getCount())
+		{
+			return TapeView();
+		}
+		const_iterator it = begin();
+		for (size_t i = 0; i < position; ++i)
+		{
+			++it;
+		}
+		return *it;
+	}
+
+	TapeView::const_iterator TapeView::begin() const
+	{
+		if (!isObject() && !isArray())
+		{
+			return const_iterator();
+		}
+		return const_iterator(document, index+2, isObject());
+	}
+	TapeView::const_iterator TapeView::end() const
+	{
+		if (!isObject() && !isArray())
+		{
+			return const_iterator();
+		}
+		return const_iterator(document, tapePayload(document->tape[index]) - 1, isObject());
+	}
+
+	Node TapeView::toNode() const
+	{
+		switch (getType())
+		{
+		case Node::T_OBJECT: // Fallthrough
+		case Node::T_ARRAY:
+			{
+				Node node(getType());
+				for (const_iterator it = begin(); it != end(); ++it)
+				{
+					if (isObject())
+						node.add(it.getName(), (*it).toNode());
+					else
+						node.add((*it).toNode());
+				}
+				return node;
+			}
+		case Node::T_STRING:
+			{
+				Node node(Node::T_STRING);
+				node.setRaw(toString());
+				return node;
+			}
+		case Node::T_INVALID:
+			return Node();
+		default:
+			return Node(getType(), toString());
+		}
+	}
+
+	TapeDocument::TapeDocument()
+	{
+	}
+	TapeDocument::~TapeDocument()
+	{
+	}
+
+	TapeView TapeDocument::getRoot() const
+	{
+		return (tape.empty() ? TapeView() : TapeView(this, 0));
+	}
+	Node TapeDocument::toNode() const
+	{
+		return getRoot().toNode();
+	}
+
+	void TapeDocument::clear()
+	{
+		tape.clear();
+		strings.clear();
+	}
+
+	Reader::Reader(const char *json, size_t length)
+		: begin(json), it(json), end(json+length), token(T_UNKNOWN), type(Node::T_INVALID), maxStringLength(0)
+	{
+#ifdef JZON_ENABLE_STATS
+		stats = ParseStats();
+#endif
+	}
+	Reader::~Reader()
+	{
+	}
+
+	Reader::Token Reader::next()
+	{
+		if (token == T_END || token == T_ERROR)
+		{
+			return token;
+		}
+
+		value.clear();
+		bool word = false;
+
+		while (it != end)
+		{
+			const char c = *it;
+
+			if (isWhitespace(c))
+			{
+				++it;
+				continue;
+			}
+
+			switch (c)
+			{
+			case '{': // Fallthrough
+			case '}': // Fallthrough
+			case '[': // Fallthrough
+			case ']': // Fallthrough
+			case ',': // Fallthrough
+			case ':': // Fallthrough
+			case '"':
+				{
+					// Leave the character for the next call if it ends a word
+					if (word)
+					{
+						return finishWord();
+					}
+					++it;
+					break;
+				}
+			case '/':
+				{
+					char p = (it+1 != end ? *(it+1) : '\0');
+					if (p == '*')
+					{
+						++it;
+						jumpToCommentEnd();
+						continue;
+					}
+					else if (p == '/')
+					{
+						jumpToNext('\n');
+						continue;
+					}
+					// Intentional fallthrough
+				}
+			default:
+				{
+					// Words continue across whitespace and comments until the next token
+					value += c;
+					word = true;
+					++it;
+					continue;
+				}
+			}
+
+			switch (c)
+			{
+			case '{': return (token = T_OBJ_BEGIN);
+			case '}': return (token = T_OBJ_END);
+			case '[': return (token = T_ARRAY_BEGIN);
+			case ']': return (token = T_ARRAY_END);
+			case ',': return (token = T_SEPARATOR_NODE);
+			case ':': return (token = T_SEPARATOR_NAME);
+			default:
+				{
+					if (!readString())
+					{
+						return (token = T_ERROR);
+					}
+					type = Node::T_STRING;
+					return (token = T_VALUE);
+				}
+			}
+		}
+
+		if (word)
+		{
+			return finishWord();
+		}
+		return (token = T_END);
+	}
+
+	size_t Reader::getOffset() const
+	{
+		return static_cast<size_t>(it - begin);
+	}
+	Node::Type Reader::getType() const
+	{
+		return type;
+	}
+	const std::string &Reader::getValue() const
+	{
+		return value;
+	}
+	std::string &Reader::getValue()
+	{
+		return value;
+	}
+
+	void Reader::setMaxStringLength(size_t length)
+	{
+		maxStringLength = length;
+	}
+	void Reader::setError(const std::string &message)
+	{
+		error = message;
+		token = T_ERROR;
+	}
+	const std::string &Reader::getError() const
+	{
+		return error;
+	}
+
+#ifdef JZON_ENABLE_STATS
+	const ParseStats &Reader::getStats() const
+	{
+		return stats;
+	}
+#endif
+
+	Reader::Token Reader::finishWord()
+	{
+		JZON_STAT(const double interpretStart = statsClock());
+		const bool known = interpretValue();
+		JZON_STAT(stats.interpretSeconds += statsClock() - interpretStart);
+
+		return (token = (known ? T_VALUE : T_UNKNOWN));
+	}
+
+	void Reader::jumpToNext(char c)
+	{
+		while (it != end && *it != c)
+		{
+			++it;
+		}
+	}
+	void Reader::jumpToCommentEnd()
+	{
+		++it;
+		char c1 = '\0', c2 = '\0';
+		while (it != end)
+		{
+			c2 = *it++;
+
+			if (c1 == '*' && c2 == '/')
+				break;
+
+			c1 = c2;
+		}
+	}
+
+	bool Reader::readString()
+	{
+		const char *runBegin = it;
+		std::string &unescaped = value;
+
+		while (it != end)
+		{
+			const char *scanEnd = end;
+			if (maxStringLength != 0)
+			{
+				// Scans at most one byte past the limit
+				const size_t length = unescaped.size() + static_cast<size_t>(it - runBegin);
+				if (length > maxStringLength)
+				{
+					std::ostringstream message;
+					message << "String is longer than " << maxStringLength << " bytes";
+					error = message.str();
+					return false;
+				}
+				if (static_cast<size_t>(end - it) > maxStringLength - length)
+				{
+					scanEnd = it + (maxStringLength - length) + 1;
+				}
+			}
+
+			it = skipPlainString(it, scanEnd);
+			if (it == end)
+			{
+				break;
+			}
+			if (it == scanEnd)
+			{
+				continue;
+			}
+
+			const char c = *it;
+			if (c == '"')
+			{
+				unescaped.append(runBegin, it);
+				JZON_STAT(stats.stringBytes += unescaped.size());
+				++it;
+				return true;
+			}
+			else if (c == '\\')
+			{
+				const size_t length = escapeSequenceLength(it, end);
+				if (length == 0)
+				{
+					const size_t shown = ((end - it > 1 && it[1] == 'u') ? 6 : 2);
+					error = "Invalid escape sequence in string: "+std::string(it, std::min<size_t>(end - it, shown));
+					return false;
+				}
+				JZON_STAT(++stats.escapes);
+
+				unescaped.append(runBegin, it);
+				if (it[1] == 'u')
+				{
+					unsigned int codePoint;
+					readUnicodeEscape(it, end, codePoint);
+					appendUtf8(unescaped, codePoint);
+				}
+				else
+				{
+					unescaped += getUnescaped(it[0], it[1]);
+				}
+				it += length;
+				runBegin = it;
+			}
+			else
+			{
+				const size_t length = utf8SequenceLength(it, end);
+				if (length == 0)
+				{
+					error = "Invalid UTF-8 in string";
+					return false;
+				}
+				it += length;
+			}
+		}
+
+		error = "Unterminated string";
+		return false;
+	}
+	bool Reader::interpretValue()
+	{
+		if (equalsIgnoreCase(value, "null"))
+		{
+			type = Node::T_NULL;
+			value.clear();
+		}
+		else if (equalsIgnoreCase(value, "true"))
+		{
+			type = Node::T_BOOL;
+			value = "true";
+		}
+		else if (equalsIgnoreCase(value, "false"))
+		{
+			type = Node::T_BOOL;
+			value = "false";
+		}
+		else
+		{
+			bool number = true;
+			bool negative = false;
+			bool fraction = false;
+			bool scientific = false;
+			bool scientificSign = false;
+			bool scientificNumber = false;
+			for (size_t i = 0; number && i < value.size(); ++i)
+			{
+				char c = static_cast<char>(toupper(value[i]));
+				switch (c)
+				{
+				case '-':
+					{
+						if (scientific)
+						{
+							if (scientificSign) // Only one - allowed after E
+								number = false;
+							else
+								scientificSign = true;
+						}
+						else
+						{
+							if (negative) // Only one - allowed before E
+								number = false;
+							else
+								negative = true;
+						}
+						break;
+					}
+				case '+':
+					{
+						if (!scientific || scientificSign)
+							number = false;
+						else
+							scientificSign = true;
+						break;
+					}
+				case '.':
+					{
+						if (fraction) // Only one . allowed
+							number = false;
+						else
+							fraction = true;
+						break;
+					}
+				case 'E':
+					{
+						if (scientific)
+							number = false;
+						else
+							scientific = true;
+						break;
+					}
+				default:
+					{
+						if (c >= '0' && c <= '9')
+						{
+							if (scientific)
+								scientificNumber = true;
+						}
+						else
+						{
+							number = false;
+						}
+						break;
+					}
+				}
+			}
+
+			if (scientific && !scientificNumber)
+				number = false;
+
+			if (number)
+			{
+				type = Node::T_NUMBER;
+			}
+			else
+			{
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	namespace
+	{
+		size_t countCodePoints(const std::string &str)
+		{
+			size_t count = 0;
+			for (std::string::const_iterator it = str.begin(); it != str.end(); ++it)
+			{
+				if ((static_cast<unsigned char>(*it) & 0xC0) != 0x80)
+					++count;
+			}
+			return count;
+		}
+		bool equalScalars(Node::Type type1, const std::string &value1, Node::Type type2, const std::string &value2)
+		{
+			if (type1 != type2)
+				return false;
+			if (type1 == Node::T_NUMBER)
+				return equalNumbers(value1, value2);
+			return (value1 == value2);
+		}
+		std::string unescapePointer(const std::string &token)
+		{
+			std::string name;
+			for (size_t i = 0; i < token.size(); ++i)
+			{
+				if (token[i] == '~' && i+1 < token.size() && (token[i+1] == '0' || token[i+1] == '1'))
+				{
+					name += (token[i+1] == '0' ? '~' : '/');
+					++i;
+				}
+				else
+				{
+					name += token[i];
+				}
+			}
+			return name;
+		}
+		std::string escapePointer(const std::string &name)
+		{
+			std::string escaped;
+			for (std::string::const_iterator it = name.begin(); it != name.end(); ++it)
+			{
+				if (*it == '~')
+					escaped += "~0";
+				else if (*it == '/')
+					escaped += "~1";
+				else
+					escaped += *it;
+			}
+			return escaped;
+		}
+
+		void emitTokens(Schema::Validator &validator, const Node &node, bool &valid)
+		{
+			switch (node.getType())
+			{
+			case Node::T_OBJECT: // Fallthrough
+			case Node::T_ARRAY:
+				{
+					const bool object = node.isObject();
+					valid = valid && validator.token(object ? Reader::T_OBJ_BEGIN : Reader::T_ARRAY_BEGIN, Node::T_INVALID, std::string());
+					for (Node::const_iterator it = node.begin(); valid && it != node.end(); ++it)
+					{
+						if (it != node.begin())
+							valid = validator.token(Reader::T_SEPARATOR_NODE, Node::T_INVALID, std::string());
+						if (object)
+						{
+							valid = valid && validator.token(Reader::T_VALUE, Node::T_STRING, (*it).first);
+							valid = valid && validator.token(Reader::T_SEPARATOR_NAME, Node::T_INVALID, std::string());
+						}
+						if (valid)
+							emitTokens(validator, (*it).second, valid);
+					}
+					valid = valid && validator.token(object ? Reader::T_OBJ_END : Reader::T_ARRAY_END, Node::T_INVALID, std::string());
+					break;
+				}
+			case Node::T_NULL:
+				{
+					valid = validator.token(Reader::T_VALUE, Node::T_NULL, std::string());
+					break;
+				}
+			case Node::T_INVALID:
+				break;
+			default:
+				{
+					valid = validator.token(Reader::T_VALUE, node.getType(), node.toString());
+					break;
+				}
+			}
+		}
+	}
+
+	Schema::Rule::Rule()
+		: types(0), hasMinimum(false), hasMaximum(false), exclusiveMinimum(false), exclusiveMaximum(false),
+		  minimum(0.0), maximum(0.0), minLength(0), maxLength(static_cast<size_t>(-1)),
+		  minItems(0), maxItems(static_cast<size_t>(-1)), additionalProperties(true), items(-1)
+	{
+	}
+
+	Schema::Schema()
+	{
+	}
+	Schema::~Schema()
+	{
+	}
+
+	bool Schema::compile(const Node &schema)
+	{
+		rules.clear();
+		error.clear();
+		if (compileRule(schema, std::string()) < 0)
+		{
+			rules.clear();
+			return false;
+		}
+		return true;
+	}
+	const std::string &Schema::getError() const
+	{
+		return error;
+	}
+
+	bool Schema::validate(const Node &node, std::string *error) const
+	{
+		Validator validator(*this);
+		bool valid = true;
+		emitTokens(validator, node, valid);
+		if (!valid && error != NULL)
+		{
+			*error = validator.getError();
+		}
+		return valid;
+	}
+	bool Schema::validateBuffer(const char *json, size_t length, std::string *error) const
+	{
+		Reader reader(json, length);
+		Validator validator(*this);
+
+		for (;;)
+		{
+			const Reader::Token token = reader.next();
+			if (token == Reader::T_END)
+			{
+				return true;
+			}
+			else if (token == Reader::T_ERROR || token == Reader::T_UNKNOWN)
+			{
+				if (error != NULL)
+					*error = (token == Reader::T_ERROR ? reader.getError() : "Unknown token: "+reader.getValue());
+				return false;
+			}
+			else if (!validator.token(token, reader.getType(), reader.getValue()))
+			{
+				if (error != NULL)
+					*error = validator.getError();
+				return false;
+			}
+		}
+	}
+	bool Schema::validateString(const std::string &json, std::string *error) const
+	{
+		return validateBuffer(json.data(), json.size(), error);
+	}
+
+	int Schema::compileRule(const Node &schema, const std::string &path)
+	{
+		const int index = static_cast<int>(rules.size());
+		rules.push_back(Rule());
+
+		if (schema.isBool() && schema.toBool())
+		{
+			return index;
+		}
+		if (!schema.isObject())
+		{
+			error = "Schema at "+(path.empty() ? std::string("(root)") : path)+" must be an object";
+			return -1;
+		}
+
+		for (Node::const_iterator it = schema.begin(); it != schema.end(); ++it)
+		{
+			const std::string &keyword = (*it).first;
+			const Node &value = (*it).second;
+			const std::string keywordPath = path+"/"+escapePointer(keyword);
+
+			if (keyword == "type")
+			{
+				Node list = value;
+				if (value.isString())
+				{
+					list = array();
+					list.add(value);
+				}
+				const Node &types = list;
+				for (Node::const_iterator t = types.begin(); t != types.end(); ++t)
+				{
+					const std::string name = (*t).second.toString();
+					if (name == "object")       rules[index].types |= (1 << Node::T_OBJECT);
+					else if (name == "array")   rules[index].types |= (1 << Node::T_ARRAY);
+					else if (name == "null")    rules[index].types |= (1 << Node::T_NULL);
+					else if (name == "string")  rules[index].types |= (1 << Node::T_STRING);
+					else if (name == "number")  rules[index].types |= (1 << Node::T_NUMBER);
+					else if (name == "integer") rules[index].types |= INTEGER_BIT;
+					else if (name == "boolean") rules[index].types |= (1 << Node::T_BOOL);
+					else
+					{
+						error = "Unknown type '"+name+"' at "+keywordPath;
+						return -1;
+					}
+				}
+			}
+			else if (keyword == "properties")
+			{
+				for (Node::const_iterator p = value.begin(); p != value.end(); ++p)
+				{
+					const int property = compileRule((*p).second, keywordPath+"/"+escapePointer((*p).first));
+					if (property < 0)
+						return -1;
+					rules[index].properties.push_back(std::make_pair((*p).first, property));
+				}
+			}
+			else if (keyword == "required")
+			{
+				for (Node::const_iterator r = value.begin(); r != value.end(); ++r)
+				{
+					rules[index].required.push_back((*r).second.toString());
+				}
+			}
+			else if (keyword == "additionalProperties")
+			{
+				if (!value.isBool())
+				{
+					error = "Only true or false is supported at "+keywordPath;
+					return -1;
+				}
+				rules[index].additionalProperties = value.toBool();
+			}
+			else if (keyword == "items")
+			{
+				const int items = compileRule(value, keywordPath);
+				if (items < 0)
+					return -1;
+				rules[index].items = items;
+			}
+			else if (keyword == "enum")
+			{
+				for (Node::const_iterator e = value.begin(); e != value.end(); ++e)
+				{
+					const Node &allowed = (*e).second;
+					if (!allowed.isValue())
+					{
+						error = "Only scalar values are supported at "+keywordPath;
+						return -1;
+					}
+					rules[index].enumValues.push_back(std::make_pair(allowed.getType(), allowed.isNull() ? std::string() : allowed.toString()));
+				}
+			}
+			else if (keyword == "minimum" || keyword == "exclusiveMinimum")
+			{
+				rules[index].hasMinimum = true;
+				rules[index].exclusiveMinimum = (keyword == "exclusiveMinimum");
+				rules[index].minimum = value.toDouble();
+			}
+			else if (keyword == "maximum" || keyword == "exclusiveMaximum")
+			{
+				rules[index].hasMaximum = true;
+				rules[index].exclusiveMaximum = (keyword == "exclusiveMaximum");
+				rules[index].maximum = value.toDouble();
+			}
+			else if (keyword == "minLength") rules[index].minLength = static_cast<size_t>(value.toDouble());
+			else if (keyword == "maxLength") rules[index].maxLength = static_cast<size_t>(value.toDouble());
+			else if (keyword == "minItems")  rules[index].minItems  = static_cast<size_t>(value.toDouble());
+			else if (keyword == "maxItems")  rules[index].maxItems  = static_cast<size_t>(value.toDouble());
+		}
+
+		return index;
+	}
+
+	Schema::Validator::Validator(const Schema &schema) : schema(schema)
+	{
+	}
+	Schema::Validator::~Validator()
+	{
+	}
+
+	bool Schema::Validator::token(Reader::Token token, Node::Type type, const std::string &value)
+	{
+		switch (token)
+		{
+		case Reader::T_OBJ_BEGIN:
+			return beginContainer(Node::T_OBJECT);
+		case Reader::T_ARRAY_BEGIN:
+			return beginContainer(Node::T_ARRAY);
+		case Reader::T_OBJ_END: // Fallthrough
+		case Reader::T_ARRAY_END:
+			return endContainer();
+		case Reader::T_SEPARATOR_NAME:
+			{
+				if (!frames.empty())
+					frames.back().expectingName = false;
+				return true;
+			}
+		case Reader::T_SEPARATOR_NODE:
+			{
+				if (!frames.empty() && frames.back().object)
+					frames.back().expectingName = true;
+				return true;
+			}
+		case Reader::T_VALUE:
+			{
+				if (!frames.empty() && frames.back().object && frames.back().expectingName)
+				{
+					return readName(value);
+				}
+				const int rule = nextRule();
+				return (rule == -2 ? false : checkValue(rule, type, value));
+			}
+		default:
+			return true;
+		}
+	}
+	const std::string &Schema::Validator::getError() const
+	{
+		return error;
+	}
+
+	// Returns the rule for the next value, -1 if anything is allowed or -2 on failure
+	int Schema::Validator::nextRule()
+	{
+		if (frames.empty())
+		{
+			return (schema.rules.empty() ? -1 : 0);
+		}
+
+		Frame &frame = frames.back();
+		if (frame.object)
+		{
+			return frame.childRule;
+		}
+
+		++frame.count;
+		if (frame.rule >= 0 && frame.count > schema.rules[frame.rule].maxItems)
+		{
+			fail("Too many items", frames.size()-1);
+			return -2;
+		}
+		return (frame.rule >= 0 ? schema.rules[frame.rule].items : -1);
+	}
+	bool Schema::Validator::beginContainer(Node::Type type)
+	{
+		const int rule = nextRule();
+		if (rule == -2 || !checkValue(rule, type, std::string()))
+		{
+			return false;
+		}
+
+		frames.push_back(Frame());
+		Frame &frame = frames.back();
+		frame.rule = rule;
+		frame.childRule = -1;
+		frame.object = (type == Node::T_OBJECT);
+		frame.expectingName = frame.object;
+		frame.count = 0;
+		if (rule >= 0 && frame.object)
+		{
+			frame.required.resize(schema.rules[rule].required.size(), false);
+		}
+		return true;
+	}
+	bool Schema::Validator::endContainer()
+	{
+		if (frames.empty())
+		{
+			return true;
+		}
+
+		const Frame &frame = frames.back();
+		if (frame.rule >= 0)
+		{
+			const Rule &rule = schema.rules[frame.rule];
+			for (size_t i = 0; i < frame.required.size(); ++i)
+			{
+				if (!frame.required[i])
+				{
+					return fail("Missing required property '"+rule.required[i]+"'", frames.size()-1);
+				}
+			}
+			if (!frame.object && frame.count < rule.minItems)
+			{
+				return fail("Too few items", frames.size()-1);
+			}
+		}
+
+		frames.pop_back();
+		return true;
+	}
+	bool Schema::Validator::readName(const std::string &name)
+	{
+		Frame &frame = frames.back();
+		frame.name = name;
+		frame.childRule = -1;
+		++frame.count;
+
+		if (frame.rule < 0)
+		{
+			return true;
+		}
+
+		const Rule &rule = schema.rules[frame.rule];
+		bool known = false;
+		for (size_t i = 0; i < rule.properties.size(); ++i)
+		{
+			if (rule.properties[i].first == name)
+			{
+				frame.childRule = rule.properties[i].second;
+				known = true;
+				break;
+			}
+		}
+		for (size_t i = 0; i < rule.required.size(); ++i)
+		{
+			if (rule.required[i] == name)
+				frame.required[i] = true;
+		}
+
+		if (!known && !rule.additionalProperties)
+		{
+			return fail("Property is not allowed", frames.size());
+		}
+		return true;
+	}
+	bool Schema::Validator::checkValue(int index, Node::Type type, const std::string &value)
+	{
+		if (index < 0)
+		{
+			return true;
+		}
+
+		const Rule &rule = schema.rules[index];
+		if (rule.types != 0 && (rule.types & (1 << type)) == 0)
+		{
+			bool integer = false;
+			if (type == Node::T_NUMBER && (rule.types & INTEGER_BIT) != 0)
+			{
+				const double number = std::strtod(value.c_str(), NULL);
+				// Infinity and NaN fail the first test, without C++11's isfinite()
+				integer = (number - number == 0 && std::floor(number) == number);
+			}
+			if (!integer)
+			{
+				return fail("Wrong type", frames.size());
+			}
+		}
+
+		if (!rule.enumValues.empty())
+		{
+			bool found = false;
+			for (size_t i = 0; i < rule.enumValues.size() && !found; ++i)
+			{
+				found = equalScalars(type, value, rule.enumValues[i].first, rule.enumValues[i].second);
+			}
+			if (!found)
+			{
+				return fail("Value is not one of the allowed values", frames.size());
+			}
+		}
+
+		if (type == Node::T_NUMBER && (rule.hasMinimum || rule.hasMaximum))
+		{
+			const double number = std::strtod(value.c_str(), NULL);
+			if (rule.hasMinimum && (number < rule.minimum || (rule.exclusiveMinimum && number == rule.minimum)))
+			{
+				return fail("Value is below the minimum", frames.size());
+			}
+			if (rule.hasMaximum && (number > rule.maximum || (rule.exclusiveMaximum && number == rule.maximum)))
+			{
+				return fail("Value is above the maximum", frames.size());
+			}
+		}
+		else if (type == Node::T_STRING && (rule.minLength > 0 || rule.maxLength != static_cast<size_t>(-1)))
+		{
+			const size_t length = countCodePoints(value);
+			if (length < rule.minLength)
+			{
+				return fail("String is too short", frames.size());
+			}
+			if (length > rule.maxLength)
+			{
+				return fail("String is too long", frames.size());
+			}
+		}
+
+		return true;
+	}
+	bool Schema::Validator::fail(const std::string &message, size_t depth)
+	{
+		std::ostringstream path;
+		for (size_t i = 0; i < depth; ++i)
+		{
+			const Frame &frame = frames[i];
+			if (frame.object)
+				path << "/" << escapePointer(frame.name);
+			else
+				path << "/" << (frame.count - 1);
+		}
+
+		const std::string pointer = path.str();
+		error = "Schema violation at "+(pointer.empty() ? std::string("(root)") : pointer)+": "+message;
+		return false;
+	}
+
+	namespace
+	{
+		// Large files are mapped rather than copied into a buffer
+		const size_t mapThreshold = 1024 * 1024;
+
+		void parseOneFile(Parser &parser, const std::string &path, std::string &buffer, ParsedFile &result)
+		{
+#ifdef JZON_POSIX_FILES
+			const int fd = open(path.c_str(), O_RDONLY);
+			if (fd < 0)
+			{
+				result.error = "Unable to open file: "+path;
+				return;
+			}
+			struct stat info;
+			if (fstat(fd, &info) == 0 && static_cast<size_t>(info.st_size) >= mapThreshold)
+			{
+				const size_t length = static_cast<size_t>(info.st_size);
+				void *mapping = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+				close(fd);
+				if (mapping != MAP_FAILED)
+				{
+#ifdef MADV_SEQUENTIAL
+					madvise(mapping, length, MADV_SEQUENTIAL);
+#endif
+					result.node = parser.parseBuffer(static_cast<const char*>(mapping), length);
+					result.error = parser.getError();
+					munmap(mapping, length);
+					return;
+				}
+			}
+			else
+			{
+				close(fd);
+			}
+#endif
+			if (!readFile(path, buffer))
+			{
+				result.error = "Unable to read file: "+path;
+				return;
+			}
+			result.node = parser.parseBuffer(buffer.data(), buffer.size());
+			result.error = parser.getError();
+		}
+
+#ifdef JZON_THREADS
+		struct WorkQueue
+		{
+			std::mutex mutex;
+			std::deque<size_t> items;
+		};
+
+		// Takes from the front of our own queue, or steals from the back of another
+		bool takeWork(std::vector<WorkQueue> &queues, size_t self, size_t &item)
+		{
+			for (size_t i = 0; i < queues.size(); ++i)
+			{
+				WorkQueue &queue = queues[(self + i) % queues.size()];
+				std::lock_guard<std::mutex> lock(queue.mutex);
+				if (!queue.items.empty())
+				{
+					if (i == 0)
+					{
+						item = queue.items.front();
+						queue.items.pop_front();
+					}
+					else
+					{
+						item = queue.items.back();
+						queue.items.pop_back();
+					}
+					return true;
+				}
+			}
+			return false;
+		}
+#endif
+	}
+
+	std::vector<ParsedFile> parseFiles(const std::vector<std::string> &paths, unsigned int threads, const Schema *schema)
+	{
+		std::vector<ParsedFile> results(paths.size());
+
+#ifdef JZON_THREADS
+		if (threads == 0)
+		{
+			threads = std::thread::hardware_concurrency();
+		}
+		if (threads > paths.size())
+		{
+			threads = static_cast<unsigned int>(paths.size());
+		}
+
+		if (threads > 1)
+		{
+			std::vector<WorkQueue> queues(threads);
+			for (size_t i = 0; i < paths.size(); ++i)
+			{
+				queues[i % threads].items.push_back(i);
+			}
+
+			std::vector<std::thread> workers;
+			for (unsigned int t = 0; t < threads; ++t)
+			{
+				workers.push_back(std::thread([&queues, &paths, &results, schema, t]()
+				{
+					Parser parser;
+					parser.setSchema(schema);
+					std::string buffer;
+					size_t item;
+					while (takeWork(queues, t, item))
+					{
+						parseOneFile(parser, paths[item], buffer, results[item]);
+					}
+				}));
+			}
+			for (size_t t = 0; t < workers.size(); ++t)
+			{
+				workers[t].join();
+			}
+			return results;
+		}
+#else
+		(void)threads;
+#endif
+
+		Parser parser;
+		parser.setSchema(schema);
+		std::string buffer;
+		for (size_t i = 0; i < paths.size(); ++i)
+		{
+			parseOneFile(parser, paths[i], buffer, results[i]);
+		}
+		return results;
+	}
+
+	bool FileCache::Key::operator==(const Key &other) const
+	{
+		return (device == other.device && inode == other.inode && size == other.size &&
+		        modifiedSeconds == other.modifiedSeconds && modifiedNanoseconds == other.modifiedNanoseconds);
+	}
+
+	FileCache::FileCache() : watchFd(-1)
+	{
+	}
+	FileCache::~FileCache()
+	{
+#ifdef JZON_INOTIFY
+		if (watchFd >= 0)
+		{
+			close(watchFd);
+		}
+#endif
+	}
+
+	bool FileCache::enableWatching()
+	{
+#ifdef JZON_INOTIFY
+		if (watchFd < 0)
+		{
+			watchFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		}
+		return (watchFd >= 0);
+#else
+		return false;
+#endif
+	}
+
+	void FileCache::setSchema(const Schema *schema)
+	{
+		parser.setSchema(schema);
+	}
+
+	Node FileCache::parseFile(const std::string &path)
+	{
+		error.clear();
+		readEvents();
+
+		std::map<std::string, Entry>::iterator it = entries.find(path);
+		if (it != entries.end() && it->second.current)
+		{
+			++stats.hits;
+			return it->second.node;
+		}
+
+		// Watched before the key is read, so that a change right after isn't missed
+		int watch = -1;
+		int targetWatch = -1;
+		const bool watched = watchDirectories(path, watch, targetWatch);
+
+		Key key;
+		const bool found = readKey(path, key);
+		++stats.checks;
+		if (it != entries.end())
+		{
+			if (found && key == it->second.key)
+			{
+				const bool moved = (it->second.watch != watch || it->second.targetWatch != targetWatch);
+				it->second.watch = watch;
+				it->second.targetWatch = targetWatch;
+				it->second.current = watched;
+				if (moved)
+					removeUnusedWatches();
+				++stats.hits;
+				return it->second.node;
+			}
+			++stats.changes;
+			entries.erase(it);
+		}
+
+		++stats.misses;
+		const Node node = (found ? parser.parseFile(path) : Node());
+		if (!node.isValid())
+		{
+			if (!found)
+				error = "Unable to open file: "+path;
+			else
+				error = parser.getError();
+			removeUnusedWatches();
+			return node;
+		}
+
+		Entry &entry = entries[path];
+		entry.node = node;
+		entry.key = key;
+		entry.watch = watch;
+		entry.targetWatch = targetWatch;
+		entry.current = watched;
+		return node;
+	}
+	const std::string &FileCache::getError() const
+	{
+		return error;
+	}
+
+	void FileCache::remove(const std::string &path)
+	{
+		entries.erase(path);
+		removeUnusedWatches();
+	}
+	void FileCache::clear()
+	{
+		entries.clear();
+		removeUnusedWatches();
+	}
+
+	const FileCache::Stats &FileCache::getStats() const
+	{
+		return stats;
+	}
+
+	bool FileCache::readKey(const std::string &path, Key &key)
+	{
+#ifdef JZON_POSIX_FILES
+		struct stat info;
+		if (stat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode))
+		{
+			return false;
+		}
+		key.device = static_cast<unsigned long long>(info.st_dev);
+		key.inode = static_cast<unsigned long long>(info.st_ino);
+		key.size = static_cast<unsigned long long>(info.st_size);
+		key.modifiedSeconds = static_cast<long long>(info.st_mtime);
+#	ifdef __APPLE__
+		key.modifiedNanoseconds = static_cast<long long>(info.st_mtimespec.tv_nsec);
+#	else
+		key.modifiedNanoseconds = static_cast<long long>(info.st_mtim.tv_nsec);
+#	endif
+		return true;
+#else
+		// Without stat() the contents are compared instead, which still saves parsing
+		std::string json;
+		if (!readFile(path, json))
+		{
+			return false;
+		}
+		key.device = 0;
+		key.inode = hashString(json);
+		key.size = json.size();
+		key.modifiedSeconds = 0;
+		key.modifiedNanoseconds = 0;
+		return true;
+#endif
+	}
+
+	bool FileCache::watchDirectories(const std::string &path, int &watch, int &targetWatch)
+	{
+		watch = -1;
+		targetWatch = -1;
+#ifdef JZON_INOTIFY
+		if (watchFd < 0)
+		{
+			return false;
+		}
+		// The directories rather than the file, which editors often replace.
+		// A symlink's target can change without its own directory changing, so
+		// the directory of the resolved path is watched as well. inotify hands
+		// back the same watch when both are the same directory.
+		const uint32_t mask = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+		                      IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+		std::string paths[2];
+		paths[0] = path;
+		char *resolved = realpath(path.c_str(), NULL);
+		if (resolved != NULL)
+		{
+			paths[1] = resolved;
+			std::free(resolved);
+		}
+		int added[2] = { -1, -1 };
+		for (int i = 0; i < 2; ++i)
+		{
+			if (paths[i].empty())
+				continue;
+			const size_t slash = paths[i].find_last_of('/');
+			const std::string directory = (slash == std::string::npos ? std::string(".") : paths[i].substr(0, slash+1));
+			added[i] = inotify_add_watch(watchFd, directory.c_str(), mask);
+			if (added[i] >= 0 && std::find(watches.begin(), watches.end(), added[i]) == watches.end())
+				watches.push_back(added[i]);
+		}
+		watch = added[0];
+		targetWatch = added[1];
+		return (watch >= 0 && (paths[1].empty() || targetWatch >= 0));
+#else
+		(void)path;
+		return false;
+#endif
+	}
+	void FileCache::removeUnusedWatches()
+	{
+#ifdef JZON_INOTIFY
+		for (size_t i = 0; i < watches.size();)
+		{
+			bool used = false;
+			for (std::map<std::string, Entry>::const_iterator it = entries.begin(); it != entries.end() && !used; ++it)
+			{
+				used = (it->second.watch == watches[i] || it->second.targetWatch == watches[i]);
+			}
+			if (used)
+			{
+				++i;
+				continue;
+			}
+			inotify_rm_watch(watchFd, watches[i]);
+			watches[i] = watches.back();
+			watches.pop_back();
+		}
+#endif
+	}
+
+	void FileCache::readEvents()
+	{
+#ifdef JZON_INOTIFY
+		if (watchFd < 0)
+		{
+			return;
+		}
+		union
+		{
+			struct inotify_event event;
+			char bytes[4096];
+		} buffer;
+		for (;;)
+		{
+			const ssize_t length = read(watchFd, buffer.bytes, sizeof(buffer.bytes));
+			if (length <= 0)
+			{
+				break;
+			}
+			for (ssize_t offset = 0; offset < length;)
+			{
+				const struct inotify_event *event = reinterpret_cast<const struct inotify_event*>(buffer.bytes + offset);
+				if ((event->mask & IN_IGNORED) != 0)
+				{
+					// Removed by the kernel or by removeUnusedWatches()
+					watches.erase(std::remove(watches.begin(), watches.end(), event->wd), watches.end());
+				}
+				for (std::map<std::string, Entry>::iterator it = entries.begin(); it != entries.end(); ++it)
+				{
+					// Anything in the directory makes the next call look at the file again
+					Entry &entry = it->second;
+					if ((event->mask & IN_Q_OVERFLOW) != 0 || entry.watch == event->wd || entry.targetWatch == event->wd)
+					{
+						entry.current = false;
+						if ((event->mask & IN_IGNORED) != 0)
+						{
+							if (entry.watch == event->wd)
+								entry.watch = -1;
+							if (entry.targetWatch == event->wd)
+								entry.targetWatch = -1;
+						}
+					}
+				}
+				offset += static_cast<ssize_t>(sizeof(struct inotify_event) + event->len);
+			}
+		}
+#endif
+	}
+
+	namespace
+	{
+		const char indexMagic[] = { 'J', 'Z', 'I', 'X' };
+		const unsigned long long indexVersion = 1;
+
+		// Index files are little endian, whatever the machine is
+		void appendUint(std::string &out, unsigned long long value, unsigned int bytes)
+		{
+			for (unsigned int i = 0; i < bytes; ++i)
+			{
+				out += static_cast<char>((value >> (8*i)) & 0xFF);
+			}
+		}
+		bool readUint(const char *&it, const char *end, unsigned int bytes, unsigned long long &value)
+		{
+			if (static_cast<size_t>(end - it) < bytes)
+			{
+				return false;
+			}
+			value = 0;
+			for (unsigned int i = 0; i < bytes; ++i)
+			{
+				value |= static_cast<unsigned long long>(static_cast<unsigned char>(*it++)) << (8*i);
+			}
+			return true;
+		}
+	}
+
+	struct FileIndex::NameOrder
+	{
+		explicit NameOrder(const std::vector<Entry> &entries) : entries(entries)
+		{
+		}
+		bool operator()(size_t a, size_t b) const
+		{
+			return (entries[a].name < entries[b].name || (entries[a].name == entries[b].name && a < b));
+		}
+		bool operator()(size_t a, const std::string &name) const
+		{
+			return (entries[a].name < name);
+		}
+
+		const std::vector<Entry> &entries;
+	};
+
+	FileIndex::FileIndex() : type(Node::T_INVALID), fileSize(0)
+	{
+	}
+	FileIndex::~FileIndex()
+	{
+	}
+
+	bool FileIndex::build(const std::string &filename)
+	{
+		type = Node::T_INVALID;
+		entries.clear();
+		byName.clear();
+		error.clear();
+
+		FileRange file;
+		if (!file.load(filename, 0, wholeFile))
+		{
+			return fail("Unable to read file: "+filename);
+		}
+#if defined(JZON_POSIX_FILES) && defined(MADV_SEQUENTIAL)
+		if (file.length > 0)
+			madvise(const_cast<char*>(file.data), file.length, MADV_SEQUENTIAL);
+#endif
+
+		// Only the outermost container is looked at closely, the elements
+		// are checked when they are parsed
+		Reader reader(file.data, file.length);
+		std::vector<Reader::Token> ends;
+		Entry entry;
+		bool expectingName = false; // In the outermost object, before a name
+		bool named = false; // After the name and ':'
+		bool hasValue = false;
+		for (;;)
+		{
+			const Reader::Token token = reader.next();
+			const unsigned long long offset = reader.getOffset();
+			const bool outermost = (ends.size() == 1);
+			if (outermost && (token == Reader::T_OBJ_BEGIN || token == Reader::T_ARRAY_BEGIN || (token == Reader::T_VALUE && !expectingName)))
+			{
+				if (hasValue)
+					return fail("Expected ',' between elements");
+				if (type == Node::T_OBJECT && !named)
+					return fail("Expected ':' after name");
+				hasValue = true;
+			}
+
+			switch (token)
+			{
+			case Reader::T_OBJ_BEGIN: // Fallthrough
+			case Reader::T_ARRAY_BEGIN:
+				{
+					const bool object = (token == Reader::T_OBJ_BEGIN);
+					if (ends.empty())
+					{
+						if (type != Node::T_INVALID)
+							return fail("Only one outermost object or array is allowed");
+						type = (object ? Node::T_OBJECT : Node::T_ARRAY);
+						expectingName = object;
+						entry.begin = offset;
+					}
+					ends.push_back(object ? Reader::T_OBJ_END : Reader::T_ARRAY_END);
+					break;
+				}
+			case Reader::T_OBJ_END: // Fallthrough
+			case Reader::T_ARRAY_END:
+				{
+					if (ends.empty() || ends.back() != token)
+						return fail("Mismatched end and beginning of object or array");
+					ends.pop_back();
+					if (ends.empty())
+					{
+						if (hasValue)
+						{
+							entry.end = offset - 1;
+							entries.push_back(entry);
+						}
+						else if (!entries.empty() || (type == Node::T_OBJECT && !expectingName))
+						{
+							return fail("Missing value after ',' or ':'");
+						}
+					}
+					break;
+				}
+			case Reader::T_SEPARATOR_NODE:
+				{
+					if (!outermost)
+						break;
+					if (!hasValue)
+						return fail("Missing value after ',' or ':'");
+					entry.end = offset - 1;
+					entries.push_back(entry);
+					entry.name.clear();
+					entry.begin = offset;
+					expectingName = (type == Node::T_OBJECT);
+					named = false;
+					hasValue = false;
+					break;
+				}
+			case Reader::T_SEPARATOR_NAME:
+				{
+					if (!outermost)
+						break;
+					if (type != Node::T_OBJECT || expectingName || named || hasValue)
+						return fail("A name has to be a string");
+					named = true;
+					entry.begin = offset;
+					break;
+				}
+			case Reader::T_VALUE:
+				{
+					if (ends.empty())
+						return fail("Outermost node must be an object or array");
+					if (outermost && expectingName)
+					{
+						if (reader.getType() != Node::T_STRING)
+							return fail("A name has to be a string");
+						entry.name.swap(reader.getValue());
+						expectingName = false;
+					}
+					break;
+				}
+			case Reader::T_UNKNOWN:
+				return fail("Unknown token: "+reader.getValue());
+			case Reader::T_ERROR:
+				return fail(reader.getError());
+			case Reader::T_END:
+				{
+					if (!ends.empty() || type == Node::T_INVALID)
+						return fail("Unexpected end of input");
+					fileSize = file.fileSize;
+					sortNames();
+					return true;
+				}
+			}
+		}
+	}
+	bool FileIndex::save(const std::string &filename) const
+	{
+		std::string data(indexMagic, sizeof(indexMagic));
+		appendUint(data, indexVersion, 4);
+		appendUint(data, static_cast<unsigned long long>(type), 1);
+		appendUint(data, fileSize, 8);
+		appendUint(data, entries.size(), 8);
+		for (std::vector<Entry>::const_iterator it = entries.begin(); it != entries.end(); ++it)
+		{
+			appendUint(data, it->begin, 8);
+			appendUint(data, it->end, 8);
+			if (type == Node::T_OBJECT)
+			{
+				appendUint(data, it->name.size(), 4);
+				data += it->name;
+			}
+		}
+
+		std::ofstream stream(filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+		stream.write(data.data(), static_cast<std::streamsize>(data.size()));
+		return stream.good();
+	}
+	bool FileIndex::load(const std::string &filename)
+	{
+		type = Node::T_INVALID;
+		entries.clear();
+		byName.clear();
+		error.clear();
+
+		std::string data;
+		if (!readFile(filename, data))
+		{
+			return fail("Unable to read file: "+filename);
+		}
+
+		const char *it = data.data();
+		const char *end = it + data.size();
+		unsigned long long version, savedType, count;
+		if (data.size() < sizeof(indexMagic) || std::memcmp(it, indexMagic, sizeof(indexMagic)) != 0)
+		{
+			return fail("Not an index file: "+filename);
+		}
+		it += sizeof(indexMagic);
+		if (!readUint(it, end, 4, version) || version != indexVersion)
+		{
+			return fail("Unsupported index version: "+filename);
+		}
+		if (!readUint(it, end, 1, savedType) || !readUint(it, end, 8, fileSize) || !readUint(it, end, 8, count) ||
+			(savedType != Node::T_OBJECT && savedType != Node::T_ARRAY))
+		{
+			return fail("Invalid index file: "+filename);
+		}
+
+		const bool object = (savedType == Node::T_OBJECT);
+		entries.reserve(static_cast<size_t>(std::min<unsigned long long>(count, data.size() / 16)));
+		for (unsigned long long i = 0; i < count; ++i)
+		{
+			Entry entry;
+			unsigned long long nameLength = 0;
+			if (!readUint(it, end, 8, entry.begin) || !readUint(it, end, 8, entry.end) || entry.begin > entry.end || entry.end > fileSize ||
+				(object && (!readUint(it, end, 4, nameLength) || static_cast<unsigned long long>(end - it) < nameLength)))
+			{
+				return fail("Invalid index file: "+filename);
+			}
+			entry.name.assign(it, static_cast<size_t>(nameLength));
+			it += nameLength;
+			entries.push_back(entry);
+		}
+		if (it != end)
+		{
+			return fail("Invalid index file: "+filename);
+		}
+
+		type = static_cast<Node::Type>(savedType);
+		sortNames();
+		return true;
+	}
+	const std::string &FileIndex::getError() const
+	{
+		return error;
+	}
+
+	Node::Type FileIndex::getType() const
+	{
+		return type;
+	}
+	size_t FileIndex::getCount() const
+	{
+		return entries.size();
+	}
+	unsigned long long FileIndex::getFileSize() const
+	{
+		return fileSize;
+	}
+
+	const std::string &FileIndex::getName(size_t element) const
+	{
+		return entries[element].name;
+	}
+	size_t FileIndex::find(const std::string &name) const
+	{
+		const std::vector<size_t>::const_iterator it = std::lower_bound(byName.begin(), byName.end(), name, NameOrder(entries));
+		return (it != byName.end() && entries[*it].name == name ? *it : entries.size());
+	}
+
+	bool FileIndex::fail(const std::string &message)
+	{
+		error = message;
+		type = Node::T_INVALID;
+		entries.clear();
+		byName.clear();
+		return false;
+	}
+	void FileIndex::sortNames()
+	{
+		byName.clear();
+		if (type != Node::T_OBJECT)
+		{
+			return;
+		}
+		byName.resize(entries.size());
+		for (size_t i = 0; i < byName.size(); ++i)
+		{
+			byName[i] = i;
+		}
+		std::sort(byName.begin(), byName.end(), NameOrder(entries));
+	}
+
+	Columns::Columns() : rows(0)
+	{
+		fields.push_back(Field());
+		fields.back().column = -1;
+	}
+	Columns::~Columns()
+	{
+	}
+
+	size_t Columns::addColumn(const std::string &path, Node::Type type)
+	{
+		size_t field = 0;
+		if (!path.empty())
+		{
+			size_t start = (path[0] == '/' ? 1 : 0);
+			for (;;)
+			{
+				const size_t slash = path.find('/', start);
+				field = findField(field, unescapePointer(path.substr(start, slash == std::string::npos ? std::string::npos : slash-start)));
+				if (slash == std::string::npos)
+					break;
+				start = slash+1;
+			}
+		}
+
+		// Rows read before the column was added have no value for it
+		Column column;
+		column.path = path;
+		column.type = type;
+		column.nulls.assign(rows, true);
+		switch (type)
+		{
+		case Node::T_NUMBER: column.numbers.assign(rows, 0.0); break;
+		case Node::T_STRING: column.strings.assign(rows, std::string()); break;
+		case Node::T_BOOL: column.bools.assign(rows, false); break;
+		default: break;
+		}
+		columns.push_back(column);
+
+		fields[field].column = static_cast<int>(columns.size()-1);
+		return columns.size()-1;
+	}
+
+	bool Columns::extract(const Node &rows)
+	{
+		error.clear();
+		if (!rows.isArray())
+		{
+			error = "Rows must be an array";
+			return false;
+		}
+
+		const size_t count = rows.getCount();
+		for (size_t i = 0; i < count; ++i)
+		{
+			extractNode(rows.get(i), 0);
+			finishRow();
+		}
+		return true;
+	}
+	bool Columns::extractBuffer(const char *json, size_t length)
+	{
+		error.clear();
+
+		Reader reader(json, length);
+		Reader::Token token = reader.next();
+		if (token != Reader::T_ARRAY_BEGIN)
+		{
+			error = (token == Reader::T_ERROR ? reader.getError() : "Rows must be an array");
+			return false;
+		}
+
+		// Rows from this text are only kept if all of it is valid
+		const size_t firstRow = rows;
+		for (;;)
+		{
+			token = reader.next();
+			if (token == Reader::T_ARRAY_END)
+			{
+				break;
+			}
+			else if (token == Reader::T_SEPARATOR_NODE)
+			{
+				continue;
+			}
+			else if (!readValue(reader, token, 0))
+			{
+				truncateRows(firstRow);
+				return false;
+			}
+			finishRow();
+		}
+
+		token = reader.next();
+		if (token != Reader::T_END)
+		{
+			error = (token == Reader::T_ERROR ? reader.getError() : "Unexpected content after the rows");
+			truncateRows(firstRow);
+			return false;
+		}
+		return true;
+	}
+	bool Columns::extractString(const std::string &json)
+	{
+		return extractBuffer(json.data(), json.size());
+	}
+	void Columns::clearRows()
+	{
+		for (size_t i = 0; i < columns.size(); ++i)
+		{
+			Column &column = columns[i];
+			column.numbers.clear();
+			column.strings.clear();
+			column.bools.clear();
+			column.nulls.clear();
+		}
+		rows = 0;
+	}
+
+	size_t Columns::getRowCount() const
+	{
+		return rows;
+	}
+	size_t Columns::getColumnCount() const
+	{
+		return columns.size();
+	}
+	const Columns::Column &Columns::getColumn(size_t index) const
+	{
+		return columns[index];
+	}
+	const std::string &Columns::getError() const
+	{
+		return error;
+	}
+
+	size_t Columns::findField(size_t parent, const std::string &name)
+	{
+		for (size_t i = 0; i < fields[parent].children.size(); ++i)
+		{
+			const size_t child = fields[parent].children[i];
+			if (fields[child].name == name)
+				return child;
+		}
+
+		fields.push_back(Field());
+		fields.back().name = name;
+		fields.back().column = -1;
+		fields[parent].children.push_back(fields.size()-1);
+		return fields.size()-1;
+	}
+	int Columns::matchMember(size_t parent, size_t position, const std::string &name)
+	{
+		std::vector<std::pair<std::string, int> > &layout = fields[parent].layout;
+		if (position < layout.size() && layout[position].first == name)
+		{
+			return layout[position].second;
+		}
+
+		// The record has a different layout than the previous one
+		int match = -1;
+		for (size_t i = 0; i < fields[parent].children.size() && match < 0; ++i)
+		{
+			const size_t child = fields[parent].children[i];
+			if (fields[child].name == name)
+				match = static_cast<int>(child);
+		}
+		if (position >= layout.size())
+		{
+			layout.resize(position+1);
+		}
+		layout[position] = std::make_pair(name, match);
+		return match;
+	}
+	void Columns::extractNode(const Node &node, int field)
+	{
+		if (fields[field].column >= 0 && node.isValue())
+		{
+			setValue(fields[field].column, node.getType(), node.data->valueStr);
+		}
+		if (!fields[field].children.empty() && node.isObject())
+		{
+			const Node::NamedNodeList &children = node.data->children;
+			for (size_t i = 0; i < children.size(); ++i)
+			{
+				const int child = matchMember(field, i, children[i].first);
+				if (child >= 0)
+					extractNode(children[i].second, child);
+			}
+		}
+	}
+	bool Columns::readValue(Reader &reader, Reader::Token token, int field)
+	{
+		switch (token)
+		{
+		case Reader::T_VALUE:
+			{
+				if (field >= 0 && fields[field].column >= 0)
+					setValue(fields[field].column, reader.getType(), reader.getValue());
+				return true;
+			}
+		case Reader::T_OBJ_BEGIN:
+			{
+				if (field < 0 || fields[field].children.empty())
+				{
+					return skipValue(reader, token);
+				}
+
+				size_t position = 0;
+				for (;;)
+				{
+					token = reader.next();
+					if (token == Reader::T_OBJ_END)
+					{
+						return true;
+					}
+					else if (token == Reader::T_SEPARATOR_NODE)
+					{
+						continue;
+					}
+					else if (token != Reader::T_VALUE || reader.getType() != Node::T_STRING)
+					{
+						error = (token == Reader::T_ERROR ? reader.getError() : "A name has to be a string");
+						return false;
+					}
+
+					const int child = matchMember(field, position++, reader.getValue());
+					if (reader.next() != Reader::T_SEPARATOR_NAME)
+					{
+						error = "Expected ':' after name";
+						return false;
+					}
+					if (!readValue(reader, reader.next(), child))
+					{
+						return false;
+					}
+				}
+			}
+		case Reader::T_ARRAY_BEGIN:
+			return skipValue(reader, token);
+		case Reader::T_ERROR:
+			{
+				error = reader.getError();
+				return false;
+			}
+		case Reader::T_UNKNOWN:
+			{
+				error = "Unknown token: "+reader.getValue();
+				return false;
+			}
+		default:
+			{
+				error = "Expected a value";
+				return false;
+			}
+		}
+	}
+	bool Columns::skipValue(Reader &reader, Reader::Token token)
+	{
+		std::vector<Reader::Token> ends;
+		for (;;)
+		{
+			switch (token)
+			{
+			case Reader::T_OBJ_BEGIN:
+				ends.push_back(Reader::T_OBJ_END);
+				break;
+			case Reader::T_ARRAY_BEGIN:
+				ends.push_back(Reader::T_ARRAY_END);
+				break;
+			case Reader::T_OBJ_END: // Fallthrough
+			case Reader::T_ARRAY_END:
+				if (ends.empty() || ends.back() != token)
+				{
+					error = "Mismatched end and beginning of object or array";
+					return false;
+				}
+				ends.pop_back();
+				break;
+			case Reader::T_ERROR:
+				error = reader.getError();
+				return false;
+			case Reader::T_UNKNOWN:
+				error = "Unknown token: "+reader.getValue();
+				return false;
+			case Reader::T_END:
+				error = "Unexpected end of input";
+				return false;
+			default:
+				break;
+			}
+			if (ends.empty())
+			{
+				return true;
+			}
+			token = reader.next();
+		}
+	}
+	void Columns::setValue(size_t index, Node::Type type, const std::string &value)
+	{
+		Column &column = columns[index];
+		if (column.nulls.size() > rows)
+		{
+			return; // Duplicate member, the first one is kept like Node::get()
+		}
+
+		const bool valid = (type == column.type);
+		column.nulls.push_back(!valid);
+		switch (column.type)
+		{
+		case Node::T_NUMBER: column.numbers.push_back(valid ? std::strtod(value.c_str(), NULL) : 0.0); break;
+		case Node::T_STRING: column.strings.push_back(valid ? value : std::string()); break;
+		case Node::T_BOOL: column.bools.push_back(valid && value == "true"); break;
+		default: break;
+		}
+	}
+	void Columns::finishRow()
+	{
+		for (size_t i = 0; i < columns.size(); ++i)
+		{
+			if (columns[i].nulls.size() == rows)
+			{
+				setValue(i, Node::T_INVALID, std::string());
+			}
+		}
+		++rows;
+	}
+	void Columns::truncateRows(size_t count)
+	{
+		for (size_t i = 0; i < columns.size(); ++i)
+		{
+			Column &column = columns[i];
+			if (column.nulls.size() > count) column.nulls.resize(count);
+			if (column.numbers.size() > count) column.numbers.resize(count);
+			if (column.strings.size() > count) column.strings.resize(count);
+			if (column.bools.size() > count) column.bools.resize(count);
+		}
+		rows = count;
+	}
+
+	namespace
+	{
+		// Largest LCS table, in cells of (n+1)*(m+1), past which array elements are
+		// matched by looking ahead for their hashes instead
+		const size_t maxMatchCells = 1 << 20;
+
+		std::string indexPointer(const std::string &path, size_t index)
+		{
+			std::ostringstream pointer;
+			pointer << path << "/" << index;
+			return pointer.str();
+		}
+		void addOperation(Node &patch, const char *op, const std::string &path, const Node *value)
+		{
+			Node operation = object();
+			operation.add("op", op);
+			operation.add("path", path);
+			if (value != NULL)
+			{
+				operation.add("value", *value);
+			}
+			patch.add(operation);
+		}
+		bool sameNode(const Node &a, unsigned long long hashA, const Node &b, unsigned long long hashB)
+		{
+			return (a.sharesData(b) || (hashA == hashB && a == b));
+		}
+		bool sameNode(const Node &a, const Node &b)
+		{
+			return (a.sharesData(b) || (a.hash() == b.hash() && a == b));
+		}
+
+		typedef std::map<unsigned long long, std::vector<size_t> > HashPositions;
+		const size_t notFound = static_cast<size_t>(-1);
+
+		// First position at or after start of an element with the hash
+		size_t nextPosition(const HashPositions &positions, unsigned long long hash, size_t start)
+		{
+			HashPositions::const_iterator it = positions.find(hash);
+			if (it == positions.end())
+			{
+				return notFound;
+			}
+			std::vector<size_t>::const_iterator position = std::lower_bound(it->second.begin(), it->second.end(), start);
+			return (position == it->second.end() ? notFound : *position);
+		}
+
+		void diffNodes(const Node &a, const Node &b, const std::string &path, Node &patch);
+
+		void diffObjects(const Node &a, const Node &b, const std::string &path, Node &patch)
+		{
+			std::vector<const NamedNode*> from, to;
+			for (Node::const_iterator it = a.begin(); it != a.end(); ++it)
+				from.push_back(&*it);
+			for (Node::const_iterator it = b.begin(); it != b.end(); ++it)
+				to.push_back(&*it);
+
+			// Members usually keep their order, so pair them up until the names differ
+			size_t start = 0;
+			while (start < from.size() && start < to.size() && from[start]->first == to[start]->first)
+			{
+				diffNodes(from[start]->second, to[start]->second, path+"/"+escapePointer(from[start]->first), patch);
+				++start;
+			}
+			if (start == from.size() && start == to.size())
+			{
+				return;
+			}
+
+			// Only the first of duplicate names is used, like Node::get()
+			std::set<std::string> seen;
+			for (size_t i = 0; i < start; ++i)
+			{
+				seen.insert(from[i]->first);
+			}
+			std::map<std::string, const Node*> members;
+			for (size_t i = start; i < to.size(); ++i)
+			{
+				members.insert(std::make_pair(to[i]->first, &to[i]->second));
+			}
+			for (size_t i = start; i < from.size(); ++i)
+			{
+				if (!seen.insert(from[i]->first).second)
+					continue;
+
+				const std::string memberPath = path+"/"+escapePointer(from[i]->first);
+				std::map<std::string, const Node*>::const_iterator member = members.find(from[i]->first);
+				if (member == members.end())
+					addOperation(patch, "remove", memberPath, NULL);
+				else
+					diffNodes(from[i]->second, *member->second, memberPath, patch);
+			}
+			for (size_t i = start; i < to.size(); ++i)
+			{
+				if (seen.insert(to[i]->first).second)
+					addOperation(patch, "add", path+"/"+escapePointer(to[i]->first), &to[i]->second);
+			}
+		}
+
+		// Elements of a packed array only exist while an iterator is on them, so
+		// those are copied to keep the pointers valid
+		void collectElements(const Node &array, std::vector<Node> &copies, std::vector<const Node*> &elements)
+		{
+			if (array.isPacked())
+			{
+				copies.reserve(array.getCount());
+				for (Node::const_iterator it = array.begin(); it != array.end(); ++it)
+					copies.push_back((*it).second);
+				for (size_t i = 0; i < copies.size(); ++i)
+					elements.push_back(&copies[i]);
+				return;
+			}
+			for (Node::const_iterator it = array.begin(); it != array.end(); ++it)
+				elements.push_back(&(*it).second);
+		}
+
+		void diffArrays(const Node &a, const Node &b, const std::string &path, Node &patch)
+		{
+			std::vector<Node> fromCopies, toCopies;
+			std::vector<const Node*> from, to;
+			collectElements(a, fromCopies, from);
+			collectElements(b, toCopies, to);
+
+			// Equal elements at both ends are left alone
+			size_t start = 0;
+			size_t fromEnd = from.size();
+			size_t toEnd = to.size();
+			while (start < fromEnd && start < toEnd && sameNode(*from[start], *to[start]))
+				++start;
+			while (fromEnd > start && toEnd > start && sameNode(*from[fromEnd-1], *to[toEnd-1]))
+			{
+				--fromEnd;
+				--toEnd;
+			}
+
+			const size_t n = fromEnd - start;
+			const size_t m = toEnd - start;
+
+			// Edit script of the middle, 'k'eep, 'r'emove or 'a'dd
+			std::string script;
+			std::vector<unsigned long long> fromHashes(n), toHashes(m);
+			for (size_t i = 0; i < n; ++i)
+				fromHashes[i] = from[start+i]->hash();
+			for (size_t j = 0; j < m; ++j)
+				toHashes[j] = to[start+j]->hash();
+
+			size_t i = 0, j = 0;
+			if ((n+1)*(m+1) <= maxMatchCells)
+			{
+				// Longest common subsequence, lengths[i*(m+1)+j] is for from[i..] and to[j..]
+				std::vector<unsigned int> lengths((n+1)*(m+1), 0);
+				for (size_t x = n; x-- > 0;)
+				{
+					for (size_t y = m; y-- > 0;)
+					{
+						if (sameNode(*from[start+x], fromHashes[x], *to[start+y], toHashes[y]))
+							lengths[x*(m+1)+y] = lengths[(x+1)*(m+1)+y+1] + 1;
+						else
+							lengths[x*(m+1)+y] = std::max(lengths[(x+1)*(m+1)+y], lengths[x*(m+1)+y+1]);
+					}
+				}
+
+				while (i < n && j < m)
+				{
+					if (sameNode(*from[start+i], fromHashes[i], *to[start+j], toHashes[j]))
+					{
+						script += 'k';
+						++i;
+						++j;
+					}
+					else if (lengths[(i+1)*(m+1)+j] >= lengths[i*(m+1)+j+1])
+					{
+						script += 'r';
+						++i;
+					}
+					else
+					{
+						script += 'a';
+						++j;
+					}
+				}
+			}
+			else
+			{
+				// Too large for LCS, so at each mismatch the element that shows up
+				// again soonest on the other side is kept, found through the hashes
+				HashPositions fromPositions, toPositions;
+				for (size_t x = 0; x < n; ++x)
+					fromPositions[fromHashes[x]].push_back(x);
+				for (size_t y = 0; y < m; ++y)
+					toPositions[toHashes[y]].push_back(y);
+
+				while (i < n && j < m)
+				{
+					if (sameNode(*from[start+i], fromHashes[i], *to[start+j], toHashes[j]))
+					{
+						script += 'k';
+						++i;
+						++j;
+						continue;
+					}
+
+					const size_t removeUntil = nextPosition(fromPositions, toHashes[j], i);
+					const size_t addUntil = nextPosition(toPositions, fromHashes[i], j);
+					if (removeUntil == notFound && addUntil == notFound)
+					{
+						script += "ra";
+						++i;
+						++j;
+					}
+					else if (removeUntil == notFound || (addUntil != notFound && addUntil - j <= removeUntil - i))
+					{
+						script += 'a';
+						++j;
+					}
+					else
+					{
+						script += 'r';
+						++i;
+					}
+				}
+			}
+			script.append(n-i, 'r');
+			script.append(m-j, 'a');
+
+			// Removed and added elements between kept ones are paired up and
+			// diffed in place, the rest become remove and add operations
+			size_t index = start;
+			i = start;
+			j = start;
+			size_t pos = 0;
+			while (pos < script.size())
+			{
+				if (script[pos] == 'k')
+				{
+					++index;
+					++i;
+					++j;
+					++pos;
+					continue;
+				}
+
+				size_t removed = 0, added = 0;
+				for (; pos < script.size() && script[pos] != 'k'; ++pos)
+				{
+					if (script[pos] == 'r')
+						++removed;
+					else
+						++added;
+				}
+				const size_t paired = std::min(removed, added);
+				for (size_t k = 0; k < paired; ++k)
+				{
+					diffNodes(*from[i++], *to[j++], indexPointer(path, index++), patch);
+				}
+				for (size_t k = paired; k < removed; ++k)
+				{
+					addOperation(patch, "remove", indexPointer(path, index), NULL);
+					++i;
+				}
+				for (size_t k = paired; k < added; ++k)
+				{
+					addOperation(patch, "add", indexPointer(path, index++), to[j++]);
+				}
+			}
+		}
+
+		void diffNodes(const Node &a, const Node &b, const std::string &path, Node &patch)
+		{
+			if (a.sharesData(b))
+			{
+				return;
+			}
+			if (a.isObject() && b.isObject())
+			{
+				diffObjects(a, b, path, patch);
+			}
+			else if (a.isArray() && b.isArray())
+			{
+				diffArrays(a, b, path, patch);
+			}
+			else if (a != b)
+			{
+				addOperation(patch, "replace", path, &b);
+			}
+		}
+	}
+
+	Node diff(const Node &a, const Node &b)
+	{
+		Node patch = array();
+		diffNodes(a, b, std::string(), patch);
+		return patch;
+	}
+
+	// Reaches into Node to modify children in place along a path
+	class Patch
+	{
+	public:
+		static bool apply(Node &root, const Node &operation, std::string &error)
+		{
+			if (!operation.isObject())
+			{
+				error = "Operation must be an object";
+				return false;
+			}
+			const std::string op = operation.get("op").toString();
+			std::vector<std::string> path;
+			if (!split(operation.get("path"), path, error))
+			{
+				return false;
+			}
+
+			if (op == "add" || op == "replace" || op == "test")
+			{
+				const Node value = operation.get("value");
+				if (!value.isValid())
+				{
+					error = "Missing value";
+					return false;
+				}
+				if (op == "add")
+					return add(root, path, value, error);
+				if (op == "replace")
+					return replace(root, path, value, error);
+
+				Node current;
+				if (!get(root, path, current, error))
+					return false;
+				if (current != value)
+				{
+					error = "Test failed at "+operation.get("path").toString();
+					return false;
+				}
+				return true;
+			}
+			else if (op == "remove")
+			{
+				return remove(root, path, error);
+			}
+			else if (op == "move" || op == "copy")
+			{
+				std::vector<std::string> from;
+				if (!split(operation.get("from"), from, error))
+				{
+					return false;
+				}
+				Node value;
+				if (!get(root, from, value, error))
+				{
+					return false;
+				}
+				if (op == "copy")
+				{
+					return add(root, path, value, error);
+				}
+				if (path.size() > from.size() && std::equal(from.begin(), from.end(), path.begin()))
+				{
+					error = "Cannot move a value into itself";
+					return false;
+				}
+				return (path == from || (remove(root, from, error) && add(root, path, value, error)));
+			}
+
+			error = "Unknown operation: "+op;
+			return false;
+		}
+
+	private:
+		static bool split(const Node &pointer, std::vector<std::string> &tokens, std::string &error)
+		{
+			if (!pointer.isString())
+			{
+				error = "Missing path";
+				return false;
+			}
+			const std::string &str = pointer.data->valueStr;
+			if (!str.empty() && str[0] != '/')
+			{
+				error = "Invalid path: "+str;
+				return false;
+			}
+			size_t start = 1;
+			while (start <= str.size())
+			{
+				const size_t slash = str.find('/', start);
+				const size_t end = (slash == std::string::npos ? str.size() : slash);
+				tokens.push_back(unescapePointer(str.substr(start, end-start)));
+				start = end+1;
+			}
+			return true;
+		}
+		static std::string join(const std::vector<std::string> &tokens, size_t count)
+		{
+			std::string pointer;
+			for (size_t i = 0; i < count; ++i)
+			{
+				pointer += "/"+escapePointer(tokens[i]);
+			}
+			return pointer;
+		}
+		// Array index of a token, the end of the array is only allowed for "-"
+		static bool index(const Node &node, const std::string &token, bool allowEnd, size_t &index)
+		{
+			const size_t count = node.getCount();
+			if (token == "-")
+			{
+				index = count;
+				return allowEnd;
+			}
+			if (token.empty() || token.size() > 18 || (token[0] == '0' && token.size() > 1))
+			{
+				return false;
+			}
+			index = 0;
+			for (size_t i = 0; i < token.size(); ++i)
+			{
+				if (token[i] < '0' || token[i] > '9')
+					return false;
+				index = index*10 + (token[i] - '0');
+			}
+			return (index < count || (allowEnd && index == count));
+		}
+		static int member(const Node &node, const std::string &name)
+		{
+			const Node::NamedNodeList &children = node.data->children;
+			for (size_t i = 0; i < children.size(); ++i)
+			{
+				if (children[i].first == name)
+					return static_cast<int>(i);
+			}
+			return -1;
+		}
+		// Detaches every node down to the parent of the last token
+		static Node *parent(Node &root, const std::vector<std::string> &tokens, std::string &error)
+		{
+			Node *node = &root;
+			for (size_t i = 0; i+1 < tokens.size(); ++i)
+			{
+				node->detach();
+				size_t position = 0;
+				if (node->isObject())
+				{
+					const int found = member(*node, tokens[i]);
+					if (found < 0)
+						node = NULL;
+					else
+						position = static_cast<size_t>(found);
+				}
+				else if (!node->isArray() || !index(*node, tokens[i], false, position))
+				{
+					node = NULL;
+				}
+				if (node == NULL)
+				{
+					error = "Path not found: "+join(tokens, i+1);
+					return NULL;
+				}
+				node = &node->data->children[position].second;
+			}
+			node->detach();
+			if (!node->isContainer())
+			{
+				error = "Path not found: "+join(tokens, tokens.size()-1);
+				return NULL;
+			}
+			return node;
+		}
+		static bool get(const Node &root, const std::vector<std::string> &tokens, Node &value, std::string &error)
+		{
+			value = root;
+			for (size_t i = 0; i < tokens.size(); ++i)
+			{
+				size_t position = 0;
+				if (value.isObject() && value.has(tokens[i]))
+				{
+					value = value.get(tokens[i]);
+				}
+				else if (value.isArray() && index(value, tokens[i], false, position))
+				{
+					value = value.get(position);
+				}
+				else
+				{
+					error = "Path not found: "+join(tokens, i+1);
+					return false;
+				}
+			}
+			return true;
+		}
+		static bool add(Node &root, const std::vector<std::string> &tokens, const Node &value, std::string &error)
+		{
+			if (tokens.empty())
+			{
+				root = value;
+				return true;
+			}
+			Node *node = parent(root, tokens, error);
+			if (node == NULL)
+			{
+				return false;
+			}
+			const std::string &name = tokens.back();
+			if (node->isObject())
+			{
+				const int found = member(*node, name);
+				if (found < 0)
+					node->data->children.push_back(std::make_pair(name, value));
+				else
+					node->data->children[static_cast<size_t>(found)].second = value;
+				return true;
+			}
+			size_t position = 0;
+			if (!index(*node, name, true, position))
+			{
+				error = "Invalid array index: "+join(tokens, tokens.size());
+				return false;
+			}
+			insertAt(node->data->children, position, std::make_pair(std::string(), value));
+			return true;
+		}
+		// Parent of an existing value and its position in it
+		static Node *locate(Node &root, const std::vector<std::string> &tokens, size_t &position, std::string &error)
+		{
+			Node *node = parent(root, tokens, error);
+			if (node == NULL)
+			{
+				return NULL;
+			}
+			if (node->isObject())
+			{
+				const int found = member(*node, tokens.back());
+				if (found >= 0)
+				{
+					position = static_cast<size_t>(found);
+					return node;
+				}
+			}
+			else if (index(*node, tokens.back(), false, position))
+			{
+				return node;
+			}
+			error = "Path not found: "+join(tokens, tokens.size());
+			return NULL;
+		}
+		static bool replace(Node &root, const std::vector<std::string> &tokens, const Node &value, std::string &error)
+		{
+			if (tokens.empty())
+			{
+				root = value;
+				return true;
+			}
+			size_t position = 0;
+			Node *node = locate(root, tokens, position, error);
+			if (node == NULL)
+			{
+				return false;
+			}
+			node->data->children[position].second = value;
+			return true;
+		}
+		static bool remove(Node &root, const std::vector<std::string> &tokens, std::string &error)
+		{
+			if (tokens.empty())
+			{
+				error = "Cannot remove the root";
+				return false;
+			}
+			size_t position = 0;
+			Node *node = locate(root, tokens, position, error);
+			if (node == NULL)
+			{
+				return false;
+			}
+			eraseAt(node->data->children, position);
+			return true;
+		}
+	};
+
+	bool applyPatch(Node &node, const Node &patch, std::string *error)
+	{
+		std::string message;
+		if (!patch.isArray())
+		{
+			message = "Patch must be an array";
+		}
+
+		// Works on a copy that shares the data, so a failed patch leaves the node as it was
+		Node result = node;
+		size_t count = 0;
+		for (Node::const_iterator it = patch.begin(); message.empty() && it != patch.end(); ++it, ++count)
+		{
+			std::string operationError;
+			if (!Patch::apply(result, (*it).second, operationError))
+			{
+				std::ostringstream str;
+				str << "Operation " << count << ": " << operationError;
+				message = str.str();
+			}
+		}
+
+		if (!message.empty())
+		{
+			if (error != NULL)
+				*error = message;
+			return false;
+		}
+		node = result;
+		return true;
+	}
+
+	namespace
+	{
+		// Finds the next quote or backslash, non-ASCII text is skipped as well
+		const char *findQuoteOrBackslash(const char *it, const char *end)
+		{
+#ifdef JZON_SSE2
+			const __m128i quote = _mm_set1_epi8('"');
+			const __m128i backslash = _mm_set1_epi8('\\');
+			while (end - it >= 16)
+			{
+				const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(it));
+				const __m128i special = _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash));
+				const unsigned int mask = static_cast<unsigned int>(_mm_movemask_epi8(special));
+				if (mask != 0)
+				{
+					return it + countTrailingZeros(mask);
+				}
+				it += 16;
+			}
+#endif
+			while (it != end && *it != '"' && *it != '\\')
+			{
+				++it;
+			}
+			return it;
+		}
+		// Finds the next character that can open or close anything: brackets, quotes and comments.
+		// The runs in between are short in most documents, too short to gain from SSE2.
+		inline const char *findStructural(const char *it, const char *end)
+		{
+			while (it != end && *it != '"' && *it != '/' && *it != '{' && *it != '}' && *it != '[' && *it != ']')
+			{
+				++it;
+			}
+			return it;
+		}
+
+		// Skips a comment starting at it, or returns it if there is none
+		const char *skipComment(const char *it, const char *end)
+		{
+			if (end - it < 2 || it[0] != '/' || (it[1] != '*' && it[1] != '/'))
+			{
+				return it;
+			}
+			if (it[1] == '/')
+			{
+				const char *newline = static_cast<const char*>(std::memchr(it, '\n', end - it));
+				return (newline != NULL ? newline : end);
+			}
+			for (it += 2; end - it >= 2; ++it)
+			{
+				if (it[0] == '*' && it[1] == '/')
+					return it + 2;
+			}
+			return end;
+		}
+		const char *skipSpace(const char *it, const char *end)
+		{
+			for (;;)
+			{
+				while (it != end && isWhitespace(*it))
 				{
-					token = T_SEPARATOR_NODE;
-					break;
+					++it;
 				}
-			case ':':
+				const char *next = skipComment(it, end);
+				if (next == it)
 				{
-					token = T_SEPARATOR_NAME;
-					break;
+					return it;
 				}
-			case '"':
+				it = next;
+			}
+		}
+		// Skips a string from just after its opening quote, returns NULL if it doesn't end
+		const char *skipStringBody(const char *it, const char *end)
+		{
+			for (;;)
+			{
+				it = findQuoteOrBackslash(it, end);
+				if (end - it < 2)
 				{
-					token = T_VALUE;
-					readString(stream, data);
-					break;
+					return (it != end && *it == '"' ? it + 1 : NULL);
 				}
-			case '/':
+				if (*it == '"')
 				{
-					char p = static_cast<char>(stream.peek());
-					if (p == '*')
-					{
-						jumpToCommentEnd(stream);
-						saveBuffer = false;
-						break;
-					}
-					else if (p == '/')
-					{
-						jumpToNext('\n', stream);
-						saveBuffer = false;
-						break;
-					}
-					// Intentional fallthrough
+					return it + 1;
 				}
-			default:
+				it += 2;
+			}
+		}
+		// Skips a whole value, returns NULL if it doesn't end
+		const char *skipValue(const char *it, const char *end)
+		{
+			if (it == end)
+			{
+				return NULL;
+			}
+			if (*it == '"')
+			{
+				return skipStringBody(it + 1, end);
+			}
+			if (*it != '{' && *it != '[')
+			{
+				while (it != end && !isWhitespace(*it) && *it != ',' && *it != ':' && *it != '}' && *it != ']' && *it != '"' && skipComment(it, end) == it)
 				{
-					valueBuffer += c;
-					saveBuffer = false;
-					break;
+					++it;
 				}
+				return it;
 			}
 
-			if ((saveBuffer || stream.peek() == std::char_traits<char>::eof()) && (!valueBuffer.empty())) // Always save buffer on the last character
+			size_t depth = 0;
+			while (it != end)
 			{
-				if (interpretValue(valueBuffer, data))
-				{
-					tokens.push(T_VALUE);
-				}
-				else
+				switch (*it)
 				{
-					// Store the unknown token, so we can show it to the user
-					data.push(std::make_pair(Node::T_STRING, valueBuffer));
-					tokens.push(T_UNKNOWN);
+				case '{': // Fallthrough
+				case '[':
+					++depth;
+					++it;
+					break;
+				case '}': // Fallthrough
+				case ']':
+					++it;
+					if (--depth == 0)
+						return it;
+					break;
+				case '"':
+					it = skipStringBody(it + 1, end);
+					if (it == NULL)
+						return NULL;
+					break;
+				case '/':
+					{
+						const char *next = skipComment(it, end);
+						it = (next == it ? it + 1 : next);
+						break;
+					}
+				default:
+					break;
 				}
-
-				valueBuffer.clear();
+				it = findStructural(it, end);
 			}
+			return NULL;
+		}
 
-			// Push the token last so that any data
-			// will get pushed first from above.
-			// If saveBuffer is false, it means that
-			// we are in the middle of a value, so we
-			// don't want to push any tokens now.
-			if (saveBuffer)
-			{
-				tokens.push(token);
-			}
+		bool failSplice(std::string *error, const std::string &message)
+		{
+			if (error != NULL)
+				*error = message;
+			return false;
 		}
 	}
-	Node Parser::assemble(TokenQueue &tokens, DataQueue &data)
-	{
-		std::stack<NamedNode> nodeStack;
-		Node root(Node::T_INVALID);
 
-		std::string nextName = "";
+	bool locate(const char *json, size_t length, const std::string &pointer, size_t &begin, size_t &end, std::string *error)
+	{
+		if (!pointer.empty() && pointer[0] != '/')
+		{
+			return failSplice(error, "Invalid path: "+pointer);
+		}
 
-		Token token;
-		while (!tokens.empty())
+		const char *stop = json + length;
+		const char *it = skipSpace(json, stop);
+		size_t start = 1;
+		while (start <= pointer.size())
 		{
-			token = tokens.front();
-			tokens.pop();
+			const size_t slash = std::min(pointer.find('/', start), pointer.size());
+			const std::string token = unescapePointer(pointer.substr(start, slash-start));
+			const std::string path = pointer.substr(0, slash);
+			start = slash+1;
 
-			switch (token)
+			if (it == stop || (*it != '{' && *it != '['))
 			{
-			case T_UNKNOWN:
-				{
-					const std::string &unknownToken = data.front().second;
-					error = "Unknown token: "+unknownToken;
-					data.pop();
-					return Node(Node::T_INVALID);
-				}
-			case T_OBJ_BEGIN:
+				return failSplice(error, "Path not found: "+path);
+			}
+			const bool object = (*it == '{');
+
+			size_t index = 0;
+			if (!object && (token.empty() || token.size() > 18 || (token[0] == '0' && token.size() > 1) || token.find_first_not_of("0123456789") != std::string::npos))
+			{
+				return failSplice(error, "Invalid array index: "+path);
+			}
+			for (size_t i = 0; !object && i < token.size(); ++i)
+			{
+				index = index*10 + (token[i] - '0');
+			}
+
+			it = skipSpace(it + 1, stop);
+			for (size_t count = 0;; ++count)
+			{
+				if (it == stop)
 				{
-					nodeStack.push(std::make_pair(nextName, object()));
-					nextName.clear();
-					break;
+					return failSplice(error, "Unexpected end of input");
 				}
-			case T_ARRAY_BEGIN:
+				if (*it == (object ? '}' : ']'))
 				{
-					nodeStack.push(std::make_pair(nextName, array()));
-					nextName.clear();
-					break;
+					return failSplice(error, "Path not found: "+path);
 				}
-			case T_OBJ_END:
-			case T_ARRAY_END:
+
+				bool found = (!object && count == index);
+				if (object)
 				{
-					if (nodeStack.empty())
-					{
-						error = "Found end of object or array without beginning";
-						return Node(Node::T_INVALID);
-					}
-					if (token == T_OBJ_END && !nodeStack.top().second.isObject())
-					{
-						error = "Mismatched end and beginning of object";
-						return Node(Node::T_INVALID);
-					}
-					if (token == T_ARRAY_END && !nodeStack.top().second.isArray())
+					if (*it != '"')
 					{
-						error = "Mismatched end and beginning of array";
-						return Node(Node::T_INVALID);
+						return failSplice(error, "A name has to be a string");
 					}
-
-					std::string nodeName = nodeStack.top().first;
-					Node node = nodeStack.top().second;
-					nodeStack.pop();
-
-					if (!nodeStack.empty())
+					const char *name = it + 1;
+					it = skipStringBody(name, stop);
+					if (it == NULL)
 					{
-						Node &stackTop = nodeStack.top().second;
-						if (stackTop.isObject())
-						{
-							stackTop.add(nodeName, node);
-						}
-						else if (stackTop.isArray())
-						{
-							stackTop.add(node);
-						}
-						else
-						{
-							error = "Can only add elements to objects and arrays";
-							return Node(Node::T_INVALID);
-						}
+						return failSplice(error, "Unterminated string");
 					}
+					const size_t nameLength = static_cast<size_t>(it - 1 - name);
+					if (std::memchr(name, '\\', nameLength) != NULL)
+						found = (unescapeString(std::string(name, nameLength)) == token);
 					else
+						found = (nameLength == token.size() && std::memcmp(name, token.data(), nameLength) == 0);
+
+					it = skipSpace(it, stop);
+					if (it == stop || *it != ':')
 					{
-						root = node;
+						return failSplice(error, "Expected ':' after name");
 					}
-					break;
+					it = skipSpace(it + 1, stop);
 				}
-			case T_VALUE:
+				if (found)
 				{
-					if (data.empty())
-					{
-						error = "Missing data for value";
-						return Node(Node::T_INVALID);
-					}
-
-					const std::pair<Node::Type, std::string> &dataPair = data.front();
-					if (!tokens.empty() && tokens.front() == T_SEPARATOR_NAME)
-					{
-						tokens.pop();
-						if (dataPair.first != Node::T_STRING)
-						{
-							error = "A name has to be a string";
-							return Node(Node::T_INVALID);
-						}
-						else
-						{
-							nextName = dataPair.second;
-							data.pop();
-						}
-					}
-					else
-					{
-						Node node(dataPair.first, dataPair.second);
-						data.pop();
-
-						if (!nodeStack.empty())
-						{
-							Node &stackTop = nodeStack.top().second;
-							if (stackTop.isObject())
-								stackTop.add(nextName, node);
-							else if (stackTop.isArray())
-								stackTop.add(node);
-
-							nextName.clear();
-						}
-						else
-						{
-							error = "Outermost node must be an object or array";
-							return Node(Node::T_INVALID);
-						}
-					}
 					break;
 				}
-			case T_SEPARATOR_NAME:
-				break;
-			case T_SEPARATOR_NODE:
+
+				it = skipValue(it, stop);
+				if (it == NULL)
 				{
-					if (!tokens.empty() && tokens.front() == T_ARRAY_END) {
-						error = "Extra comma in array";
-						return Node(Node::T_INVALID);
-					}
-					break;
+					return failSplice(error, "Unexpected end of input");
+				}
+				it = skipSpace(it, stop);
+				if (it != stop && *it == ',')
+				{
+					it = skipSpace(it + 1, stop);
+				}
+				else if (it != stop && *it != (object ? '}' : ']'))
+				{
+					return failSplice(error, "Expected ',' after value");
 				}
 			}
 		}
 
-		return root;
-	}
-
-	void Parser::jumpToNext(char c, std::istream &stream)
-	{
-		while (!stream.eof() && static_cast<char>(stream.get()) != c);
-		stream.unget();
-	}
-	void Parser::jumpToCommentEnd(std::istream &stream)
-	{
-		stream.ignore(1);
-		char c1 = '\0', c2 = '\0';
-		while (stream.peek() != std::char_traits<char>::eof())
+		const char *valueEnd = skipValue(it, stop);
+		if (valueEnd == NULL || valueEnd == it)
 		{
-			stream.get(c2);
-
-			if (c1 == '*' && c2 == '/')
-				break;
-
-			c1 = c2;
+			return failSplice(error, "Unexpected end of input");
 		}
+		begin = static_cast<size_t>(it - json);
+		end = static_cast<size_t>(valueEnd - json);
+		return true;
 	}
-
-	void Parser::readString(std::istream &stream, DataQueue &data)
+	bool splice(std::string &json, const std::string &pointer, const Node &value, std::string *error)
 	{
-		std::string str;
-
-		char c1 = '\0', c2 = '\0';
-		while (stream.peek() != std::char_traits<char>::eof())
+		size_t begin, end;
+		if (!value.isValid())
 		{
-			stream.get(c2);
-
-			if (c1 != '\\' && c2 == '"')
-			{
-				break;
-			}
-
-			str += c2;
-
-			c1 = c2;
+			return failSplice(error, "Invalid value");
+		}
+		if (!locate(json.data(), json.size(), pointer, begin, end, error))
+		{
+			return false;
 		}
 
-		data.push(std::make_pair(Node::T_STRING, str));
+		std::string text;
+		Writer().writeString(value, text);
+		json.replace(begin, end-begin, text);
+		return true;
 	}
-	bool Parser::interpretValue(const std::string &value, DataQueue &data)
+	bool spliceInPlace(char *json, size_t length, const std::string &pointer, const Node &value, std::string *error)
 	{
-		std::string upperValue(value.size(), '\0');
-
-		std::transform(value.begin(), value.end(), upperValue.begin(), toupper);
-
-		if (upperValue == "NULL")
+		size_t begin, end;
+		if (!value.isValid())
 		{
-			data.push(std::make_pair(Node::T_NULL, std::string()));
+			return failSplice(error, "Invalid value");
 		}
-		else if (upperValue == "TRUE")
+		if (!locate(json, length, pointer, begin, end, error))
 		{
-			data.push(std::make_pair(Node::T_BOOL, std::string("true")));
+			return false;
 		}
-		else if (upperValue == "FALSE")
+		while (end < length && json[end] == ' ')
 		{
-			data.push(std::make_pair(Node::T_BOOL, std::string("false")));
+			++end;
 		}
-		else
+
+		std::string text;
+		Writer().writeString(value, text);
+		if (text.size() > end-begin)
 		{
-			bool number = true;
-			bool negative = false;
-			bool fraction = false;
-			bool scientific = false;
-			bool scientificSign = false;
-			bool scientificNumber = false;
-			for (std::string::const_iterator it = upperValue.begin(); number && it != upperValue.end(); ++it)
+			std::ostringstream message;
+			message << "The new value needs " << text.size() << " bytes, but only " << (end-begin) << " are available";
+			return failSplice(error, message.str());
+		}
+		std::memcpy(json+begin, text.data(), text.size());
+		std::memset(json+begin+text.size(), ' ', end-begin-text.size());
+		return true;
+	}
+
+	namespace Detail
+	{
+		namespace
+		{
+			template <typename T>
+			bool readInteger(Reader &reader, Reader::Token token, T &value)
 			{
-				char c = (*it);
-				switch (c)
+				if (token == Reader::T_VALUE && reader.getType() == Node::T_NULL)
+					return true;
+				if (token != Reader::T_VALUE || reader.getType() != Node::T_NUMBER)
+					return fail(reader, token, "Expected a number");
+
+				const std::string &str = reader.getValue();
+				const bool negative = (str[0] == '-');
+				const bool isSigned = std::numeric_limits<T>::is_signed;
+				unsigned long long magnitude = 0;
+				for (size_t i = (negative ? 1 : 0); i < str.size(); ++i)
 				{
-				case '-':
-					{
-						if (scientific)
-						{
-							if (scientificSign) // Only one - allowed after E
-								number = false;
-							else
-								scientificSign = true;
-						}
-						else
-						{
-							if (negative) // Only one - allowed before E
-								number = false;
-							else
-								negative = true;
-						}
-						break;
-					}
-				case '+':
-					{
-						if (!scientific || scientificSign)
-							number = false;
-						else
-							scientificSign = true;
-						break;
-					}
-				case '.':
-					{
-						if (fraction) // Only one . allowed
-							number = false;
-						else
-							fraction = true;
-						break;
-					}
-				case 'E':
-					{
-						if (scientific)
-							number = false;
-						else
-							scientific = true;
-						break;
-					}
-				default:
+					const char c = str[i];
+					if (c < '0' || c > '9')
 					{
-						if (c >= '0' && c <= '9')
-						{
-							if (scientific)
-								scientificNumber = true;
-						}
-						else
-						{
-							number = false;
-						}
-						break;
+						// Fractions and exponents are truncated like Node::toInt()
+						const double real = std::strtod(str.c_str(), NULL);
+						const double truncated = (real < 0 ? std::ceil(real) : std::floor(real));
+						const double limit = std::ldexp(1.0, std::numeric_limits<T>::digits);
+						if (!(truncated < limit && truncated >= (isSigned ? -limit : 0.0)))
+							return fail(reader, token, "Number out of range");
+						value = static_cast<T>(truncated);
+						return true;
 					}
+					const unsigned int digit = static_cast<unsigned int>(c - '0');
+					if (magnitude > (std::numeric_limits<unsigned long long>::max() - digit) / 10)
+						return fail(reader, token, "Number out of range");
+					magnitude = magnitude*10 + digit;
 				}
+
+				// The most negative value has one more than the largest positive one
+				const unsigned long long largest = static_cast<unsigned long long>(std::numeric_limits<T>::max());
+				if (negative ? (magnitude != 0 && (!isSigned || magnitude - 1 > largest)) : magnitude > largest)
+					return fail(reader, token, "Number out of range");
+				if (negative && magnitude != 0)
+					value = static_cast<T>(-static_cast<long long>(magnitude - 1) - 1);
+				else
+					value = static_cast<T>(magnitude);
+				return true;
 			}
+			template <typename T>
+			bool readReal(Reader &reader, Reader::Token token, T &value)
+			{
+				if (token == Reader::T_VALUE && reader.getType() == Node::T_NULL)
+					return true;
+				if (token != Reader::T_VALUE || reader.getType() != Node::T_NUMBER)
+					return fail(reader, token, "Expected a number");
 
-			if (scientific && !scientificNumber)
-				number = false;
+				const double real = std::strtod(reader.getValue().c_str(), NULL);
+				const double largest = static_cast<double>(std::numeric_limits<T>::max());
+				if (!(real <= largest && real >= -largest))
+					return fail(reader, token, "Number out of range");
+				value = static_cast<T>(real);
+				return true;
+			}
+			template <typename T>
+			void writeReal(std::ostream &stream, T value)
+			{
+				// JSON has no infinity or NaN
+				const T largest = std::numeric_limits<T>::max();
+				if (!(value <= largest && value >= -largest))
+				{
+					stream << "null";
+					return;
+				}
+				// Enough digits to read back the same value, max_digits10 in C++11
+				const std::streamsize precision = stream.precision(2 + std::numeric_limits<T>::digits * 30103 / 100000);
+				stream << value;
+				stream.precision(precision);
+			}
+		}
 
-			if (number)
+		bool fail(Reader &reader, Reader::Token token, const char *message)
+		{
+			if (token == Reader::T_UNKNOWN)
 			{
-				data.push(std::make_pair(Node::T_NUMBER, value));
+				reader.setError("Unknown token: "+reader.getValue());
 			}
-			else
+			else if (token != Reader::T_ERROR)
 			{
-				return false;
+				reader.setError(message);
 			}
+			return false;
 		}
+		bool skip(Reader &reader, Reader::Token token)
+		{
+			if (token == Reader::T_VALUE)
+				return true;
+			if (token != Reader::T_OBJ_BEGIN && token != Reader::T_ARRAY_BEGIN)
+				return fail(reader, token, "Expected a value");
 
-		return true;
+			int depth = 1;
+			while (depth > 0)
+			{
+				token = reader.next();
+				switch (token)
+				{
+				case Reader::T_OBJ_BEGIN: // Fallthrough
+				case Reader::T_ARRAY_BEGIN:
+					++depth;
+					break;
+				case Reader::T_OBJ_END: // Fallthrough
+				case Reader::T_ARRAY_END:
+					--depth;
+					break;
+				case Reader::T_UNKNOWN: // Fallthrough
+				case Reader::T_ERROR:
+					return fail(reader, token, "");
+				case Reader::T_END:
+					return fail(reader, token, "Unexpected end of input");
+				default:
+					break;
+				}
+			}
+			return true;
+		}
+		bool finish(Reader &reader)
+		{
+			const Reader::Token token = reader.next();
+			return (token == Reader::T_END || fail(reader, token, "Expected end of input"));
+		}
+
+		bool read(Reader &reader, Reader::Token token, bool &value)
+		{
+			if (token == Reader::T_VALUE && reader.getType() == Node::T_NULL)
+				return true;
+			if (token != Reader::T_VALUE || reader.getType() != Node::T_BOOL)
+				return fail(reader, token, "Expected a bool");
+
+			value = (reader.getValue() == "true");
+			return true;
+		}
+		bool read(Reader &reader, Reader::Token token, int &value) { return readInteger(reader, token, value); }
+		bool read(Reader &reader, Reader::Token token, unsigned int &value) { return readInteger(reader, token, value); }
+		bool read(Reader &reader, Reader::Token token, long &value) { return readInteger(reader, token, value); }
+		bool read(Reader &reader, Reader::Token token, unsigned long &value) { return readInteger(reader, token, value); }
+		bool read(Reader &reader, Reader::Token token, long long &value) { return readInteger(reader, token, value); }
+		bool read(Reader &reader, Reader::Token token, unsigned long long &value) { return readInteger(reader, token, value); }
+		bool read(Reader &reader, Reader::Token token, float &value) { return readReal(reader, token, value); }
+		bool read(Reader &reader, Reader::Token token, double &value) { return readReal(reader, token, value); }
+		bool read(Reader &reader, Reader::Token token, std::string &value)
+		{
+			if (token == Reader::T_VALUE && reader.getType() == Node::T_NULL)
+				return true;
+			if (token != Reader::T_VALUE || reader.getType() != Node::T_STRING)
+				return fail(reader, token, "Expected a string");
+
+			value.swap(reader.getValue());
+			return true;
+		}
+
+		void write(std::ostream &stream, bool value) { stream << (value ? "true" : "false"); }
+		void write(std::ostream &stream, int value) { stream << value; }
+		void write(std::ostream &stream, unsigned int value) { stream << value; }
+		void write(std::ostream &stream, long value) { stream << value; }
+		void write(std::ostream &stream, unsigned long value) { stream << value; }
+		void write(std::ostream &stream, long long value) { stream << value; }
+		void write(std::ostream &stream, unsigned long long value) { stream << value; }
+		void write(std::ostream &stream, float value) { writeReal(stream, value); }
+		void write(std::ostream &stream, double value) { writeReal(stream, value); }
+		void write(std::ostream &stream, const std::string &value) { writeQuoted(stream, value); }
+		void writeName(std::ostream &stream, const char *name, size_t length)
+		{
+			size_t escapes = 0;
+			writeQuoted(stream, name, name + length, escapes);
+			stream.put(':');
+		}
 	}
 }
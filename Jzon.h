@@ -25,9 +25,17 @@ THE SOFTWARE.
 #include <string>
 #include <vector>
 #include <queue>
+#include <map>
 #include <iterator>
 #include <istream>
 #include <ostream>
+#include <sstream>
+
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#	include <string_view>
+#	include <type_traits>
+#	define JZON_STRING_VIEW
+#endif
 
 #ifndef JZON_API
 #	ifdef JZON_DLL
@@ -60,9 +68,102 @@ namespace Jzon
 	class Node;
 	typedef std::pair<std::string, Node> NamedNode;
 
+	// Heap bytes used by a tree, see Node::memoryUsage()
+	struct MemoryUsage
+	{
+		size_t total;
+		size_t headers;  // Node data blocks
+		size_t values;   // Text of strings, numbers and booleans
+		size_t keys;     // Member names
+		size_t children; // Lists of children
+		size_t packed;   // Packed numeric arrays
+		size_t unused;   // Spare capacity included above, freed by Node::shrinkToFit()
+		size_t blocks;   // Distinct data blocks, shared ones are counted once
+	};
+
+	// Member name for lookups repeated on many objects with the same layout,
+	// like the records of an array. It remembers where the name was found last
+	// and looks there first, so objects with the same member order are not
+	// searched at all:
+	//
+	//   const Jzon::Key timestamp("timestamp");
+	//   for (...) total += record.get(timestamp).toDouble();
+	//
+	// If an object has the name twice, either member may be found. Lookups
+	// update the remembered position, so a key must not be shared by threads:
+	// make one per loop as above rather than a static or global one.
+	class JZON_API Key
+	{
+	public:
+		explicit Key(const std::string &name);
+		explicit Key(const char *name);
+
+		inline const std::string &getName() const { return name; }
+
+	private:
+		friend class Node;
+
+		std::string name;
+		mutable size_t slot;
+	};
+
 	class JZON_API Node
 	{
+#ifdef JZON_PERSISTENT_CONTAINERS
+		class PersistentList;
+#endif
+		struct PackedNumbers;
 	public:
+#ifdef JZON_PERSISTENT_CONTAINERS
+		class JZON_API iterator : public std::iterator<std::input_iterator_tag, NamedNode>
+		{
+		public:
+			iterator() : list(0), index(0) {}
+			iterator(PersistentList *l, size_t i) : list(l), index(i) {}
+			iterator(const iterator &it) : list(it.list), index(it.index) {}
+
+			iterator &operator++() { ++index; return *this; }
+			iterator operator++(int) { iterator tmp(*this); operator++(); return tmp; }
+
+			bool operator==(const iterator &rhs) { return index == rhs.index; }
+			bool operator!=(const iterator &rhs) { return index != rhs.index; }
+
+			NamedNode &operator*();
+			NamedNode *operator->();
+
+		private:
+			PersistentList *list;
+			size_t index;
+		};
+		class JZON_API const_iterator : public std::iterator<std::input_iterator_tag, const NamedNode>
+		{
+		public:
+			const_iterator() : list(0), packed(0), index(0), current(0) {}
+			const_iterator(const PersistentList *l, size_t i) : list(l), packed(0), index(i), current(0) {}
+			const_iterator(const PackedNumbers *n, size_t i) : list(0), packed(n), index(i), current(0) {}
+			const_iterator(const const_iterator &it) : list(it.list), packed(it.packed), index(it.index), current(0) {}
+			~const_iterator();
+
+			const_iterator &operator=(const const_iterator &rhs);
+
+			const_iterator &operator++() { ++index; return *this; }
+			const_iterator operator++(int) { const_iterator tmp(*this); operator++(); return tmp; }
+
+			bool operator==(const const_iterator &rhs) { return index == rhs.index; }
+			bool operator!=(const const_iterator &rhs) { return index != rhs.index; }
+
+			const NamedNode &operator*();
+			const NamedNode *operator->();
+
+		private:
+			const NamedNode &unpacked();
+
+			const PersistentList *list;
+			const PackedNumbers *packed;
+			size_t index;
+			NamedNode *current; // Element of a packed array, made on demand
+		};
+#else
 		class iterator : public std::iterator<std::input_iterator_tag, NamedNode>
 		{
 		public:
@@ -82,25 +183,35 @@ namespace Jzon
 		private:
 			NamedNode *p;
 		};
-		class const_iterator : public std::iterator<std::input_iterator_tag, const NamedNode>
+		class JZON_API const_iterator : public std::iterator<std::input_iterator_tag, const NamedNode>
 		{
 		public:
-			const_iterator() : p(0) {}
-			const_iterator(const NamedNode *o) : p(o) {}
-			const_iterator(const const_iterator &it) : p(it.p) {}
+			const_iterator() : p(0), packed(0), index(0), current(0) {}
+			const_iterator(const NamedNode *o) : p(o), packed(0), index(0), current(0) {}
+			const_iterator(const PackedNumbers *n, size_t i) : p(0), packed(n), index(i), current(0) {}
+			const_iterator(const const_iterator &it) : p(it.p), packed(it.packed), index(it.index), current(0) {}
+			~const_iterator();
 
-			const_iterator &operator++() { ++p; return *this; }
+			const_iterator &operator=(const const_iterator &rhs);
+
+			const_iterator &operator++() { if (packed != 0) ++index; else ++p; return *this; }
 			const_iterator operator++(int) { const_iterator tmp(*this); operator++(); return tmp; }
 
-			bool operator==(const const_iterator &rhs) { return p == rhs.p; }
-			bool operator!=(const const_iterator &rhs) { return p != rhs.p; }
+			bool operator==(const const_iterator &rhs) { return p == rhs.p && index == rhs.index; }
+			bool operator!=(const const_iterator &rhs) { return p != rhs.p || index != rhs.index; }
 
-			const NamedNode &operator*() { return *p; }
-			const NamedNode *operator->() { return p; }
+			const NamedNode &operator*() { return (packed != 0 ? unpacked() : *p); }
+			const NamedNode *operator->() { return &operator*(); }
 
 		private:
+			const NamedNode &unpacked();
+
 			const NamedNode *p;
+			const PackedNumbers *packed;
+			size_t index;
+			NamedNode *current; // Element of a packed array, made on demand
 		};
+#endif
 
 		enum Type
 		{
@@ -144,6 +255,10 @@ namespace Jzon
 		inline bool isValue() const { return (isNull() || isString() || isNumber() || isBool()); }
 
 		std::string toString(const std::string &def = std::string()) const;
+#ifdef JZON_STRING_VIEW
+		// Like toString(), without copying. Valid until the node is modified.
+		std::string_view toStringView(std::string_view def = std::string_view()) const;
+#endif
 		int toInt(int def = 0) const;
 		float toFloat(float def = 0.f) const;
 		double toDouble(double def = 0.0) const;
@@ -152,6 +267,8 @@ namespace Jzon
 		void setNull();
 		void set(Type type, const std::string &value);
 		void set(const std::string &value);
+		// Sets a string that is already unescaped, without copying it through unescapeString()
+		void setRaw(const std::string &value);
 		void set(const char *value);
 		void set(int value);
 		void set(unsigned int value);
@@ -180,21 +297,176 @@ namespace Jzon
 		void clear();
 
 		bool has(const std::string &name) const;
+		bool has(const Key &key) const;
 		size_t getCount() const;
 		Node get(const std::string &name) const;
+		Node get(const Key &key) const;
 		Node get(size_t index) const;
+		void remove(const Key &key);
+
+		// Like get(), but returns a reference to the child instead of a copy, or
+		// to an invalid node when there is none. The reference stays valid until
+		// this node is modified. On packed arrays the first at(index) makes nodes
+		// for all the elements, which stay next to the packed numbers.
+		const Node &at(const std::string &name) const;
+		const Node &at(const Key &key) const;
+		const Node &at(size_t index) const;
+
+#ifdef JZON_STRING_VIEW
+		// Only chosen for std::string_view arguments, so that literals and 0
+		// still go to the overloads above
+		template <typename T>
+		typename std::enable_if<std::is_same<T, std::string_view>::value, bool>::type has(T name) const
+		{
+			return (findChild(name.data(), name.size(), noChild) != noChild);
+		}
+		template <typename T>
+		typename std::enable_if<std::is_same<T, std::string_view>::value, Node>::type get(T name) const
+		{
+			return childAt(findChild(name.data(), name.size(), noChild));
+		}
+		template <typename T>
+		typename std::enable_if<std::is_same<T, std::string_view>::value, const Node&>::type at(T name) const
+		{
+			return childAt(findChild(name.data(), name.size(), noChild));
+		}
+		template <typename T>
+		typename std::enable_if<std::is_same<T, std::string_view>::value>::type remove(T name)
+		{
+			removeChild(findChild(name.data(), name.size(), noChild));
+		}
+#endif
 
 		iterator begin();
 		const_iterator begin() const;
 		iterator end();
 		const_iterator end() const;
 
+		// Arrays of numbers read by Parser are stored packed, as one block of
+		// integers or doubles instead of a node per element, as long as every
+		// number is written back exactly as it was read. They are unpacked the
+		// first time they are modified or iterated over without const. A
+		// const_iterator over a packed array makes each element on demand, and
+		// the reference it returns lasts until the iterator is moved.
+		bool isPacked() const;
+		// Direct access to the packed values, getCount() long. NULL unless the
+		// array is packed with that type.
+		const long long *getIntegerData() const;
+		const double *getDoubleData() const;
+		// Copies every element of an array, packed or not
+		std::vector<long long> toIntegerArray() const;
+		std::vector<double> toDoubleArray() const;
+
+		// Estimates the memory used by the whole tree, counting data shared
+		// between nodes once. Allocator overhead and the immortal data of
+		// common values like null and true are not included.
+		MemoryUsage memoryUsage() const;
+		// Releases spare capacity in every string and list of the tree. The
+		// tree is not detached, since shared data keeps the same contents.
+		void shrinkToFit();
+
+		// True when both nodes point to the same data, which makes them equal
+		// without comparing. Copies share data until one of them is modified.
+		inline bool sharesData(const Node &other) const { return (data == other.data); }
+
+		// Structural hash, equal for nodes that compare equal. It is cached
+		// in the node until it is modified, so it is cheap to call repeatedly.
+		unsigned long long hash() const;
+
+		// Deep comparison. Object members are compared regardless of order,
+		// and numbers are compared by value (1.0 == 1).
 		bool operator==(const Node &other) const;
 		bool operator!=(const Node &other) const;
 		inline operator bool() const { return isValid(); }
 
 	private:
+		friend class Parser;
+		friend class Columns;
+		friend class Patch;
+		friend class Writer;
+
+		struct PackedNumbers
+		{
+			PackedNumbers() : isReal(false), elements(NULL) {}
+			PackedNumbers(const PackedNumbers &other) : isReal(other.isReal), integers(other.integers), reals(other.reals), elements(NULL) {}
+			~PackedNumbers();
+
+			bool isReal; // Integers are moved to reals when the first real is added
+			std::vector<long long> integers;
+			std::vector<double> reals;
+			Node *elements; // Made by at(index) and kept until the array changes
+
+		private:
+			PackedNumbers &operator=(const PackedNumbers &);
+		};
+
+		bool addPacked(const std::string &number);
+		void unpack() const;
+		static Node packedAt(const PackedNumbers &packed, size_t index);
+		static const Node *packedElements(PackedNumbers &packed);
+
+		static const size_t noChild = static_cast<size_t>(-1);
+		// Index of the first member with the name, trying the hint first
+		size_t findChild(const char *name, size_t length, size_t hint) const;
+		// The member at the index, or an invalid node for noChild
+		const Node &childAt(size_t index) const;
+		void removeChild(size_t index);
+
+		struct Visited;
+		void measure(MemoryUsage &usage, Visited &visited) const;
+		void shrink(Visited &visited) const;
+
+#ifdef JZON_PERSISTENT_CONTAINERS
+		// Copy-on-write list of children, laid out as a 32-way trie with a
+		// separate tail chunk. Copying only shares the chunks, and modifying
+		// an element copies the chunks on its path, so detaching a shared
+		// container costs O(log n) instead of O(n).
+		class JZON_API PersistentList
+		{
+		public:
+			PersistentList();
+			PersistentList(const PersistentList &other);
+			~PersistentList();
+
+			PersistentList &operator=(const PersistentList &rhs);
+
+			inline size_t size() const { return count; }
+			inline bool empty() const { return (count == 0); }
+			inline void reserve(size_t) {}
+
+			const NamedNode &operator[](size_t index) const;
+			NamedNode &operator[](size_t index);
+
+			void push_back(const NamedNode &value);
+			void pop_back();
+			void insert(size_t index, const NamedNode &value);
+			void erase(size_t index);
+			void clear();
+
+			// Adds the chunks not visited yet, with the members in them
+			void measure(MemoryUsage &usage, Visited &visited) const;
+
+		private:
+			struct Chunk;
+
+			size_t tailOffset() const;
+			Chunk *uniqueLeaf(size_t index);
+			Chunk *popLeaf(size_t offset);
+
+			// Swaps without copying the name or touching reference counts
+			static void swapItems(NamedNode &a, NamedNode &b);
+			static Chunk *unique(Chunk *&chunk);
+			static void release(Chunk *chunk);
+
+			Chunk *root;
+			Chunk *tail;
+			size_t count;
+			unsigned int shift;
+		};
+		typedef PersistentList NamedNodeList;
+#else
 		typedef std::vector<NamedNode> NamedNodeList;
+#endif
 		struct Data
 		{
 			explicit Data(Type type);
@@ -202,16 +474,26 @@ namespace Jzon
 			~Data();
 			void addRef();
 			bool release();
-			int refCount;
+			int refCount; // Negative for immortal data, which is never modified or freed
 
 			Type type;
 			std::string valueStr;
 			NamedNodeList children;
+			PackedNumbers *packed; // Replaces children when not NULL
+
+			bool hashValid;
+			unsigned long long hashValue;
 		} *data;
+
+		// Immortal data for null, true, false, 0 and "", or NULL for other values
+		static Data *sharedData(Type type, const std::string &value);
+
+		bool equalChildren(const Node &other) const;
 	};
 
 	JZON_API std::string escapeString(const std::string &value);
 	JZON_API std::string unescapeString(const std::string &value);
+	JZON_API bool isValidUtf8(const std::string &value);
 
 	JZON_API Node invalid();
 	JZON_API Node null();
@@ -228,6 +510,40 @@ namespace Jzon
 	const Format StandardFormat = { true, true, true, 1 };
 	const Format NoFormat = { false, false, false, 0 };
 
+#ifdef JZON_ENABLE_STATS
+	enum TracePhase
+	{
+		TRACE_PARSE,    // Whole Parser::parseStream call
+		TRACE_TOKENIZE, // Scanning and value interpretation
+		TRACE_ASSEMBLE, // Building the node tree
+		TRACE_WRITE     // Whole Writer::writeStream call
+	};
+	// Called at the beginning and end of each phase
+	typedef void (*TraceHook)(TracePhase phase, bool begin, void *userData);
+
+	struct JZON_API ParseStats
+	{
+		size_t bytes;
+		size_t nodes[Node::T_BOOL+1]; // Indexed by Node::Type
+		size_t maxDepth;
+		size_t stringBytes;
+		size_t escapes;
+		size_t allocations; // Node data blocks and strings too long to be stored inline
+		double scanSeconds;
+		double interpretSeconds;
+		double assembleSeconds;
+	};
+	struct JZON_API WriteStats
+	{
+		size_t bytes; // 0 if the stream can't report its position
+		size_t nodes[Node::T_BOOL+1]; // Indexed by Node::Type
+		size_t maxDepth;
+		size_t stringBytes;
+		size_t escapes;
+		double seconds;
+	};
+#endif
+
 	class JZON_API Writer
 	{
 	public:
@@ -240,11 +556,42 @@ namespace Jzon
 		void writeString(const Node &node, std::string &json) const;
 		void writeFile(const Node &node, const std::string &filename) const;
 
+		// Rewrites JSON text in this writer's format without building any nodes.
+		// The output is the same as parsing and then writing it, comments are
+		// dropped, but where the parser keeps the last of several outermost
+		// objects or arrays this fails. Returns false on invalid input, which
+		// leaves the output incomplete.
+		// reformatStream() reads the whole input into memory before it starts, so
+		// it needs as much memory as the input text, though still no nodes.
+		bool reformatBuffer(const char *json, size_t length, std::ostream &stream, std::string *error = NULL) const;
+		bool reformatString(const std::string &json, std::string &output, std::string *error = NULL) const;
+		bool reformatStream(std::istream &input, std::ostream &output, std::string *error = NULL) const;
+
+		// Writes large documents on several threads (0 picks one per core), with
+		// the same output as writeStream(). Big containers are split into chunks
+		// that are written separately and then joined in order. writeChunks()
+		// hands out the chunks instead, for example to pass them to writev().
+		// Without C++11 everything is written on the calling thread.
+		void writeStreamParallel(const Node &node, std::ostream &stream, unsigned int threads = 0) const;
+		void writeChunks(const Node &node, std::vector<std::string> &chunks, unsigned int threads = 0) const;
+
+#ifdef JZON_ENABLE_STATS
+		// Statistics for the last write
+		const WriteStats &getStats() const;
+		void setTraceHook(TraceHook hook, void *userData = NULL);
+#endif
+
 	private:
 		void writeNode(const Node &node, unsigned int level, std::ostream &stream) const;
 		void writeObject(const Node &node, unsigned int level, std::ostream &stream) const;
 		void writeArray(const Node &node, unsigned int level, std::ostream &stream) const;
 		void writeValue(const Node &node, std::ostream &stream) const;
+		void writeChildren(const Node &node, size_t begin, size_t end, unsigned int level, std::ostream &stream) const;
+		void writeChildPrefix(const std::string *name, bool first, const std::string &indentation, std::ostream &stream) const;
+
+		class Reformatter;
+		struct ChunkPlan;
+		void planChunks(const Node &node, unsigned int level, size_t target, ChunkPlan &plan) const;
 
 		std::string getIndentation(unsigned int level) const;
 
@@ -252,6 +599,273 @@ namespace Jzon
 		char indentationChar;
 		const char *newline;
 		const char *spacing;
+
+#ifdef JZON_ENABLE_STATS
+		mutable WriteStats stats;
+		TraceHook traceHook;
+		void *traceUserData;
+#endif
+	};
+
+	// Splits JSON into tokens one at a time, without building any nodes.
+	// This is what Parser uses to read its input, and it can be used
+	// directly to read documents that don't need to be kept as a tree.
+	class JZON_API Reader
+	{
+	public:
+		enum Token
+		{
+			T_UNKNOWN, // A word that isn't a valid value, see getValue()
+			T_OBJ_BEGIN,
+			T_OBJ_END,
+			T_ARRAY_BEGIN,
+			T_ARRAY_END,
+			T_SEPARATOR_NODE,
+			T_SEPARATOR_NAME,
+			T_VALUE, // See getType() and getValue()
+			T_END,
+			T_ERROR // See getError()
+		};
+
+		Reader(const char *json, size_t length);
+		~Reader();
+
+		// Reads the next token. T_END and T_ERROR are returned for every call after them.
+		Token next();
+		// Bytes read so far, up to at least the end of the last token
+		size_t getOffset() const;
+
+		// Type and text of the last T_VALUE. Strings are unescaped.
+		Node::Type getType() const;
+		const std::string &getValue() const;
+		std::string &getValue();
+
+		// Fails strings and names longer than this after unescaping, without
+		// reading the rest of them. 0 means no limit.
+		void setMaxStringLength(size_t length);
+
+		// Stops reading with an error, for users that find problems in the token stream
+		void setError(const std::string &message);
+		const std::string &getError() const;
+
+#ifdef JZON_ENABLE_STATS
+		// Only escapes, stringBytes and interpretSeconds are counted
+		const ParseStats &getStats() const;
+#endif
+
+	private:
+		Token finishWord();
+
+		void jumpToNext(char c);
+		void jumpToCommentEnd();
+
+		bool readString();
+		bool interpretValue();
+
+		const char *begin;
+		const char *it;
+		const char *end;
+
+		Token token;
+		Node::Type type;
+		std::string value;
+		std::string error;
+		size_t maxStringLength;
+
+#ifdef JZON_ENABLE_STATS
+		ParseStats stats;
+#endif
+	};
+
+	// Validates documents against a subset of JSON Schema: type (including
+	// "integer"), properties, required, additionalProperties (true or
+	// false), items (a single schema), enum (of scalars), minimum, maximum,
+	// exclusiveMinimum, exclusiveMaximum (as numbers), minLength, maxLength,
+	// minItems and maxItems. Other keywords are ignored. Errors contain the
+	// JSON Pointer of the first value that doesn't match.
+	class JZON_API Schema
+	{
+	public:
+		Schema();
+		~Schema();
+
+		bool compile(const Node &schema);
+		const std::string &getError() const;
+
+		bool validate(const Node &node, std::string *error = NULL) const;
+		// Validates without building a tree
+		bool validateBuffer(const char *json, size_t length, std::string *error = NULL) const;
+		bool validateString(const std::string &json, std::string *error = NULL) const;
+
+		// Checks a token stream as it is read, see Parser::setSchema()
+		class JZON_API Validator
+		{
+		public:
+			explicit Validator(const Schema &schema);
+			~Validator();
+
+			// Returns false at the first violation
+			bool token(Reader::Token token, Node::Type type, const std::string &value);
+			const std::string &getError() const;
+
+		private:
+			struct Frame
+			{
+				int rule;
+				int childRule; // Rule for the current member of an object
+				bool object;
+				bool expectingName;
+				size_t count;
+				std::string name;
+				std::vector<bool> required;
+			};
+
+			int nextRule();
+			bool beginContainer(Node::Type type);
+			bool endContainer();
+			bool readName(const std::string &name);
+			bool checkValue(int rule, Node::Type type, const std::string &value);
+			bool fail(const std::string &message, size_t depth);
+
+			const Schema &schema;
+			std::vector<Frame> frames;
+			std::string error;
+		};
+
+	private:
+		enum { INTEGER_BIT = (1 << (Node::T_BOOL+1)) };
+
+		struct Rule
+		{
+			Rule();
+
+			unsigned int types; // Bits for each Node::Type and INTEGER_BIT, 0 allows anything
+			bool hasMinimum, hasMaximum;
+			bool exclusiveMinimum, exclusiveMaximum;
+			double minimum, maximum;
+			size_t minLength, maxLength;
+			size_t minItems, maxItems;
+			std::vector<std::pair<std::string, int> > properties;
+			std::vector<std::string> required;
+			bool additionalProperties;
+			int items;
+			std::vector<std::pair<Node::Type, std::string> > enumValues;
+		};
+
+		int compileRule(const Node &schema, const std::string &path);
+
+		std::vector<Rule> rules;
+		std::string error;
+	};
+
+	class TapeDocument;
+
+	// Read-only view of a value in a TapeDocument. Views are small enough to
+	// pass by value, and stay valid as long as the document isn't modified.
+	class JZON_API TapeView
+	{
+	public:
+		class JZON_API const_iterator
+		{
+		public:
+			const_iterator() : document(NULL), index(0), object(false) {}
+			const_iterator(const TapeDocument *d, size_t i, bool o) : document(d), index(i), object(o) {}
+
+			const_iterator &operator++();
+			const_iterator operator++(int) { const_iterator tmp(*this); operator++(); return tmp; }
+
+			bool operator==(const const_iterator &rhs) const { return index == rhs.index; }
+			bool operator!=(const const_iterator &rhs) const { return index != rhs.index; }
+
+			// Empty for array elements
+			std::string getName() const;
+			TapeView operator*() const;
+
+		private:
+			const TapeDocument *document;
+			size_t index;
+			bool object;
+		};
+
+		TapeView();
+
+		Node::Type getType() const;
+
+		inline bool isValid()  const { return (getType() != Node::T_INVALID); }
+		inline bool isObject() const { return (getType() == Node::T_OBJECT);  }
+		inline bool isArray()  const { return (getType() == Node::T_ARRAY);   }
+		inline bool isNull()   const { return (getType() == Node::T_NULL);    }
+		inline bool isString() const { return (getType() == Node::T_STRING);  }
+		inline bool isNumber() const { return (getType() == Node::T_NUMBER);  }
+		inline bool isBool()   const { return (getType() == Node::T_BOOL);    }
+
+		std::string toString(const std::string &def = std::string()) const;
+		int toInt(int def = 0) const;
+		float toFloat(float def = 0.f) const;
+		double toDouble(double def = 0.0) const;
+		bool toBool(bool def = false) const;
+
+		// Containers know their size, and every value knows where it ends,
+		// so getCount() is O(1) and lookups step over whole subtrees at once.
+		// get(index) is still O(index).
+		size_t getCount() const;
+		bool has(const std::string &name) const;
+		TapeView get(const std::string &name) const;
+		TapeView get(size_t index) const;
+
+		const_iterator begin() const;
+		const_iterator end() const;
+
+		// Copies the value and everything below it into a mutable Node
+		Node toNode() const;
+
+	private:
+		friend class TapeDocument;
+
+		TapeView(const TapeDocument *document, size_t index);
+
+		const TapeDocument *document;
+		size_t index;
+	};
+
+	// Flat, read-only alternative to a Node tree, filled by Parser::parseTapeBuffer().
+	// Structure is kept in one array of 64-bit words and strings in one buffer,
+	// so a whole document takes two allocations and is read front to back.
+	class JZON_API TapeDocument
+	{
+	public:
+		TapeDocument();
+		~TapeDocument();
+
+		// Invalid if nothing was parsed
+		TapeView getRoot() const;
+		Node toNode() const;
+
+		void clear();
+
+	private:
+		friend class Parser;
+		friend class TapeView;
+		friend class TapeView::const_iterator;
+
+		std::vector<unsigned long long> tape;
+		std::string strings;
+	};
+
+	class FileIndex;
+
+	// Bounds on what Parser accepts, for input that can't be trusted. Parsing
+	// stops at the first token that goes over a limit, and files larger than
+	// maxBytes are not read at all. 0 means no limit.
+	struct JZON_API ParseLimits
+	{
+		ParseLimits();
+
+		size_t maxBytes;
+		size_t maxDepth;         // Levels of nested objects and arrays
+		size_t maxNodes;         // Values, objects and arrays, not counting names
+		size_t maxStringLength;  // Bytes in a string or name, after unescaping
+		size_t maxContainerSize; // Children of a single object or array
 	};
 
 	class JZON_API Parser
@@ -263,35 +877,528 @@ namespace Jzon
 		Node parseStream(std::istream &stream);
 		Node parseString(const std::string &json);
 		Node parseFile(const std::string &filename);
+		Node parseBuffer(const char *json, size_t length);
+
+		// Parses into a TapeDocument instead of a tree of nodes
+		bool parseTapeString(const std::string &json, TapeDocument &document);
+		bool parseTapeFile(const std::string &filename, TapeDocument &document);
+		bool parseTapeBuffer(const char *json, size_t length, TapeDocument &document);
+
+		// Parses a single element of the outermost array, or member of the
+		// outermost object, of a file indexed by FileIndex. Only the pages
+		// holding the element are mapped and read.
+		Node parseIndexed(const std::string &filename, const FileIndex &index, size_t element);
+		Node parseIndexed(const std::string &filename, const FileIndex &index, const std::string &name);
 
 		const std::string &getError() const;
 
+		// Validate documents while they are read, failing at the first violation.
+		// The schema must outlive the parser, NULL turns validation off.
+		void setSchema(const Schema *schema);
+		void setLimits(const ParseLimits &limits);
+
+		// Null, booleans, 0 and "" always share immortal data. With interning on,
+		// strings and numbers of up to 32 bytes that repeat within a document
+		// share data too, which saves memory on documents full of repeated values.
+		void setInternValues(bool intern);
+
+#ifdef JZON_ENABLE_STATS
+		// Statistics for the last parse
+		const ParseStats &getStats() const;
+		void setTraceHook(TraceHook hook, void *userData = NULL);
+#endif
+
 	private:
-		enum Token
-		{
-			T_UNKNOWN,
-			T_OBJ_BEGIN,
-			T_OBJ_END,
-			T_ARRAY_BEGIN,
-			T_ARRAY_END,
-			T_SEPARATOR_NODE,
-			T_SEPARATOR_NAME,
-			T_VALUE
-		};
-		typedef std::queue<Token> TokenQueue;
+		typedef std::queue<Reader::Token> TokenQueue;
 		typedef std::queue<std::pair<Node::Type, std::string> > DataQueue;
 
-		void tokenize(std::istream &stream, TokenQueue &tokens, DataQueue &data);
+		bool tokenize(const char *it, const char *end, TokenQueue &tokens, DataQueue &data);
+		// Like parseBuffer(), but also takes a single value outside of an object or array
+		Node parseElement(const char *json, size_t length);
 		Node assemble(TokenQueue &tokens, DataQueue &data);
+		class NodeBuilder;
+
+		std::string error;
+		const Schema *schema;
+		ParseLimits limits;
+		bool internValues;
+
+#ifdef JZON_ENABLE_STATS
+		ParseStats stats;
+		TraceHook traceHook;
+		void *traceUserData;
+#endif
+	};
+
+	struct ParsedFile
+	{
+		Node node;
+		std::string error; // Parser::getError() for this file, empty on success
+	};
+
+	// Reads and parses many files at once. Files are spread over the given number
+	// of threads (0 picks one per core) which steal work from each other when they
+	// run out. Results are in the same order as the paths. Without C++11 the files
+	// are parsed one after another.
+	JZON_API std::vector<ParsedFile> parseFiles(const std::vector<std::string> &paths, unsigned int threads = 0, const Schema *schema = NULL);
+
+	// Parses each file once, and returns the same node again for as long as the
+	// file is unchanged, judged by its device, inode, modification time and size.
+	// The nodes share data with the cache, so they should only be read, or
+	// detached before being modified. Like Node, a cache must only be used from
+	// one thread at a time.
+	class JZON_API FileCache
+	{
+	public:
+		struct Stats
+		{
+			Stats() : hits(0), misses(0), changes(0), checks(0) {}
+
+			size_t hits; // Returned a cached node
+			size_t misses; // Read and parsed the file
+			size_t changes; // Misses for files that were cached, but had changed
+			size_t checks; // Times a file was looked at with stat()
+		};
+
+		FileCache();
+		~FileCache();
+
+		// Watches the directories of cached files, and of the files their paths
+		// resolve to, with inotify, so that files are only looked at again after
+		// something in those directories changed. Watches no cached file needs
+		// any more are removed.
+		// Returns false where inotify isn't available, the cache then keeps
+		// checking every file on every call.
+		bool enableWatching();
+
+		// Validates files when they are parsed, see Parser::setSchema()
+		void setSchema(const Schema *schema);
+
+		// The cached node, or the file parsed again if it changed. Files that
+		// fail to parse return an invalid node and aren't cached.
+		Node parseFile(const std::string &path);
+		const std::string &getError() const;
+
+		void remove(const std::string &path);
+		void clear();
+
+		const Stats &getStats() const;
+
+	private:
+		struct Key
+		{
+			bool operator==(const Key &other) const;
+
+			unsigned long long device;
+			unsigned long long inode;
+			unsigned long long size;
+			long long modifiedSeconds;
+			long long modifiedNanoseconds;
+		};
+		struct Entry
+		{
+			Node node;
+			Key key;
+			int watch; // Watch of the directory, or -1
+			int targetWatch; // Watch of the directory the path resolves to, or -1
+			bool current; // Nothing changed in either directory since the key was read
+		};
 
-		void jumpToNext(char c, std::istream &stream);
-		void jumpToCommentEnd(std::istream &stream);
+		static bool readKey(const std::string &path, Key &key);
+		bool watchDirectories(const std::string &path, int &watch, int &targetWatch);
+		void removeUnusedWatches();
+		void readEvents();
 
-		void readString(std::istream &stream, DataQueue &data);
-		bool interpretValue(const std::string &value, DataQueue &data);
+		Parser parser;
+		std::map<std::string, Entry> entries;
+		int watchFd;
+		std::vector<int> watches; // Every watch added and not removed yet
+		Stats stats;
+		std::string error;
+	};
+
+	// Byte offsets of each element of the outermost array, or member of the
+	// outermost object, of a file that doesn't change. It is built by reading
+	// the file once, and saved next to it so that Parser::parseIndexed() can
+	// read single elements of large files without parsing all of them.
+	class JZON_API FileIndex
+	{
+	public:
+		FileIndex();
+		~FileIndex();
+
+		bool build(const std::string &filename);
+		bool save(const std::string &filename) const;
+		bool load(const std::string &filename);
+		const std::string &getError() const;
+
+		// T_ARRAY or T_OBJECT once built or loaded, T_INVALID before
+		Node::Type getType() const;
+		size_t getCount() const;
+		// Size of the indexed file, which is checked before reading from it
+		unsigned long long getFileSize() const;
+
+		// Member names of an indexed object, in file order
+		const std::string &getName(size_t element) const;
+		// Element of the first member with the name, or getCount() if there is none
+		size_t find(const std::string &name) const;
+
+	private:
+		friend class Parser;
+
+		struct Entry
+		{
+			unsigned long long begin; // First byte after '[', ',' or ':'
+			unsigned long long end;   // The following ',', ']' or '}'
+			std::string name;
+		};
+
+		struct NameOrder;
+
+		bool fail(const std::string &message);
+		void sortNames();
+
+		Node::Type type;
+		unsigned long long fileSize;
+		std::vector<Entry> entries;
+		std::vector<size_t> byName; // Entries sorted by name
+		std::string error;
+	};
 
+	// Pulls fields out of an array of records into one typed vector per field:
+	//
+	//   Jzon::Columns columns;
+	//   columns.addColumn("/id", Jzon::Node::T_NUMBER);
+	//   columns.addColumn("/user/name", Jzon::Node::T_STRING);
+	//   columns.extractString("[{\"id\": 1, \"user\": {\"name\": \"a\"}}]");
+	//
+	// Members are looked for where they were found in the previous record
+	// first, so records that share a key order are read without searching.
+	class JZON_API Columns
+	{
+	public:
+		struct Column
+		{
+			std::string path;
+			Node::Type type;
+			// Only the vector for the type is filled, with one value per row
+			std::vector<double> numbers;
+			std::vector<std::string> strings;
+			std::vector<bool> bools;
+			// True where the row has no value of the right type, the value is then 0, "" or false
+			std::vector<bool> nulls;
+		};
+
+		Columns();
+		~Columns();
+
+		// Paths are JSON Pointers from each record, type is T_NUMBER, T_STRING or T_BOOL.
+		// Returns the index of the column.
+		size_t addColumn(const std::string &path, Node::Type type);
+
+		// Appends a row for each element of the array
+		bool extract(const Node &rows);
+		// Reads the rows straight from JSON text, without building any nodes.
+		// Invalid text, including anything after the array, adds no rows.
+		bool extractBuffer(const char *json, size_t length);
+		bool extractString(const std::string &json);
+		// Removes all rows but keeps the columns
+		void clearRows();
+
+		size_t getRowCount() const;
+		size_t getColumnCount() const;
+		const Column &getColumn(size_t index) const;
+		const std::string &getError() const;
+
+	private:
+		struct Field
+		{
+			std::string name;
+			int column; // -1 when only a parent of other fields
+			std::vector<size_t> children;
+			// Names of the members in the previous record and the field for each, or -1
+			std::vector<std::pair<std::string, int> > layout;
+		};
+
+		size_t findField(size_t parent, const std::string &name);
+		int matchMember(size_t parent, size_t position, const std::string &name);
+		void extractNode(const Node &node, int field);
+		bool readValue(Reader &reader, Reader::Token token, int field);
+		bool skipValue(Reader &reader, Reader::Token token);
+		void setValue(size_t column, Node::Type type, const std::string &value);
+		void finishRow();
+		// Drops the rows from count on, including a partly read one
+		void truncateRows(size_t count);
+
+		std::vector<Field> fields;
+		std::vector<Column> columns;
+		size_t rows;
 		std::string error;
 	};
+
+	// Builds a JSON Patch (RFC 6902) that turns a into b. Subtrees that share
+	// data, like the untouched parts of a modified copy, are skipped without
+	// looking inside them. Object members are matched by name and array
+	// elements by hash, so the patch grows with the change rather than with
+	// the document.
+	JZON_API Node diff(const Node &a, const Node &b);
+	// Applies every operation of a patch to the node, or none of them if one fails
+	JZON_API bool applyPatch(Node &node, const Node &patch, std::string *error = NULL);
+
+	// Finds the value at a JSON Pointer in JSON text without parsing it. The
+	// values before it are skipped by matching brackets and quotes, so the
+	// time grows with the position of the value rather than the document.
+	// begin and end are the offsets of its first byte and the byte after it.
+	JZON_API bool locate(const char *json, size_t length, const std::string &pointer, size_t &begin, size_t &end, std::string *error = NULL);
+	// Replaces the value at a JSON Pointer with another value, written without
+	// formatting. The rest of the text, comments included, stays as it was.
+	JZON_API bool splice(std::string &json, const std::string &pointer, const Node &value, std::string *error = NULL);
+	// Like splice(), but keeps the length of the text by padding the new value
+	// with spaces, so it also works on buffers that can't grow, like mapped
+	// files. Spaces after the old value count as room, so values can be padded
+	// when they are first written to leave room for later edits. Fails if the
+	// new value doesn't fit.
+	JZON_API bool spliceInPlace(char *json, size_t length, const std::string &pointer, const Node &value, std::string *error = NULL);
+
+	// Describes the fields of a struct, so that it can be decoded from and
+	// encoded to JSON directly, without any nodes in between:
+	//
+	//   struct Point { int x; int y; std::vector<std::string> tags; };
+	//
+	//   JZON_FIELDS_BEGIN(Point)
+	//     JZON_FIELD(x)
+	//     JZON_FIELD(y)
+	//     JZON_FIELD_NAMED("labels", tags)
+	//   JZON_FIELDS_END()
+	//
+	//   Point point;
+	//   if (Jzon::decode(json, point, &error)) ...
+	//   Jzon::encode(point, stream);
+	//
+	// The macros must be used in the global namespace. Fields can be bools,
+	// numbers, std::strings, other described structs and std::vectors of
+	// them. Unknown names are skipped, and null leaves a field unchanged.
+	template <typename T> struct Fields;
+
+	namespace Detail
+	{
+		JZON_API bool fail(Reader &reader, Reader::Token token, const char *message);
+		JZON_API bool skip(Reader &reader, Reader::Token token);
+		JZON_API bool finish(Reader &reader);
+
+		JZON_API bool read(Reader &reader, Reader::Token token, bool &value);
+		JZON_API bool read(Reader &reader, Reader::Token token, int &value);
+		JZON_API bool read(Reader &reader, Reader::Token token, unsigned int &value);
+		JZON_API bool read(Reader &reader, Reader::Token token, long &value);
+		JZON_API bool read(Reader &reader, Reader::Token token, unsigned long &value);
+		JZON_API bool read(Reader &reader, Reader::Token token, long long &value);
+		JZON_API bool read(Reader &reader, Reader::Token token, unsigned long long &value);
+		JZON_API bool read(Reader &reader, Reader::Token token, float &value);
+		JZON_API bool read(Reader &reader, Reader::Token token, double &value);
+		JZON_API bool read(Reader &reader, Reader::Token token, std::string &value);
+		template <typename T> bool read(Reader &reader, Reader::Token token, std::vector<T> &value);
+		template <typename T> bool read(Reader &reader, Reader::Token token, T &object);
+
+		JZON_API void write(std::ostream &stream, bool value);
+		JZON_API void write(std::ostream &stream, int value);
+		JZON_API void write(std::ostream &stream, unsigned int value);
+		JZON_API void write(std::ostream &stream, long value);
+		JZON_API void write(std::ostream &stream, unsigned long value);
+		JZON_API void write(std::ostream &stream, long long value);
+		JZON_API void write(std::ostream &stream, unsigned long long value);
+		JZON_API void write(std::ostream &stream, float value);
+		JZON_API void write(std::ostream &stream, double value);
+		JZON_API void write(std::ostream &stream, const std::string &value);
+		// Writes a field name, escaped and in quotes, and the : after it
+		JZON_API void writeName(std::ostream &stream, const char *name, size_t length);
+		template <typename T> void write(std::ostream &stream, const std::vector<T> &value);
+		template <typename T> void write(std::ostream &stream, const T &object);
+
+		// Reads the value of the field with the name the reader is at
+		class FieldReader
+		{
+		public:
+			explicit FieldReader(Reader &reader) : reader(reader), found(false), success(true) {}
+
+			// The length of the name is known at compile time, so most
+			// names are rejected without looking at the characters
+			template <size_t N, typename T>
+			bool operator()(const char (&name)[N], T &field)
+			{
+				const std::string &key = reader.getValue();
+				if (key.size() != N-1 || key.compare(0, N-1, name) != 0)
+					return true;
+
+				found = true;
+				Reader::Token token = reader.next();
+				if (token != Reader::T_SEPARATOR_NAME)
+					success = fail(reader, token, "Expected : after name");
+				else
+					success = read(reader, reader.next(), field);
+				return false;
+			}
+
+			Reader &reader;
+			bool found;
+			bool success;
+		};
+		class FieldWriter
+		{
+		public:
+			explicit FieldWriter(std::ostream &stream) : stream(stream), first(true) {}
+
+			template <size_t N, typename T>
+			bool operator()(const char (&name)[N], const T &field)
+			{
+				if (!first)
+					stream << ",";
+				first = false;
+				writeName(stream, name, N-1);
+				write(stream, field);
+				return true;
+			}
+
+			std::ostream &stream;
+			bool first;
+		};
+
+		template <typename T>
+		bool read(Reader &reader, Reader::Token token, std::vector<T> &value)
+		{
+			if (token == Reader::T_VALUE && reader.getType() == Node::T_NULL)
+				return true;
+			if (token != Reader::T_ARRAY_BEGIN)
+				return fail(reader, token, "Expected an array");
+
+			value.clear();
+			token = reader.next();
+			if (token == Reader::T_ARRAY_END)
+				return true;
+			for (;;)
+			{
+				value.push_back(T());
+				if (!read(reader, token, value.back()))
+					return false;
+
+				token = reader.next();
+				if (token == Reader::T_ARRAY_END)
+					return true;
+				if (token != Reader::T_SEPARATOR_NODE)
+					return fail(reader, token, "Expected , or ] in array");
+				token = reader.next();
+			}
+		}
+		template <typename T>
+		bool read(Reader &reader, Reader::Token token, T &object)
+		{
+			if (token == Reader::T_VALUE && reader.getType() == Node::T_NULL)
+				return true;
+			if (token != Reader::T_OBJ_BEGIN)
+				return fail(reader, token, "Expected an object");
+
+			token = reader.next();
+			if (token == Reader::T_OBJ_END)
+				return true;
+			for (;;)
+			{
+				if (token != Reader::T_VALUE || reader.getType() != Node::T_STRING)
+					return fail(reader, token, "Expected a name");
+
+				FieldReader fields(reader);
+				Fields<T>::visit(fields, object);
+				if (!fields.found)
+				{
+					token = reader.next();
+					if (token != Reader::T_SEPARATOR_NAME)
+						return fail(reader, token, "Expected : after name");
+					if (!skip(reader, reader.next()))
+						return false;
+				}
+				else if (!fields.success)
+				{
+					return false;
+				}
+
+				token = reader.next();
+				if (token == Reader::T_OBJ_END)
+					return true;
+				if (token != Reader::T_SEPARATOR_NODE)
+					return fail(reader, token, "Expected , or } in object");
+				token = reader.next();
+			}
+		}
+
+		template <typename T>
+		void write(std::ostream &stream, const std::vector<T> &value)
+		{
+			stream << "[";
+			for (typename std::vector<T>::const_iterator it = value.begin(); it != value.end(); ++it)
+			{
+				if (it != value.begin())
+					stream << ",";
+				write(stream, *it);
+			}
+			stream << "]";
+		}
+		template <typename T>
+		void write(std::ostream &stream, const T &object)
+		{
+			stream << "{";
+			FieldWriter fields(stream);
+			Fields<T>::visit(fields, object);
+			stream << "}";
+		}
+	}
+
+	template <typename T>
+	bool decode(const char *json, size_t length, T &value, std::string *error = NULL)
+	{
+		Reader reader(json, length);
+		if (Detail::read(reader, reader.next(), value) && Detail::finish(reader))
+		{
+			return true;
+		}
+		if (error != NULL)
+		{
+			*error = reader.getError();
+		}
+		return false;
+	}
+	template <typename T>
+	bool decode(const std::string &json, T &value, std::string *error = NULL)
+	{
+		return decode(json.data(), json.size(), value, error);
+	}
+
+	template <typename T>
+	void encode(const T &value, std::ostream &stream)
+	{
+		Detail::write(stream, value);
+	}
+	template <typename T>
+	void encode(const T &value, std::string &json)
+	{
+		std::ostringstream stream;
+		Detail::write(stream, value);
+		json = stream.str();
+	}
 }
 
+#define JZON_FIELDS_BEGIN(T) \
+	namespace Jzon \
+	{ \
+		template <> struct Fields<T> \
+		{ \
+			template <typename Visitor, typename Object> \
+			static bool visit(Visitor &visitor, Object &object) \
+			{ \
+				return true
+#define JZON_FIELD_NAMED(name, member) && visitor(name, object.member)
+#define JZON_FIELD(member) JZON_FIELD_NAMED(#member, member)
+#define JZON_FIELDS_END() \
+				; \
+			} \
+		}; \
+	}
+
 #endif // Jzon_h__
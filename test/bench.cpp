@@ -0,0 +1,809 @@
+#include "../Jzon.h"
+
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+// Count every allocation made while the benchmark runs
+namespace
+{
+	unsigned long long allocationCount = 0;
+}
+void *operator new(std::size_t size)
+{
+	++allocationCount;
+	void *p = std::malloc(size == 0 ? 1 : size);
+	if (p == NULL)
+		throw std::bad_alloc();
+	return p;
+}
+void *operator new[](std::size_t size)
+{
+	return operator new(size);
+}
+void operator delete(void *p) throw()
+{
+	std::free(p);
+}
+void operator delete[](void *p) throw()
+{
+	std::free(p);
+}
+void operator delete(void *p, std::size_t) throw()
+{
+	std::free(p);
+}
+void operator delete[](void *p, std::size_t) throw()
+{
+	std::free(p);
+}
+
+namespace
+{
+	const double minSeconds = 0.5;
+	const int minIterations = 3;
+	const size_t targetSize = 2 * 1024 * 1024;
+
+	double now()
+	{
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec + ts.tv_nsec * 1e-9;
+	}
+	// Peak of the whole process so far, which is why each case runs in its own
+	long peakRssKb()
+	{
+		rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		return usage.ru_maxrss;
+	}
+
+	// Deterministic generator so that runs are comparable
+	const unsigned int initialSeed = 12345;
+	unsigned int seed = initialSeed;
+	unsigned int nextRandom()
+	{
+		seed = seed * 1103515245 + 12345;
+		return (seed >> 16) & 0x7fff;
+	}
+	std::string randomWord(size_t length)
+	{
+		std::string word;
+		for (size_t i = 0; i < length; ++i)
+			word += static_cast<char>('a' + nextRandom() % 26);
+		return word;
+	}
+
+	std::string generateNumbers()
+	{
+		std::ostringstream json;
+		json << "[";
+		for (size_t i = 0; json.tellp() < static_cast<std::streamoff>(targetSize); ++i)
+		{
+			if (i > 0)
+				json << ",";
+			switch (i % 3)
+			{
+			case 0: json << nextRandom() * 1000 + nextRandom(); break;
+			case 1: json << "-" << nextRandom() << "." << nextRandom(); break;
+			case 2: json << nextRandom() << "." << nextRandom() << "e-" << nextRandom() % 20; break;
+			}
+		}
+		json << "]";
+		return json.str();
+	}
+	std::string generateStrings()
+	{
+		std::ostringstream json;
+		json << "[";
+		for (size_t i = 0; json.tellp() < static_cast<std::streamoff>(targetSize); ++i)
+		{
+			if (i > 0)
+				json << ",";
+			json << "\"" << randomWord(4 + nextRandom() % 40);
+			if (i % 8 == 0)
+				json << "\\n\\\"" << randomWord(8) << "\\\"";
+			json << "\"";
+		}
+		json << "]";
+		return json.str();
+	}
+	std::string generateNested()
+	{
+		const int depth = 200;
+		std::ostringstream json;
+		json << "[";
+		for (size_t i = 0; json.tellp() < static_cast<std::streamoff>(targetSize); ++i)
+		{
+			if (i > 0)
+				json << ",";
+			for (int d = 0; d < depth; ++d)
+				json << "{\"" << randomWord(3) << "\":[" << d << ",";
+			json << "null";
+			for (int d = 0; d < depth; ++d)
+				json << "]}";
+		}
+		json << "]";
+		return json.str();
+	}
+	std::string generateWideObject()
+	{
+		std::ostringstream json;
+		json << "{";
+		for (size_t i = 0; json.tellp() < static_cast<std::streamoff>(targetSize); ++i)
+		{
+			if (i > 0)
+				json << ",";
+			json << "\"" << randomWord(6) << i << "\":";
+			switch (i % 4)
+			{
+			case 0: json << nextRandom(); break;
+			case 1: json << "\"" << randomWord(10) << "\""; break;
+			case 2: json << (nextRandom() % 2 == 0 ? "true" : "false"); break;
+			case 3: json << "null"; break;
+			}
+		}
+		json << "}";
+		return json.str();
+	}
+	std::string generateRecords()
+	{
+		std::ostringstream json;
+		json << "[";
+		for (size_t i = 0; json.tellp() < static_cast<std::streamoff>(targetSize); ++i)
+		{
+			if (i > 0)
+				json << ",";
+			json << "{\"id\":" << i
+			     << ",\"name\":\"" << randomWord(8) << "\""
+			     << ",\"score\":" << nextRandom() << "." << nextRandom() % 100
+			     << ",\"active\":" << (nextRandom() % 2 == 0 ? "true" : "false")
+			     << ",\"tags\":[\"" << randomWord(4) << "\",\"" << randomWord(5) << "\"]}";
+		}
+		json << "]";
+		return json.str();
+	}
+
+	size_t countNodes(const Jzon::Node &node)
+	{
+		size_t count = 1;
+		for (Jzon::Node::const_iterator it = node.begin(); it != node.end(); ++it)
+		{
+			count += countNodes((*it).second);
+		}
+		return count;
+	}
+
+	struct Result
+	{
+		std::string name;
+		size_t bytes;
+		size_t nodes;
+		int parseIterations;
+		double parseSeconds;
+		unsigned long long parseAllocations;
+		int writeIterations;
+		double writeSeconds;
+		unsigned long long writeAllocations;
+		long peakRss;
+	};
+
+	bool run(const std::string &name, const std::string &json, Result &result)
+	{
+		Jzon::Parser parser;
+		Jzon::Writer writer;
+
+		result.name = name;
+		result.bytes = json.size();
+
+		Jzon::Node node;
+		double start = now();
+		int iterations = 0;
+		do
+		{
+			node = parser.parseString(json);
+			if (!node.isValid())
+			{
+				std::cerr << name << ": " << parser.getError() << std::endl;
+				return false;
+			}
+			++iterations;
+		} while (iterations < minIterations || now() - start < minSeconds);
+		result.parseSeconds = (now() - start) / iterations;
+		result.parseIterations = iterations;
+		result.nodes = countNodes(node);
+
+		// Counted on one more run rather than averaged over the timed ones,
+		// whose number varies, so that the count is the same every time
+		unsigned long long allocations = allocationCount;
+		node = parser.parseString(json);
+		result.parseAllocations = allocationCount - allocations;
+
+		std::string output;
+		start = now();
+		iterations = 0;
+		do
+		{
+			output.clear();
+			writer.writeString(node, output);
+			++iterations;
+		} while (iterations < minIterations || now() - start < minSeconds);
+		result.writeSeconds = (now() - start) / iterations;
+		result.writeIterations = iterations;
+
+		allocations = allocationCount;
+		output.clear();
+		writer.writeString(node, output);
+		result.writeAllocations = allocationCount - allocations;
+
+		result.peakRss = peakRssKb();
+		return true;
+	}
+
+	// Runs the case in a child process, so that the peak RSS is that case's
+	// alone and not the largest of every case run before it
+	bool runIsolated(const std::string &name, const std::string &json, Result &result)
+	{
+		int fds[2];
+		if (pipe(fds) != 0)
+			return run(name, json, result);
+		const pid_t pid = fork();
+		if (pid < 0)
+		{
+			close(fds[0]);
+			close(fds[1]);
+			return run(name, json, result);
+		}
+		if (pid == 0)
+		{
+			close(fds[0]);
+			if (!run(name, json, result))
+				_exit(1);
+			Jzon::Node fields = Jzon::object();
+			fields.add("bytes", static_cast<unsigned long long>(result.bytes));
+			fields.add("nodes", static_cast<unsigned long long>(result.nodes));
+			fields.add("parseIterations", result.parseIterations);
+			fields.add("parseSeconds", result.parseSeconds);
+			fields.add("parseAllocations", result.parseAllocations);
+			fields.add("writeIterations", result.writeIterations);
+			fields.add("writeSeconds", result.writeSeconds);
+			fields.add("writeAllocations", result.writeAllocations);
+			fields.add("peakRss", static_cast<long long>(result.peakRss));
+			std::string text;
+			Jzon::Writer().writeString(fields, text);
+			for (size_t written = 0; written < text.size();)
+			{
+				const ssize_t count = write(fds[1], text.data() + written, text.size() - written);
+				if (count <= 0)
+					_exit(1);
+				written += static_cast<size_t>(count);
+			}
+			_exit(0);
+		}
+
+		close(fds[1]);
+		std::string text;
+		char buffer[4096];
+		ssize_t count;
+		while ((count = read(fds[0], buffer, sizeof(buffer))) > 0)
+			text.append(buffer, static_cast<size_t>(count));
+		close(fds[0]);
+		int status = 0;
+		waitpid(pid, &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			return false;
+
+		Jzon::Parser parser;
+		const Jzon::Node fields = parser.parseString(text);
+		result.name = name;
+		result.bytes = static_cast<size_t>(fields.get("bytes").toInt());
+		result.nodes = static_cast<size_t>(fields.get("nodes").toInt());
+		result.parseIterations = fields.get("parseIterations").toInt();
+		result.parseSeconds = fields.get("parseSeconds").toDouble();
+		result.parseAllocations = static_cast<unsigned long long>(fields.get("parseAllocations").toInt());
+		result.writeIterations = fields.get("writeIterations").toInt();
+		result.writeSeconds = fields.get("writeSeconds").toDouble();
+		result.writeAllocations = static_cast<unsigned long long>(fields.get("writeAllocations").toInt());
+		result.peakRss = static_cast<long>(fields.get("peakRss").toInt());
+		return fields.isObject();
+	}
+
+	// Micro benchmarks of single Node operations on containers of a given size
+	const double minMicroSeconds = 0.02;
+	const int microRepeats = 5;
+	const size_t microSizes[] = { 1, 16, 256, 4096, 65536, 1048576 };
+
+	struct Fixture
+	{
+		size_t size;
+		std::vector<std::string> names;
+		Jzon::Node object;
+		Jzon::Node array;
+		Jzon::Node number;
+		Jzon::Node scratch;
+		Jzon::Node scratchArray;
+		Jzon::Node building;
+		std::vector<Jzon::Key> keys;
+	};
+
+	void setupFixture(Fixture &fixture, size_t size)
+	{
+		fixture.size = size;
+		fixture.names.clear();
+		fixture.object = Jzon::object();
+		fixture.array = Jzon::array();
+		for (size_t i = 0; i < size; ++i)
+		{
+			std::ostringstream name;
+			name << "key" << i;
+			fixture.names.push_back(name.str());
+			fixture.object.add(name.str(), static_cast<int>(i));
+			fixture.array.add(static_cast<int>(i));
+		}
+		fixture.number = Jzon::Node(12345);
+		fixture.scratch = fixture.object;
+		fixture.scratch.detach();
+		fixture.scratchArray = fixture.array;
+		fixture.scratchArray.detach();
+		fixture.building = Jzon::Node();
+		fixture.keys.clear();
+		fixture.keys.push_back(Jzon::Key(fixture.names[size / 2]));
+	}
+
+	// Lookups by name use the middle member, so the cost doesn't depend on the iteration count
+	size_t opGetName(Fixture &f, size_t) { return f.object.get(f.names[f.size / 2]).isValid(); }
+	size_t opGetKey(Fixture &f, size_t) { return f.object.get(f.keys[0]).isValid(); }
+	size_t opHasMissing(Fixture &f, size_t) { return f.object.has("missing"); }
+	size_t opGetIndex(Fixture &f, size_t i) { return f.array.get(i % f.size).isValid(); }
+	size_t opAtName(Fixture &f, size_t) { return f.object.at(f.names[f.size / 2]).isValid(); }
+	size_t opAtIndex(Fixture &f, size_t i) { return f.array.at(i % f.size).isValid(); }
+	size_t opToInt(Fixture &f, size_t) { return static_cast<size_t>(f.number.toInt()); }
+	size_t opIterate(Fixture &f, size_t)
+	{
+		const Jzon::Node &array = f.array;
+		size_t count = 0;
+		for (Jzon::Node::const_iterator it = array.begin(); it != array.end(); ++it)
+			count += (*it).second.isNumber();
+		return count;
+	}
+	size_t opAdd(Fixture &f, size_t i)
+	{
+		if (!f.building.isArray() || f.building.getCount() >= f.size)
+			f.building = Jzon::array();
+		f.building.add(static_cast<int>(i));
+		return f.building.getCount();
+	}
+	size_t opAddName(Fixture &f, size_t i)
+	{
+		if (!f.building.isObject() || f.building.getCount() >= f.size)
+			f.building = Jzon::object();
+		f.building.add(f.names[f.building.getCount()], static_cast<int>(i));
+		return f.building.getCount();
+	}
+	size_t opRemoveName(Fixture &f, size_t i)
+	{
+		// Removes a member and adds it back, so the object keeps its size
+		const std::string &name = f.names[f.size / 2];
+		f.scratch.remove(name);
+		f.scratch.add(name, static_cast<int>(i));
+		return f.scratch.getCount();
+	}
+	size_t opRemoveIndex(Fixture &f, size_t i)
+	{
+		// Removes from the middle and adds to the end, which moves half the elements
+		f.scratchArray.remove(f.size / 2);
+		f.scratchArray.add(static_cast<int>(i));
+		return f.scratchArray.getCount();
+	}
+
+	// Fixed workload independent of Jzon, used to factor out the speed of the machine
+	size_t opCalibrate(Fixture &, size_t i)
+	{
+		std::vector<std::string> strings;
+		for (size_t n = 0; n < 64; ++n)
+		{
+			std::ostringstream str;
+			str << "calibration" << ((n + i) * 2654435761u) % 1000;
+			strings.push_back(str.str());
+		}
+		std::sort(strings.begin(), strings.end());
+		return strings.front().size();
+	}
+
+	struct MicroCase
+	{
+		const char *name;
+		size_t (*run)(Fixture &fixture, size_t i);
+		bool sized; // Otherwise only run once, as the size doesn't matter
+	};
+
+	struct MicroResult
+	{
+		std::string name;
+		size_t size;
+		double nsPerOp;
+		double allocationsPerOp;
+	};
+
+	size_t microSink = 0;
+
+	void runMicro(const MicroCase &micro, Fixture &fixture, MicroResult &result)
+	{
+		result.name = micro.name;
+		result.size = fixture.size;
+		result.nsPerOp = 0.0;
+		result.allocationsPerOp = 0.0;
+
+		size_t iterations = 1;
+		for (int repeat = 0; repeat < microRepeats; ++repeat)
+		{
+			double seconds = 0.0;
+			unsigned long long allocations = 0;
+			for (;;)
+			{
+				const unsigned long long allocationsBefore = allocationCount;
+				const double start = now();
+				for (size_t i = 0; i < iterations; ++i)
+					microSink += micro.run(fixture, i);
+				seconds = now() - start;
+				allocations = allocationCount - allocationsBefore;
+				if (seconds >= minMicroSeconds)
+					break;
+				iterations *= 2;
+			}
+
+			// Best of the repeats, to keep noise out of the comparison
+			const double nsPerOp = seconds * 1e9 / iterations;
+			if (repeat == 0 || nsPerOp < result.nsPerOp)
+				result.nsPerOp = nsPerOp;
+			result.allocationsPerOp = static_cast<double>(allocations) / iterations;
+		}
+	}
+
+	struct Case
+	{
+		const char *name;
+		std::string (*generate)();
+	};
+	const Case cases[] = {
+		{ "numbers", &generateNumbers },
+		{ "strings", &generateStrings },
+		{ "nested", &generateNested },
+		{ "wide_object", &generateWideObject },
+		{ "records", &generateRecords }
+	};
+	const size_t numCases = sizeof(cases) / sizeof(cases[0]);
+
+	const MicroCase microCases[] = {
+		{ "get_name", &opGetName, true },
+		{ "get_key", &opGetKey, true },
+		{ "has_missing", &opHasMissing, true },
+		{ "get_index", &opGetIndex, true },
+		{ "at_name", &opAtName, true },
+		{ "at_index", &opAtIndex, true },
+		{ "to_int", &opToInt, false },
+		{ "iterate", &opIterate, true },
+		{ "add", &opAdd, true },
+		{ "add_name", &opAddName, true },
+		{ "remove_name", &opRemoveName, true },
+		{ "remove_index", &opRemoveIndex, true }
+	};
+	const size_t numMicroCases = sizeof(microCases) / sizeof(microCases[0]);
+	const size_t numSizes = sizeof(microSizes) / sizeof(microSizes[0]);
+
+	// A case runs if it's in the list of cases to retry, or otherwise matches the filter
+	bool isSelected(const std::string &name, const std::string &group, const std::string &filter, const std::vector<std::string> &only)
+	{
+		if (!only.empty())
+			return (std::find(only.begin(), only.end(), name) != only.end());
+		return (filter.empty() || filter == group);
+	}
+
+	bool runMacroSuite(const std::string &filter, const std::vector<std::string> &only, Jzon::Node &results)
+	{
+		bool success = true;
+		bool header = false;
+		for (size_t i = 0; i < numCases; ++i)
+		{
+			if (!isSelected(cases[i].name, cases[i].name, filter, only))
+				continue;
+
+			if (!header)
+			{
+				std::cerr << std::left << std::setw(14) << "case"
+				          << std::right << std::setw(10) << "MB"
+				          << std::setw(12) << "parse MB/s"
+				          << std::setw(14) << "Mnodes/s"
+				          << std::setw(14) << "parse allocs"
+				          << std::setw(12) << "write MB/s"
+				          << std::setw(14) << "write allocs"
+				          << std::setw(14) << "peak RSS kB" << std::endl;
+				header = true;
+			}
+
+			// Each case starts from the same seed, so that a retried case
+			// gets the same document without the cases before it
+			seed = initialSeed;
+			Result result;
+			if (!runIsolated(cases[i].name, cases[i].generate(), result))
+			{
+				success = false;
+				continue;
+			}
+
+			const double mb = result.bytes / (1024.0 * 1024.0);
+			const double parseMbs = mb / result.parseSeconds;
+			const double writeMbs = mb / result.writeSeconds;
+			const double nodesPerSecond = result.nodes / result.parseSeconds;
+
+			std::cerr << std::left << std::setw(14) << result.name << std::right << std::fixed << std::setprecision(2)
+			          << std::setw(10) << mb
+			          << std::setw(12) << parseMbs
+			          << std::setw(14) << nodesPerSecond / 1e6
+			          << std::setw(14) << result.parseAllocations
+			          << std::setw(12) << writeMbs
+			          << std::setw(14) << result.writeAllocations
+			          << std::setw(14) << result.peakRss << std::endl;
+
+			Jzon::Node entry = Jzon::object();
+			entry.add("case", result.name);
+			entry.add("bytes", static_cast<unsigned long long>(result.bytes));
+			entry.add("nodes", static_cast<unsigned long long>(result.nodes));
+			entry.add("parse_iterations", result.parseIterations);
+			entry.add("parse_mb_per_s", parseMbs);
+			entry.add("parse_nodes_per_s", static_cast<unsigned long long>(nodesPerSecond));
+			entry.add("parse_allocations", result.parseAllocations);
+			entry.add("write_iterations", result.writeIterations);
+			entry.add("write_mb_per_s", writeMbs);
+			entry.add("write_allocations", result.writeAllocations);
+			entry.add("peak_rss_kb", static_cast<long long>(result.peakRss));
+			results.add(entry);
+		}
+		return success;
+	}
+
+	void addMicroResult(const std::string &name, const MicroResult &result, Jzon::Node &results)
+	{
+		std::cerr << std::left << std::setw(24) << name << std::right << std::fixed << std::setprecision(2)
+		          << std::setw(14) << result.nsPerOp
+		          << std::setw(14) << result.allocationsPerOp << std::endl;
+
+		Jzon::Node entry = Jzon::object();
+		entry.add("case", name);
+		entry.add("size", static_cast<unsigned long long>(result.size));
+		entry.add("ns_per_op", result.nsPerOp);
+		entry.add("allocations_per_op", result.allocationsPerOp);
+		results.add(entry);
+	}
+
+	void runMicroSuite(const std::string &filter, const std::vector<std::string> &only, Jzon::Node &results)
+	{
+		std::cerr << std::left << std::setw(24) << "operation"
+		          << std::right << std::setw(14) << "ns/op"
+		          << std::setw(14) << "allocs/op" << std::endl;
+
+		Fixture fixture;
+		fixture.size = 0;
+
+		// Only measured once, retries are compared against the same machine speed
+		if (only.empty())
+		{
+			const MicroCase calibration = { "calibration", &opCalibrate, false };
+			MicroResult result;
+			runMicro(calibration, fixture, result);
+			addMicroResult("calibration", result, results);
+		}
+
+		for (size_t s = 0; s < numSizes; ++s)
+		{
+			bool prepared = false;
+			for (size_t i = 0; i < numMicroCases; ++i)
+			{
+				const MicroCase &microCase = microCases[i];
+				std::ostringstream name;
+				name << microCase.name << "/" << microSizes[s];
+				if ((!microCase.sized && s > 0) || !isSelected(name.str(), microCase.name, filter, only))
+					continue;
+
+				if (!prepared)
+				{
+					setupFixture(fixture, microSizes[s]);
+					prepared = true;
+				}
+
+				MicroResult result;
+				runMicro(microCase, fixture, result);
+				addMicroResult(name.str(), result, results);
+			}
+		}
+	}
+
+	Jzon::Node findCase(const Jzon::Node &results, const std::string &name)
+	{
+		for (Jzon::Node::const_iterator it = results.begin(); it != results.end(); ++it)
+		{
+			if ((*it).second.get("case").toString() == name)
+				return (*it).second;
+		}
+		return Jzon::Node();
+	}
+
+	// Compares results with a stored run and collects the cases that regressed
+	int checkBaseline(const Jzon::Node &results, const Jzon::Node &baseline, double threshold, bool report, std::vector<std::string> &failed)
+	{
+		// How much slower this machine currently is than when the baseline was made,
+		// a faster machine keeps the stored numbers rather than tightening them
+		double slowdown = 1.0;
+		const Jzon::Node calibration = findCase(results, "calibration");
+		const Jzon::Node baseCalibration = findCase(baseline, "calibration");
+		if (calibration.isValid() && baseCalibration.isValid())
+			slowdown = std::max(1.0, calibration.get("ns_per_op").toDouble() / baseCalibration.get("ns_per_op").toDouble());
+		if (report)
+			std::cerr << "Machine speed relative to baseline: " << 1.0 / slowdown << "x" << std::endl;
+
+		struct Metric
+		{
+			const char *name;
+			bool higherIsBetter;
+			bool exact; // A count rather than a timing, so the threshold doesn't apply
+			double slack; // Added to what counts may grow by
+		};
+		const Metric metrics[] = {
+			{ "parse_mb_per_s", true, false, 0.0 },
+			{ "write_mb_per_s", true, false, 0.0 },
+			{ "parse_allocations", false, true, 0.0 },
+			{ "write_allocations", false, true, 0.0 },
+			{ "ns_per_op", false, false, 0.0 },
+			// Averaged over a number of runs that depends on timing, so the
+			// amortized growth of containers moves it by a little
+			{ "allocations_per_op", false, true, 0.01 }
+		};
+		const size_t numMetrics = sizeof(metrics) / sizeof(metrics[0]);
+
+		int regressions = 0;
+		for (Jzon::Node::const_iterator it = results.begin(); it != results.end(); ++it)
+		{
+			const Jzon::Node &result = (*it).second;
+			const std::string name = result.get("case").toString();
+			if (name == "calibration")
+				continue;
+
+			const Jzon::Node base = findCase(baseline, name);
+			if (!base.isValid())
+			{
+				if (report)
+					std::cerr << "NEW        " << name << " (not in baseline)" << std::endl;
+				continue;
+			}
+
+			bool caseFailed = false;
+			for (size_t m = 0; m < numMetrics; ++m)
+			{
+				const Metric &metric = metrics[m];
+				if (!result.has(metric.name) || !base.has(metric.name))
+					continue;
+
+				const double value = result.get(metric.name).toDouble();
+				double expected = base.get(metric.name).toDouble();
+				if (!metric.exact)
+					expected = (metric.higherIsBetter ? expected / slowdown : expected * slowdown);
+				// Counts only allow for the rounding of the stored numbers
+				const double allowed = (metric.exact ? 1e-5 : threshold);
+				const bool regressed = (metric.higherIsBetter ? value < expected * (1.0 - allowed) : value > expected * (1.0 + allowed) + metric.slack);
+				if (regressed)
+				{
+					if (report)
+						std::cerr << "REGRESSION " << name << " " << metric.name << ": " << expected << " -> " << value << std::endl;
+					++regressions;
+					caseFailed = true;
+				}
+			}
+			if (caseFailed)
+				failed.push_back(name);
+		}
+		return regressions;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	std::string filter;
+	std::string baselineFile;
+	double threshold = 0.25;
+	bool macro = true;
+	bool micro = false;
+	for (int i = 1; i < argc; ++i)
+	{
+		const std::string arg = argv[i];
+		if (arg == "--micro")
+		{
+			macro = false;
+			micro = true;
+		}
+		else if (arg == "--all")
+		{
+			macro = true;
+			micro = true;
+		}
+		else if (arg == "--check" && i+1 < argc)
+		{
+			baselineFile = argv[++i];
+		}
+		else if (arg == "--threshold" && i+1 < argc)
+		{
+			threshold = std::atof(argv[++i]);
+		}
+		else
+		{
+			filter = arg;
+		}
+	}
+
+	Jzon::Node results = Jzon::array();
+	bool success = true;
+	const std::vector<std::string> all;
+
+	if (macro)
+		success = runMacroSuite(filter, all, results);
+	if (micro)
+		runMicroSuite(filter, all, results);
+
+	if (!baselineFile.empty())
+	{
+		Jzon::Parser parser;
+		const Jzon::Node baseline = parser.parseFile(baselineFile);
+		if (!baseline.isArray())
+		{
+			std::cerr << "Unable to read baseline " << baselineFile << ": " << parser.getError() << std::endl;
+			return 1;
+		}
+
+		// Timings are noisy, so regressed cases are measured again before failing
+		const int maxRetries = 4;
+		for (int attempt = 0; ; ++attempt)
+		{
+			std::vector<std::string> failed;
+			const bool last = (attempt == maxRetries);
+			const int regressions = checkBaseline(results, baseline, threshold, last, failed);
+			if (failed.empty() || last)
+			{
+				std::cerr << regressions << " regressions against " << baselineFile << " (threshold " << threshold * 100 << "%)" << std::endl;
+				if (regressions > 0)
+					success = false;
+				break;
+			}
+
+			std::cerr << "Measuring " << failed.size() << " regressed cases again" << std::endl;
+			Jzon::Node retried = Jzon::array();
+			if (macro)
+				runMacroSuite(filter, failed, retried);
+			if (micro)
+				runMicroSuite(filter, failed, retried);
+
+			Jzon::Node merged = Jzon::array();
+			for (Jzon::Node::iterator it = results.begin(); it != results.end(); ++it)
+			{
+				const Jzon::Node retry = findCase(retried, (*it).second.get("case").toString());
+				merged.add(retry.isValid() ? retry : (*it).second);
+			}
+			results = merged;
+		}
+	}
+
+	// Machine-readable results on stdout, the tables above go to stderr
+	Jzon::Writer writer(Jzon::StandardFormat);
+	writer.writeStream(results, std::cout);
+	std::cout << std::endl;
+
+	return (success ? 0 : 1);
+}
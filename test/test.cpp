@@ -1,19 +1,712 @@
 #include "../Jzon.h"
 
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+
+// Structs for the fields test, the macros must be used in the global namespace
+struct Inner
+{
+	std::string label;
+	bool enabled;
+};
+struct Record
+{
+	int small;
+	long long big;
+	size_t count;
+	long offset;
+	unsigned long mask;
+	double ratio;
+	std::vector<std::string> tags;
+	Inner inner;
+	int quoted;
+};
+
+JZON_FIELDS_BEGIN(Inner)
+	JZON_FIELD(label)
+	JZON_FIELD(enabled)
+JZON_FIELDS_END()
+
+JZON_FIELDS_BEGIN(Record)
+	JZON_FIELD(small)
+	JZON_FIELD(big)
+	JZON_FIELD(count)
+	JZON_FIELD(offset)
+	JZON_FIELD(mask)
+	JZON_FIELD(ratio)
+	JZON_FIELD(tags)
+	JZON_FIELD(inner)
+	JZON_FIELD_NAMED("say \"hi\"\n", quoted)
+JZON_FIELDS_END()
+
+namespace
+{
+	// Reports the first failed check of a feature test
+	#define CHECK(condition) \
+		if (!(condition)) \
+		{ \
+			std::cerr << "Line " << __LINE__ << ": " << #condition << std::endl; \
+			return false; \
+		}
+
+	std::string toString(size_t value)
+	{
+		std::ostringstream stream;
+		stream << value;
+		return stream.str();
+	}
+	std::string readFile(const std::string &filename)
+	{
+		std::ifstream file(filename.c_str(), std::ios::in | std::ios::binary);
+		std::ostringstream stream;
+		stream << file.rdbuf();
+		return stream.str();
+	}
+	void writeFile(const std::string &filename, const std::string &contents)
+	{
+		std::ofstream file(filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+		file << contents;
+	}
+	std::string write(const Jzon::Node &node, const Jzon::Format &format = Jzon::NoFormat)
+	{
+		std::string json;
+		Jzon::Writer writer(format);
+		writer.writeString(node, json);
+		return json;
+	}
+
+	bool sameElements(const Jzon::Node &array, const std::vector<int> &expected)
+	{
+		if (array.getCount() != expected.size())
+			return false;
+		for (size_t i = 0; i < expected.size(); ++i)
+		{
+			if (array.get(i).toInt() != expected[i])
+				return false;
+		}
+		return true;
+	}
+
+	// Removes and inserts in the middle of a large array, and checks that
+	// copies taken along the way keep their elements
+	bool testContainers()
+	{
+		Jzon::Node array = Jzon::array();
+		std::vector<int> expected;
+		for (int i = 0; i < 3000; ++i)
+		{
+			array.add(i);
+			expected.push_back(i);
+		}
+
+		Jzon::Node snapshot = array;
+		std::vector<int> snapshotExpected = expected;
+		unsigned int seed = 1;
+		for (int step = 0; step < 3000; ++step)
+		{
+			seed = seed * 1103515245 + 12345;
+			const size_t random = (seed >> 16) & 0x7fff;
+			if (step % 3 == 0)
+			{
+				const size_t index = random % expected.size();
+				array.remove(index);
+				expected.erase(expected.begin() + index);
+			}
+			else if (step % 3 == 1)
+			{
+				// Inserting goes through a patch
+				const size_t index = random % (expected.size() + 1);
+				Jzon::Node operation = Jzon::object();
+				operation.add("op", "add");
+				operation.add("path", "/"+toString(index));
+				operation.add("value", step);
+				Jzon::Node patch = Jzon::array();
+				patch.add(operation);
+				CHECK(Jzon::applyPatch(array, patch));
+				expected.insert(expected.begin() + index, step);
+			}
+			else
+			{
+				array.add(step);
+				expected.push_back(step);
+			}
+
+			if (step % 500 == 0)
+			{
+				CHECK(sameElements(snapshot, snapshotExpected));
+				snapshot = array;
+				snapshotExpected = expected;
+			}
+		}
+		CHECK(sameElements(array, expected));
+		CHECK(sameElements(snapshot, snapshotExpected));
+
+		std::vector<int> iterated;
+		const Jzon::Node &constArray = array;
+		for (Jzon::Node::const_iterator it = constArray.begin(); it != constArray.end(); ++it)
+			iterated.push_back((*it).second.toInt());
+		CHECK(iterated == expected);
+		return true;
+	}
+
+	bool testFields()
+	{
+		Record record;
+		record.small = -5;
+		record.big = -9000000000LL;
+		record.count = 7;
+		record.offset = -11;
+		record.mask = 13;
+		record.ratio = 0.5;
+		record.tags.push_back("a");
+		record.tags.push_back("b\"c");
+		record.inner.label = "x";
+		record.inner.enabled = true;
+		record.quoted = 3;
+
+		std::string json;
+		Jzon::encode(record, json);
+		CHECK(json == "{\"small\":-5,\"big\":-9000000000,\"count\":7,\"offset\":-11,\"mask\":13,\"ratio\":0.5,"
+		              "\"tags\":[\"a\",\"b\\\"c\"],\"inner\":{\"label\":\"x\",\"enabled\":true},\"say \\\"hi\\\"\\n\":3}");
+
+		// Written text parses, and reads back into the same values
+		Jzon::Parser parser;
+		CHECK(parser.parseString(json).isValid());
+		Record decoded = Record();
+		std::string error;
+		CHECK(Jzon::decode(json, decoded, &error));
+		CHECK(decoded.small == -5 && decoded.big == -9000000000LL && decoded.count == 7);
+		CHECK(decoded.offset == -11 && decoded.mask == 13 && decoded.ratio == 0.5);
+		CHECK(decoded.tags == record.tags && decoded.inner.label == "x" && decoded.inner.enabled);
+		CHECK(decoded.quoted == 3);
+
+		// Unknown members are skipped, and null keeps the value
+		CHECK(Jzon::decode("{\"unknown\":[1,{\"a\":2}],\"small\":null,\"count\":8}", decoded, &error));
+		CHECK(decoded.small == -5 && decoded.count == 8);
+
+		CHECK(!Jzon::decode("{\"small\":\"1\"}", decoded, &error));
+		CHECK(error == "Expected a number");
+		CHECK(!Jzon::decode("{\"small\":3000000000}", decoded, &error));
+		CHECK(error == "Number out of range");
+		CHECK(!Jzon::decode("{\"count\":-1}", decoded, &error));
+		CHECK(error == "Number out of range");
+		CHECK(!Jzon::decode("{\"big\":9223372036854775808}", decoded, &error));
+		CHECK(error == "Number out of range");
+		CHECK(Jzon::decode("{\"big\":-9223372036854775808}", decoded, &error));
+		CHECK(decoded.big == -9223372036854775807LL - 1);
+		CHECK(!Jzon::decode("{\"tags\":{}}", decoded, &error));
+		CHECK(error == "Expected an array");
+		CHECK(!Jzon::decode("{\"small\":1", decoded, &error));
+		CHECK(error == "Expected , or } in object");
+		CHECK(!Jzon::decode("{} {}", decoded, &error));
+		CHECK(error == "Expected end of input");
+		return true;
+	}
+
+	bool testSchema()
+	{
+		Jzon::Parser parser;
+		Jzon::Schema schema;
+		CHECK(schema.compile(parser.parseString(
+			"{\"type\": \"object\", \"required\": [\"id\"], \"additionalProperties\": false,"
+			" \"properties\": {"
+			"  \"id\": {\"type\": \"integer\", \"minimum\": 1},"
+			"  \"name\": {\"type\": \"string\", \"maxLength\": 5},"
+			"  \"tags\": {\"type\": \"array\", \"maxItems\": 2, \"items\": {\"enum\": [\"a\", \"b\"]}}}}")));
+
+		const char *valid[] = {
+			"{\"id\": 1}",
+			"{\"id\": 3, \"name\": \"abc\", \"tags\": [\"a\", \"b\"]}"
+		};
+		const char *invalid[] = {
+			"{\"name\": \"a\"}",
+			"{\"id\": 0}",
+			"{\"id\": 1.5}",
+			"{\"id\": 1, \"other\": 1}",
+			"{\"id\": 1, \"name\": \"too long\"}",
+			"{\"id\": 1, \"tags\": [\"c\"]}",
+			"{\"id\": 1, \"tags\": [\"a\", \"b\", \"a\"]}",
+			"[1]"
+		};
+		for (size_t i = 0; i < sizeof(valid) / sizeof(valid[0]); ++i)
+		{
+			CHECK(schema.validateString(valid[i]));
+			CHECK(schema.validate(parser.parseString(valid[i])));
+		}
+		for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); ++i)
+		{
+			std::string error;
+			CHECK(!schema.validateString(invalid[i], &error) && !error.empty());
+			CHECK(!schema.validate(parser.parseString(invalid[i])));
+		}
+
+		// The parser stops at the first violation
+		parser.setSchema(&schema);
+		CHECK(parser.parseString(valid[1]).isValid());
+		CHECK(!parser.parseString(invalid[1]).isValid() && !parser.getError().empty());
+		return true;
+	}
+
+	bool testPacked()
+	{
+		const char *arrays[] = {
+			"[1,-2,3000000000000,0]",
+			"[1.5,2,-0.25,0.001]",
+			"[1,2.5]"
+		};
+		Jzon::Parser parser;
+		for (size_t i = 0; i < sizeof(arrays) / sizeof(arrays[0]); ++i)
+		{
+			const Jzon::Node node = parser.parseString(arrays[i]);
+			CHECK(node.isPacked());
+			CHECK(write(node) == arrays[i]);
+
+			// Equal to the same array of separate nodes
+			Jzon::Node built = Jzon::array();
+			for (Jzon::Node::const_iterator it = node.begin(); it != node.end(); ++it)
+				built.add((*it).second);
+			CHECK(!built.isPacked() && built == node && built.hash() == node.hash());
+		}
+
+		Jzon::Node integers = parser.parseString("[1,-2,3000000000000]");
+		CHECK(integers.getIntegerData() != NULL && integers.getIntegerData()[2] == 3000000000000LL);
+		CHECK(integers.getDoubleData() == NULL);
+		CHECK(integers.toDoubleArray()[1] == -2.0);
+
+		// Numbers that wouldn't be written back the same aren't packed
+		CHECK(!parser.parseString("[1.0,2]").isPacked());
+		CHECK(!parser.parseString("[1e+100,2]").isPacked());
+		CHECK(!parser.parseString("[1,\"a\"]").isPacked());
+
+		// Reading elements by reference keeps the array packed, changing it doesn't
+		const Jzon::Node &constIntegers = integers;
+		const Jzon::Node &second = constIntegers.at(1);
+		CHECK(second.toInt() == -2 && constIntegers.at(0).toInt() == 1 && !constIntegers.at(3).isValid());
+		CHECK(integers.isPacked());
+		Jzon::Node copy = integers;
+		integers.add(4);
+		CHECK(!integers.isPacked() && write(integers) == "[1,-2,3000000000000,4]");
+		CHECK(copy.isPacked() && write(copy) == "[1,-2,3000000000000]");
+		return true;
+	}
+
+	bool testColumns()
+	{
+		Jzon::Columns columns;
+		const size_t id = columns.addColumn("/id", Jzon::Node::T_NUMBER);
+		const size_t name = columns.addColumn("/user/name", Jzon::Node::T_STRING);
+		const size_t ok = columns.addColumn("/ok", Jzon::Node::T_BOOL);
+
+		const std::string rows =
+			"[{\"id\": 1, \"user\": {\"name\": \"a\"}, \"ok\": true},"
+			" {\"user\": {\"name\": \"b\\n\"}, \"id\": 2, \"extra\": [1, 2]},"
+			" {\"id\": \"3\", \"ok\": false}]";
+		CHECK(columns.extractString(rows));
+		CHECK(columns.getRowCount() == 3);
+		CHECK(columns.getColumn(id).numbers[1] == 2 && columns.getColumn(id).nulls[2]);
+		CHECK(columns.getColumn(name).strings[1] == "b\n" && columns.getColumn(name).nulls[2]);
+		CHECK(columns.getColumn(ok).bools[0] && columns.getColumn(ok).nulls[1] && !columns.getColumn(ok).bools[2]);
+
+		// Extracting from nodes gives the same rows
+		Jzon::Columns fromNodes;
+		fromNodes.addColumn("/id", Jzon::Node::T_NUMBER);
+		fromNodes.addColumn("/user/name", Jzon::Node::T_STRING);
+		fromNodes.addColumn("/ok", Jzon::Node::T_BOOL);
+		Jzon::Parser parser;
+		CHECK(fromNodes.extract(parser.parseString(rows)));
+		for (size_t c = 0; c < columns.getColumnCount(); ++c)
+		{
+			CHECK(fromNodes.getColumn(c).numbers == columns.getColumn(c).numbers);
+			CHECK(fromNodes.getColumn(c).strings == columns.getColumn(c).strings);
+			CHECK(fromNodes.getColumn(c).bools == columns.getColumn(c).bools);
+			CHECK(fromNodes.getColumn(c).nulls == columns.getColumn(c).nulls);
+		}
+
+		// Failed extraction adds no rows, not even the complete ones before the error
+		CHECK(!columns.extractString("[{\"id\": 4}, {\"id\": "));
+		CHECK(!columns.getError().empty());
+		CHECK(!columns.extractString("[{\"id\": 4}] x"));
+		CHECK(columns.getRowCount() == 3);
+		for (size_t c = 0; c < columns.getColumnCount(); ++c)
+			CHECK(columns.getColumn(c).nulls.size() == 3);
+
+		columns.clearRows();
+		CHECK(columns.getRowCount() == 0 && columns.extractString("[{\"id\": 5}]") && columns.getColumn(id).numbers[0] == 5);
+		return true;
+	}
+
+	bool testReformat()
+	{
+		std::vector<std::string> documents;
+		for (int i = 1; i <= 3; ++i)
+			documents.push_back(readFile("spec/pass"+toString(i)+".json"));
+		documents.push_back("{ /* comment */ \"a\": [1, 2.5, {\"b\": null}, []], \"c\": {}, // line\n \"d\": \"e\\u0041\\n\"}");
+
+		const Jzon::Format formats[] = { Jzon::NoFormat, Jzon::StandardFormat };
+		Jzon::Parser parser;
+		for (size_t f = 0; f < 2; ++f)
+		{
+			Jzon::Writer writer(formats[f]);
+			for (size_t i = 0; i < documents.size(); ++i)
+			{
+				std::string output;
+				CHECK(writer.reformatString(documents[i], output));
+				CHECK(output == write(parser.parseString(documents[i]), formats[f]));
+			}
+		}
+
+		// Invalid text fails with the same error as parsing it
+		const char *invalid[] = { "", "[1,", "{\"a\":[1,2", "[1,]", "{1:2}", "[}", "]", "[tru]", "\"a\"" };
+		Jzon::Writer writer;
+		for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); ++i)
+		{
+			std::string output;
+			std::string error;
+			CHECK(!writer.reformatString(invalid[i], output, &error));
+			CHECK(!parser.parseString(invalid[i]).isValid());
+			CHECK(!error.empty() && error == parser.getError());
+		}
+		return true;
+	}
+
+	bool testParallelWrite()
+	{
+		// Large enough to be split into chunks at more than one level
+		Jzon::Parser parser;
+		Jzon::Node root = Jzon::object();
+		Jzon::Node records = Jzon::array();
+		for (int i = 0; i < 30000; ++i)
+		{
+			Jzon::Node record = Jzon::object();
+			record.add("id", i);
+			record.add("name", "record \"" + toString(i) + "\"");
+			record.add("values", parser.parseString("[1, 2, 3]"));
+			records.add(record);
+		}
+		root.add("records", records);
+		root.add("numbers", parser.parseString("[1.5, 2, 3, 4, 5, 6, 7, 8, 9]"));
+		root.add("empty", Jzon::object());
+
+		const Jzon::Format formats[] = { Jzon::NoFormat, Jzon::StandardFormat };
+		for (size_t f = 0; f < 2; ++f)
+		{
+			Jzon::Writer writer(formats[f]);
+			std::ostringstream serial;
+			writer.writeStream(root, serial);
+			for (unsigned int threads = 1; threads <= 4; threads *= 2)
+			{
+				std::ostringstream parallel;
+				writer.writeStreamParallel(root, parallel, threads);
+				CHECK(parallel.str() == serial.str());
+
+				std::vector<std::string> chunks;
+				writer.writeChunks(root, chunks, threads);
+				std::string joined;
+				for (size_t i = 0; i < chunks.size(); ++i)
+					joined += chunks[i];
+				CHECK(joined == serial.str());
+			}
+		}
+		return true;
+	}
+
+	bool testPatch()
+	{
+		Jzon::Parser parser;
+		const char *pairs[][2] = {
+			{ "{\"a\": 1, \"b\": [1, 2, 3], \"c\": {\"d\": \"e\"}}", "{\"a\": 2, \"b\": [1, 3, 4], \"c\": {\"f\": null}}" },
+			{ "[1, 2, 3, 4, 5]", "[5, 4, 3, 2, 1]" },
+			{ "[{\"id\": 1}, {\"id\": 2}]", "[{\"id\": 2}, {\"id\": 1}, {\"id\": 3}]" },
+			{ "{\"a/b\": 1, \"c~d\": 2}", "{\"a/b\": 3}" },
+			{ "{\"a\": [1, 2]}", "[]" }
+		};
+		for (size_t i = 0; i < sizeof(pairs) / sizeof(pairs[0]); ++i)
+		{
+			const Jzon::Node a = parser.parseString(pairs[i][0]);
+			const Jzon::Node b = parser.parseString(pairs[i][1]);
+			const Jzon::Node patch = Jzon::diff(a, b);
+			Jzon::Node patched = a;
+			std::string error;
+			CHECK(Jzon::applyPatch(patched, patch, &error));
+			CHECK(patched == b);
+			CHECK(a == parser.parseString(pairs[i][0]));
+		}
+
+		// Equal and shared nodes need no operations
+		const Jzon::Node a = parser.parseString(pairs[0][0]);
+		CHECK(Jzon::diff(a, a).getCount() == 0);
+		CHECK(Jzon::diff(a, parser.parseString(pairs[0][0])).getCount() == 0);
+
+		// A failing operation leaves the node as it was, even after others succeeded
+		const char *failing[] = {
+			"[{\"op\": \"replace\", \"path\": \"/a\", \"value\": 5}, {\"op\": \"remove\", \"path\": \"/missing\"}]",
+			"[{\"op\": \"add\", \"path\": \"/b/-\", \"value\": 4}, {\"op\": \"test\", \"path\": \"/a\", \"value\": 2}]",
+			"[{\"op\": \"remove\", \"path\": \"/b/0\"}, {\"op\": \"add\", \"path\": \"/b/9\", \"value\": 1}]",
+			"[{\"op\": \"move\", \"from\": \"/c\", \"path\": \"/c/d\"}]",
+			"[{\"op\": \"unknown\", \"path\": \"/a\"}]"
+		};
+		for (size_t i = 0; i < sizeof(failing) / sizeof(failing[0]); ++i)
+		{
+			Jzon::Node node = a;
+			std::string error;
+			CHECK(!Jzon::applyPatch(node, parser.parseString(failing[i]), &error));
+			CHECK(!error.empty());
+			CHECK(node == a && write(node) == write(a));
+		}
+		return true;
+	}
+
+	bool testTape()
+	{
+		const std::string json = "{\"name\": \"tape\", \"list\": [1, \"two\", [3], {\"four\": 4}], \"flag\": true, \"none\": null, \"name\": \"last\"}";
+		Jzon::Parser parser;
+		Jzon::TapeDocument document;
+		CHECK(parser.parseTapeString(json, document));
+
+		const Jzon::TapeView root = document.getRoot();
+		CHECK(root.isObject() && root.getCount() == 5);
+		CHECK(root.has("flag") && !root.has("missing") && !root.get("missing").isValid());
+		CHECK(root.get("name").toString() == "tape");
+		CHECK(root.get("flag").toBool() && root.get("none").isNull());
+
+		const Jzon::TapeView list = root.get("list");
+		CHECK(list.isArray() && list.getCount() == 4);
+		CHECK(list.get(0).toInt() == 1 && list.get(1).toString() == "two");
+		CHECK(list.get(2).get(0).toInt() == 3 && list.get(3).get("four").toInt() == 4);
+		CHECK(!list.get(4).isValid());
+
+		std::vector<std::string> names;
+		for (Jzon::TapeView::const_iterator it = root.begin(); it != root.end(); ++it)
+			names.push_back(it.getName());
+		CHECK(names.size() == 5 && names[1] == "list" && names[4] == "name");
+
+		CHECK(document.toNode() == parser.parseString(json));
+		CHECK(list.toNode() == parser.parseString(json).get("list"));
+
+		CHECK(!parser.parseTapeString("{\"a\": [1, 2}", document) && !parser.getError().empty());
+		CHECK(!document.getRoot().isValid());
+		return true;
+	}
+
+	bool checkCache(Jzon::FileCache &cache, const std::string &path)
+	{
+		writeFile(path, "{\"version\": 1}");
+		Jzon::Node first = cache.parseFile(path);
+		CHECK(first.get("version").toInt() == 1);
+		CHECK(cache.getStats().misses == 1);
+
+		Jzon::Node again = cache.parseFile(path);
+		CHECK(again.sharesData(first) && cache.getStats().hits == 1);
+
+		// A change of size is noticed even within the same second
+		writeFile(path, "{\"version\": 22}");
+		Jzon::Node changed = cache.parseFile(path);
+		CHECK(changed.get("version").toInt() == 22);
+		CHECK(cache.getStats().misses == 2 && cache.getStats().changes == 1);
+
+		writeFile(path, "{\"version\": ");
+		CHECK(!cache.parseFile(path).isValid());
+		CHECK(cache.getError() == "Unexpected end of input");
+		writeFile(path, "{\"version\": 333}");
+		CHECK(cache.parseFile(path).get("version").toInt() == 333);
+
+		std::remove(path.c_str());
+		CHECK(!cache.parseFile(path).isValid() && !cache.getError().empty());
+		return true;
+	}
+
+	bool testFileCache()
+	{
+		const std::string path = "feature_cache.tmp.json";
+		Jzon::FileCache polling;
+		const bool polled = checkCache(polling, path);
+		std::remove(path.c_str());
+		CHECK(polled);
+
+		// Where inotify is available, changes are noticed through it
+		Jzon::FileCache watching;
+		if (watching.enableWatching())
+		{
+			const bool watched = checkCache(watching, path);
+			std::remove(path.c_str());
+			CHECK(watched);
+		}
+		return true;
+	}
+
+	bool testLimits()
+	{
+		struct LimitCase
+		{
+			size_t Jzon::ParseLimits::*limit;
+			size_t value;
+			const char *accepted;
+			const char *rejected;
+		};
+		const LimitCase cases[] = {
+			{ &Jzon::ParseLimits::maxBytes, 10, "[1,2,3,4]", "[1,2,3,4,5]" },
+			{ &Jzon::ParseLimits::maxDepth, 2, "[[1],{\"a\":2}]", "[[[1]]]" },
+			{ &Jzon::ParseLimits::maxNodes, 5, "[1,[2,3]]", "[1,[2,3,4]]" },
+			{ &Jzon::ParseLimits::maxStringLength, 3, "{\"abc\":\"def\"}", "{\"abcd\":1}" },
+			{ &Jzon::ParseLimits::maxStringLength, 3, "[\"\\u0041bc\"]", "[\"abcd\"]" },
+			{ &Jzon::ParseLimits::maxContainerSize, 2, "[[1,2],{\"a\":1,\"b\":2}]", "{\"a\":1,\"b\":2,\"c\":3}" }
+		};
+		for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i)
+		{
+			Jzon::ParseLimits limits;
+			limits.*cases[i].limit = cases[i].value;
+			Jzon::Parser parser;
+			parser.setLimits(limits);
+
+			CHECK(parser.parseString(cases[i].accepted).isValid());
+			CHECK(!parser.parseString(cases[i].rejected).isValid() && !parser.getError().empty());
+
+			// The tape parser keeps to the same limits
+			Jzon::TapeDocument document;
+			CHECK(parser.parseTapeString(cases[i].accepted, document));
+			CHECK(!parser.parseTapeString(cases[i].rejected, document));
+		}
+		return true;
+	}
+
+	bool testIndexed()
+	{
+		const std::string path = "feature_index.tmp.json";
+		const std::string indexPath = "feature_index.tmp.idx";
+		const std::string json = "{\"a\": [1, {\"b\": \"c\"}], \"d\\\"e\": \"f\\n\", \"g\": null, \"h\": 0, \"i\": {}}";
+		writeFile(path, json);
+
+		Jzon::FileIndex index;
+		const bool built = index.build(path);
+		Jzon::Parser parser;
+		const Jzon::Node whole = parser.parseString(json);
+		bool matches = built && index.getType() == Jzon::Node::T_OBJECT && index.getCount() == 5;
+		for (Jzon::Node::const_iterator it = whole.begin(); it != whole.end(); ++it)
+		{
+			matches = matches && parser.parseIndexed(path, index, (*it).first) == (*it).second;
+		}
+		const bool missing = !parser.parseIndexed(path, index, "missing").isValid();
+
+		Jzon::FileIndex loaded;
+		const bool saved = index.save(indexPath) && loaded.load(indexPath);
+		const bool sameIndex = saved && parser.parseIndexed(path, loaded, 1).toString() == "f\n";
+
+		// A different file under the same name is noticed
+		writeFile(path, "[1, 2]");
+		const bool stale = !parser.parseIndexed(path, index, "a").isValid() && !parser.getError().empty();
+
+		Jzon::FileIndex arrayIndex;
+		const bool arrayBuilt = arrayIndex.build(path) && arrayIndex.getType() == Jzon::Node::T_ARRAY;
+		const bool element = arrayBuilt && parser.parseIndexed(path, arrayIndex, 1).toInt() == 2;
+
+		std::remove(path.c_str());
+		std::remove(indexPath.c_str());
+		CHECK(built);
+		CHECK(matches);
+		CHECK(missing);
+		CHECK(saved && sameIndex);
+		CHECK(stale);
+		CHECK(arrayBuilt && element);
+		return true;
+	}
+
+	bool testSplice()
+	{
+		const std::string json =
+			"{ /* first */ \"a\\\"b\": [1, {\"x\": \"y\"}], // second\n"
+			"  \"c/d\": 2, \"e~f\": true, \"g\": \"}]\" }";
+
+		size_t begin = 0;
+		size_t end = 0;
+		CHECK(Jzon::locate(json.data(), json.size(), "/a\"b/1/x", begin, end));
+		CHECK(json.substr(begin, end-begin) == "\"y\"");
+		CHECK(Jzon::locate(json.data(), json.size(), "/c~1d", begin, end));
+		CHECK(json.substr(begin, end-begin) == "2");
+		CHECK(Jzon::locate(json.data(), json.size(), "/e~0f", begin, end));
+		CHECK(json.substr(begin, end-begin) == "true");
+		CHECK(Jzon::locate(json.data(), json.size(), "/g", begin, end));
+		CHECK(json.substr(begin, end-begin) == "\"}]\"");
+		CHECK(Jzon::locate(json.data(), json.size(), "", begin, end));
+		CHECK(begin == 0 && end == json.size());
+
+		std::string error;
+		CHECK(!Jzon::locate(json.data(), json.size(), "/a\"b/2", begin, end, &error) && !error.empty());
+		CHECK(!Jzon::locate(json.data(), json.size(), "/missing", begin, end, &error) && !error.empty());
+		CHECK(!Jzon::locate(json.data(), json.size(), "a", begin, end, &error) && !error.empty());
+
+		// Only the value changes, comments and the rest of the text stay
+		std::string spliced = json;
+		Jzon::Node value = Jzon::object();
+		value.add("new", "value\n");
+		CHECK(Jzon::splice(spliced, "/a\"b/1", value));
+		CHECK(spliced == "{ /* first */ \"a\\\"b\": [1, {\"new\":\"value\\n\"}], // second\n"
+		                 "  \"c/d\": 2, \"e~f\": true, \"g\": \"}]\" }");
+
+		// In place, values are padded to keep the length, and must fit
+		std::vector<char> buffer(json.begin(), json.end());
+		CHECK(Jzon::spliceInPlace(&buffer[0], buffer.size(), "/e~0f", Jzon::Node(0)));
+		CHECK(std::string(buffer.begin(), buffer.end()) == "{ /* first */ \"a\\\"b\": [1, {\"x\": \"y\"}], // second\n"
+		                                                    "  \"c/d\": 2, \"e~f\": 0   , \"g\": \"}]\" }");
+		CHECK(Jzon::spliceInPlace(&buffer[0], buffer.size(), "/c~1d", Jzon::Node(5)));
+		CHECK(std::string(buffer.begin(), buffer.end()) == "{ /* first */ \"a\\\"b\": [1, {\"x\": \"y\"}], // second\n"
+		                                                    "  \"c/d\": 5, \"e~f\": 0   , \"g\": \"}]\" }");
+		const std::string before(buffer.begin(), buffer.end());
+		CHECK(!Jzon::spliceInPlace(&buffer[0], buffer.size(), "/c~1d", Jzon::Node("far too long"), &error) && !error.empty());
+		CHECK(std::string(buffer.begin(), buffer.end()) == before);
+
+		Jzon::Parser parser;
+		CHECK(parser.parseString(before).get("c/d").toInt() == 5);
+		return true;
+	}
+
+	struct Feature
+	{
+		const char *name;
+		bool (*test)();
+	};
+	const Feature features[] = {
+		{ "containers", &testContainers },
+		{ "fields", &testFields },
+		{ "schema", &testSchema },
+		{ "packed", &testPacked },
+		{ "columns", &testColumns },
+		{ "reformat", &testReformat },
+		{ "parallel_write", &testParallelWrite },
+		{ "patch", &testPatch },
+		{ "tape", &testTape },
+		{ "file_cache", &testFileCache },
+		{ "limits", &testLimits },
+		{ "indexed", &testIndexed },
+		{ "splice", &testSplice }
+	};
+}
 
 int main(int argc, char **argv)
 {
+	if (argc == 3 && std::strcmp(argv[1], "--feature") == 0)
+	{
+		for (size_t i = 0; i < sizeof(features) / sizeof(features[0]); ++i)
+		{
+			if (std::strcmp(argv[2], features[i].name) == 0)
+				return (features[i].test() ? 0 : 1);
+		}
+		std::cerr << "Unknown feature: " << argv[2] << std::endl;
+		return 1;
+	}
 	if (argc != 2)
 	{
-		std::cerr << "Expecting 1 argument - a file name" << std::endl;
+		std::cerr << "Expecting 1 argument - a file name, or --feature and a feature name" << std::endl;
 		return 1;
 	}
 
 	std::string filename(argv[1]);
-	
+
 	Jzon::Parser parser;
-	
+
 	Jzon::Node node = parser.parseFile(filename);
 	if (!node.isValid())
 	{
@@ -1,5 +1,6 @@
 #!/bin/bash
 prog=$1
+persistent=$2
 outfile="test.out"
 FAIL='\E[1;31m'"FAIL"'\E[0m'
 PASS='\E[1;32m'"PASS"'\E[0m'
@@ -40,6 +41,22 @@ run_failure() {
 	fi
 }
 
+# Runs one of the checks built into the test program, optionally with another build of it
+run_feature() {
+	echo "Running feature test ${1}"
+	success=true
+	${2:-$prog} --feature $1 2>$outfile || success=false
+	if $success; then
+		((passes++))
+		echo -e $PASS" Feature works!"
+	else
+		((fails++))
+		echo -en $FAIL" "
+		cat $outfile
+		failure=true
+	fi
+}
+
 touch $outfile
 
 failure=false
@@ -52,6 +69,15 @@ for i in $(seq 1 33); do
 	run_failure $i
 done
 
+for feature in containers fields schema packed columns reformat parallel_write patch tape file_cache limits indexed splice; do
+	run_feature $feature
+done
+
+# The containers are PersistentLists in this build
+if [ -n "$persistent" ]; then
+	run_feature containers $persistent
+fi
+
 rm $outfile
 
 echo
@@ -0,0 +1,83 @@
+// Builds sidecar indexes for large JSON files and reads single elements
+// through them, see Jzon::FileIndex.
+//
+//   index build data.json           writes data.json.index
+//   index get data.json 12345       prints element 12345 of the outermost array
+//   index get data.json name        prints the member called name
+
+#include "../Jzon.h"
+
+#include <iostream>
+#include <sstream>
+
+namespace
+{
+	int usage()
+	{
+		std::cerr << "Usage: index build <file> [index]" << std::endl;
+		std::cerr << "       index get <file> <element or name> [index]" << std::endl;
+		return 2;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 3)
+		return usage();
+
+	const std::string command = argv[1];
+	const std::string filename = argv[2];
+	Jzon::FileIndex index;
+
+	if (command == "build" && argc <= 4)
+	{
+		const std::string indexname = (argc == 4 ? argv[3] : filename+".index");
+		if (!index.build(filename))
+		{
+			std::cerr << index.getError() << std::endl;
+			return 1;
+		}
+		if (!index.save(indexname))
+		{
+			std::cerr << "Unable to write file: " << indexname << std::endl;
+			return 1;
+		}
+		std::cerr << index.getCount() << (index.getType() == Jzon::Node::T_OBJECT ? " members" : " elements") << " in " << indexname << std::endl;
+		return 0;
+	}
+	else if (command == "get" && (argc == 4 || argc == 5))
+	{
+		const std::string indexname = (argc == 5 ? argv[4] : filename+".index");
+		if (!index.load(indexname))
+		{
+			std::cerr << index.getError() << std::endl;
+			return 1;
+		}
+
+		Jzon::Parser parser;
+		Jzon::Node node;
+		if (index.getType() == Jzon::Node::T_OBJECT)
+		{
+			node = parser.parseIndexed(filename, index, argv[3]);
+		}
+		else
+		{
+			std::istringstream number(argv[3]);
+			size_t element;
+			if (!(number >> element) || !number.eof())
+				return usage();
+			node = parser.parseIndexed(filename, index, element);
+		}
+		if (!node.isValid())
+		{
+			std::cerr << parser.getError() << std::endl;
+			return 1;
+		}
+
+		Jzon::Writer writer(Jzon::StandardFormat);
+		writer.writeStream(node, std::cout);
+		std::cout << std::endl;
+		return 0;
+	}
+	return usage();
+}